@@ -1,77 +1,1258 @@
 /* atm_system.c
    ATM Withdrawal System (console)
-   - Accounts stored in accounts.txt
-   - ATM inventory stored in atm.txt
-   - Transactions appended to transactions.txt
-   Compile: gcc atm_system.c -o atm_system
+   - Accounts stored in accounts.bin, a checksummed binary snapshot that is
+     mmapped at startup and updated record by record; accounts.txt is only
+     imported when no usable snapshot exists and written on admin export.
+     PINs are kept as salted PBKDF2-HMAC-SHA256 hashes; logins are
+     throttled per account and per terminal (client address).
+   - ATM inventory stored in atm.txt (one note count per cassette)
+   - Transactions appended as varint-coded binary records to segmented
+     logs (transactions.NNNNNN.log) through a buffered writer drained by a
+     background flusher thread; sealed segments are block-compressed to
+     .lgz, and a per-account position index is kept in transactions.idx.
+     Sealed segments also get column copies with zone maps
+     (transactions.NNNNNN.col), mmapped by the admin history query.
+   - Withdrawals committed first to journal.txt (write-ahead, group commit)
+     and replayed on startup if the process died before a checkpoint; in
+     fleet mode the journal is sharded by account number (journal.k.txt).
+     Checkpoints into the snapshot files run on a background thread.
+   - Fleet inventories (--fleet) stored in fleet.txt, one machine per line
+   Modes:
+     atm_system                        interactive console
+     atm_system --serve PORT [THREADS] multi-session server (Linux), one
+                                       epoll event loop per thread
+     atm_system --fleet PORT [MACHINES [THREADS]]
+                                       server for a fleet of machines over
+                                       one shared, sharded account store
+     atm_system --batch FILE|-         replay a command stream (see runBatch)
+     atm_system --bench [ACCOUNTS]     hot-path benchmarks on synthetic books
+                                       of 1K up to ACCOUNTS (default 1M); fails
+                                       if a pooled server session allocates
+                                       (when counted, see -DATM_ALLOC_COUNT)
+     atm_system --dump-log             print the transaction log as text
+     atm_system --refill-plan [HOURS]  forecast when each machine's cassettes
+                                       run out and the notes to load now for
+                                       a next visit HOURS away (default 24)
+     atm_system --loadgen serve|fleet|batch [CUSTOMERS [REQUESTS [MIX]]]
+                                       soak test: thousands of simulated
+                                       customers against a child server or
+                                       batch replay in a fresh loadgen.*
+                                       directory, then checks that cash out
+                                       of the cassettes and balances agree
+                                       with the transaction log (the
+                                       directory is kept only if they don't)
+   Compile: gcc atm_system.c -o atm_system -pthread
+            (-DATM_NO_PROBES compiles the latency probes out,
+             -DATM_TXN_NO_COMPRESS keeps sealed segments uncompressed,
+             -DATM_ALLOC_COUNT counts heap allocations in --bench on glibc)
 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#define ftruncate _chsize
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if !defined(ATM_NO_PROBES) && (defined(__x86_64__) || defined(__i386__))
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define PROBE_USE_TSC 1
+#endif
+#ifdef _MSC_VER
+#define ATM_THREAD_LOCAL __declspec(thread)
+#else
+#define ATM_THREAD_LOCAL __thread
+#endif
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#endif
 
 #define ACC_FILE "accounts.txt"
+#define ACC_SNAPSHOT_FILE "accounts.bin"
 #define ATM_FILE "atm.txt"
-#define TXN_FILE "transactions.txt"
+#define TXN_TEXT_FILE "transactions.txt"  // text log of older builds, imported once
+#define TXN_LOG_PREFIX "transactions"      // segments transactions.NNNNNN.log/.lgz
+#define JNL_PREFIX "journal"               // shard 0 is journal.txt, shard k journal.k.txt
+#define FLEET_FILE "fleet.txt"
 
 #define MAX_NAME_LEN 50
-#define MAX_ACCOUNTS 1000
 #define MAX_LINE 256
 #define ADMIN_PIN 999999  // default admin PIN (change as needed)
 
+/* Cassette configuration, fixed at build time so every per-denomination loop
+   has a constant trip count and is unrolled by the compiler. Values must be
+   in descending order. Other machines are built with e.g.
+   -DATM_DENOMINATIONS="{2000,500,200,100,50,10}"
+   -DATM_DEFAULT_COUNTS="{10,20,50,100,100,100}" */
+#ifndef ATM_DENOMINATIONS
+#define ATM_DENOMINATIONS {2000, 500, 200, 100}
+#ifndef ATM_DEFAULT_COUNTS
+#define ATM_DEFAULT_COUNTS {10, 20, 50, 100}
+#endif
+#endif
+#ifndef ATM_DEFAULT_COUNTS
+#define ATM_DEFAULT_COUNTS {0}
+#endif
+#define ATM_NUM_DENOMS ((int)(sizeof((const int[])ATM_DENOMINATIONS) / sizeof(int)))
+#define ATM_MAX_DENOMS 8
+_Static_assert(ATM_NUM_DENOMS >= 1 && ATM_NUM_DENOMS <= ATM_MAX_DENOMS,
+               "ATM_DENOMINATIONS must list 1 to ATM_MAX_DENOMS denominations");
+
+/* Dispense policy used at startup (see dispensePolicies) */
+#ifndef ATM_DISPENSE_STRATEGY
+#define ATM_DISPENSE_STRATEGY DISPENSE_GREEDY
+#endif
+/* Share of the smaller cassettes held back by the reserve-small policy */
+#define SMALL_NOTE_RESERVE_PCT 25
+/* Number of recent withdrawals replayed when scoring dispense policies */
+#define DISPENSE_REPLAY_WINDOW 1000
+/* Highest amount, in units of the smallest note, that the dispensable-amount
+   cache covers (larger ones are left to the dispense policy) */
+#define DISPENSE_CACHE_UNITS 2048
+
+/* Account store: records live in chunks of ACCOUNT_CHUNK that never move,
+   found through a fixed directory of ACCOUNT_MAX_CHUNKS entries (32M
+   accounts) */
+#define ACCOUNT_CHUNK_SHIFT 10
+#define ACCOUNT_CHUNK (1 << ACCOUNT_CHUNK_SHIFT)
+#define ACCOUNT_MAX_CHUNKS 32768
+#define ACCOUNT_CHUNK_ALIGN 64 // hot chunks start on a cache line
+
+/* Account records are guarded by a fixed pool of mutexes; account index i
+   uses accountLocks[i % ACCOUNT_LOCK_STRIPES] */
+#define ACCOUNT_LOCK_STRIPES 256
+/* Attempts to re-plan a withdrawal whose notes were taken by another
+   session between planning and reserving */
+#define WITHDRAW_RETRIES 3
+
+/* Batch replay: journal records are fsynced in groups of BATCH_SYNC_INTERVAL
+   commands and snapshot files are checkpointed every BATCH_CHECKPOINT_INTERVAL
+   journaled withdrawals */
+#define BATCH_SYNC_INTERVAL 8192
+#define BATCH_CHECKPOINT_INTERVAL 100000
+
+/* Benchmarks (--bench) write only to these scratch files */
+#define BENCH_ACC_FILE "bench_accounts.txt"
+#define BENCH_SNAPSHOT_FILE "bench_accounts.bin"
+#define BENCH_TXN_PREFIX "bench_transactions"
+#define BENCH_JNL_PREFIX "bench_journal"
+#define BENCH_ATM_FILE "bench_atm.txt"
+#define BENCH_SESSION_CYCLES 20000
+#define BENCH_SESSION_WARMUP 2000 // cycles run before the session row, so buffers reach their size
+#define BENCH_DEFAULT_ACCOUNTS 1000000
+#define BENCH_SAMPLES 200000   // timed operations per benchmark row
+#define BENCH_LOGIN_KEYS 64    // accounts given hashed PINs for the login rows
+
+/* Latency metrics: label used in the Prometheus dump and the file the
+   admin menu writes it to */
+#ifndef ATM_MACHINE_ID
+#define ATM_MACHINE_ID "atm-1"
+#endif
+#define METRICS_FILE "metrics.prom"
+/* Probe histograms: 4 log-linear buckets per power of two ticks */
+#define PROBE_BUCKETS 256
+
+/* Server mode limits */
+#define SESSION_IN_MAX 512     // longest request line accepted
+#define SESSION_OUT_INLINE 2048 // reply bytes buffered in the session itself
+#define SESSION_POOL_BLOCK 64  // sessions preallocated per event loop at a time
+#define SERVER_MAX_EVENTS 64   // epoll events handled per wakeup
+
+/* Load generator (--loadgen): each run gets a fresh directory with a
+   synthetic book of LOADGEN_ACCOUNTS_PER_CUSTOMER accounts per customer
+   and full cassettes, removed after a run that passes and kept for
+   inspection after one that fails */
+#define LOADGEN_DIR_TEMPLATE "loadgen.XXXXXX"
+#define LOADGEN_DEFAULT_CUSTOMERS 1000
+#define LOADGEN_DEFAULT_REQUESTS 200000
+#define LOADGEN_DEFAULT_MIX "40:40:15:5"  // inquiry:withdraw:history:wrong-PIN
+#define LOADGEN_ACCOUNTS_PER_CUSTOMER 4
+#define LOADGEN_FIRST_ACCOUNT 5000000
+#define LOADGEN_BALANCE 250000   // rupees per account
+#define LOADGEN_NOTES 200000     // notes per cassette and machine
+#define LOADGEN_MACHINES 16      // fleet target
+#define LOADGEN_VISIT_OPS 6      // most requests in one visit after LOGIN
+#define LOADGEN_HISTORY_ROWS 10
+#define LOADGEN_SEED 0x5eed1e55ULL
+#define LOADGEN_START_SECONDS 10 // wait for the server to listen
+#define LOADGEN_STALL_SECONDS 30 // give up when no reply arrives for this long
+#define LOADGEN_IN_MAX 4096
+#define LOADGEN_CONNECT_BURST 64 // terminals connecting at once, so the accept queue keeps up
+
+/* Money is held as whole paise; text forms are rupees.paise */
+#define PAISE 100
+#define RUPEES(r) ((Money)(r) * PAISE)
+#define MONEY_BUF 24           // formatMoney output, sign and NUL included
+
+/* Text export records are padded to a fixed width (the trailing '\n' is
+   included in the length): number, PIN, balance, name, attempts, locked.
+   A hashed PIN adds ACC_CRED_LEN at the end of the line. */
+#define ACC_RECORD_LEN 96
+#define ACC_CRED_TAG "pbkdf2-sha256$"
+#define ACC_CRED_LEN (1 + 14 + 10 + 1 + 2 * PIN_SALT_LEN + 1 + 2 * PIN_HASH_LEN) // at most
+
+/* Binary account snapshot (accounts.bin):
+   [header, ACC_SNAPSHOT_HEADER bytes][Account x capacity]
+   [AccountProfile x capacity][PinHash x capacity][uint32 checksum x capacity]
+   Records are the in-memory layouts and capacity is a whole number of store
+   chunks, so the file is mapped and its chunks used in place. The spare
+   capacity lets new accounts be appended without moving the later tables.
+   Any change to Account, AccountProfile or PinHash must bump
+   ACC_SNAPSHOT_VERSION. Versions 1 and 2 stored AccountRecordV2 records,
+   version 3 the split layout with a double balance (AccountRecordV3),
+   version 4 today's hot records and profiles without credentials, version 5
+   the credential inside the profile (AccountProfileV5); all are converted
+   on load. */
+#define ACC_SNAPSHOT_MAGIC "ATMSNAP"
+#define ACC_SNAPSHOT_VERSION 6
+#define ACC_SNAPSHOT_HEADER 64
+#define ACC_SNAPSHOT_ENDIAN 0x01020304u
+
+/* Withdrawals are made durable in the journal; accounts.bin and atm.txt are
+   only brought up to date (and the journal truncated) at a checkpoint, which
+   happens on logout, refill, exit or after this many journaled records. */
+#define JNL_CHECKPOINT_INTERVAL 64
+/* Checkpoints run on a background thread; a withdrawal only waits for one
+   when this many intervals' worth of records are still unapplied */
+#define JNL_BACKLOG_FACTOR 8
+/* Startup replay of the journal runs on up to JNL_REPLAY_MAX_THREADS
+   workers, each taking the records of a share of the accounts, with at
+   least JNL_REPLAY_MIN_PER_THREAD records per worker */
+#define JNL_REPLAY_MAX_THREADS 16
+#define JNL_REPLAY_MIN_PER_THREAD 4096
+
+/* Journal shards: one by default, FLEET_JOURNAL_SHARDS in fleet mode, where
+   the checkpoint interval is scaled by the shard count (a checkpoint resets
+   and fsyncs every shard). Recovery reads every shard file present,
+   whatever the count it ran with. */
+#define JNL_MAX_SHARDS 64
+#define FLEET_JOURNAL_SHARDS 16
+#define FLEET_DEFAULT_MACHINES 16
+#define FLEET_MAX_MACHINES 100000
+
+/* Longest text form of a log record, newline and NUL included */
+#define TXN_LINE_MAX 256
+#define TIME_BUF 32            // formatTime output
+
+/* Binary transaction log (see "Transaction log" below). The active segment
+   is sealed at TXN_SEGMENT_BYTES or TXN_SEGMENT_SECONDS of age; sealed
+   segments are block-compressed unless built with -DATM_TXN_NO_COMPRESS. */
+#define TXN_LOG_MAGIC "ATMTXNL"
+#define TXN_LOG_VERSION 1
+#define TXN_SEGMENT_HEADER 32
+#define TXN_SEGMENT_COMPRESSED 1u
+#define TXN_SEGMENT_BYTES (64L * 1024 * 1024)
+#define TXN_SEGMENT_SECONDS (24 * 60 * 60)
+#define TXN_BLOCK_SIZE (16 * 1024)
+#define TXN_READ_BUF (2 * TXN_BLOCK_SIZE)
+#define TXN_RECORD_MAX 96      // longest encoded record (a withdrawal with its notes)
+#define TXN_PAYLOAD_MIN 5      // type and four one-byte varints
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_BOUND(n) ((n) + (n) / 2 + 16)
+
+/* History store (see "History store"): columns of each sealed segment in
+   transactions.NNNNNN.col, with a zone map every HIST_BLOCK_ROWS records */
+#define HIST_STORE_MAGIC "ATMTXNC"
+#define HIST_STORE_VERSION 1
+#define HIST_STORE_HEADER 64
+#define HIST_BLOCK_ROWS 4096
+
+/* Transaction log writer: records are staged in a ring buffer and written
+   out when it holds TXN_FLUSH_THRESHOLD bytes or every TXN_FLUSH_INTERVAL_MS */
+#define TXN_RING_SIZE (64 * 1024)
+#define TXN_FLUSH_THRESHOLD (16 * 1024)
+#define TXN_FLUSH_INTERVAL_MS 200
+
+/* With inquiry summaries on, balance inquiries are tallied per account and
+   logged as one TXN_INQUIRY_SUMMARY record when the session ends, before
+   the account's next withdrawal or history read, or at the latest after
+   this many seconds */
+#define INQUIRY_SUMMARY_SECONDS 60
+
+/* Admin reports: books smaller than REPORT_MIN_PER_THREAD per worker are
+   scanned on fewer threads; listings print REPORT_PAGE_SIZE rows a page */
+#define REPORT_MAX_THREADS 16
+#define REPORT_MIN_PER_THREAD 65536
+#define REPORT_PAGE_SIZE 50
+#define REPORT_BUCKETS 8       // balance ranges: under ₹1, one per power of ten, then ₹10 lakh and up
+
+/* PINs are stored as PBKDF2-HMAC-SHA256 over PIN_HASH_ITERATIONS rounds
+   with a PIN_SALT_LEN byte salt. Logins that need a hash draw on a token
+   bucket per account (LOGIN_ACCOUNT_BURST, one more every
+   LOGIN_ACCOUNT_REFILL seconds); failed ones also draw on one per
+   terminal (LOGIN_TERMINAL_BURST, every LOGIN_TERMINAL_REFILL seconds). */
+#define PIN_HASH_ITERATIONS 10000
+#define PIN_SALT_LEN 16
+#define PIN_HASH_LEN 32
+#define LOGIN_ACCOUNT_BURST 5
+#define LOGIN_ACCOUNT_REFILL 60
+#define LOGIN_TERMINAL_BURST 10
+#define LOGIN_TERMINAL_REFILL 6
+#define LOGIN_TERMINAL_SLOTS 4096
+#define LOGIN_TERMINAL_LOCAL 0u   // the console and batch input
+
+/* Refill forecasts learn from the last FORECAST_HISTORY_DAYS of withdrawals
+   and project at most FORECAST_HORIZON_HOURS ahead. A plan covers the
+   demand until the next visit (FORECAST_CYCLE_HOURS unless given) plus
+   safety stock, in bundles of FORECAST_BUNDLE notes. */
+#define FORECAST_HISTORY_DAYS 28
+#define FORECAST_HORIZON_HOURS (14 * 24)
+#define FORECAST_CYCLE_HOURS 24
+#define FORECAST_SAFETY_Z 1.65 // one-sided: about 95% of visits cover the demand
+#define FORECAST_BUNDLE 100
+
+typedef long long Money; // amount in paise
+
+/* Hot part of an account: everything login, lockout, withdrawal and the
+   index probe read, packed into 32 bytes (two records per cache line) */
 typedef struct {
     int accountNumber;
-    int pin;
-    double balance;
-    char name[MAX_NAME_LEN];
+    int pin;    // PIN not hashed yet (see PinHash), else 0
+    Money balance;
     int loginAttempts; // consecutive failed attempts
     int locked; // 0 = unlocked, 1 = locked
+    int slot;   // index of this record in the account store
 } Account;
 
+/* Hashed PIN. iterations is 0 for an account whose PIN has not been
+   hashed yet (imported from text or an older snapshot); the PIN is then in
+   Account.pin until the first login hashes it. check is FNV-1a of the other
+   fields seeded with the slot, like a record checksum, but kept apart so
+   the hash can be rewritten without touching the hot record. */
+typedef struct {
+    unsigned int iterations;
+    unsigned char salt[PIN_SALT_LEN];
+    unsigned char hash[PIN_HASH_LEN];
+    unsigned int check;
+} PinHash;
+
+/* Cold part, kept in a separate store: only greetings, listings and
+   exports read it. The name does not change after the account is created.
+   The credential has a store of its own (see credAt) so that listings
+   walk names packed back to back. */
+typedef struct {
+    char name[MAX_NAME_LEN];
+} AccountProfile;
+
+/* Profile of snapshot version 5 (versions 3 and 4 had today's) */
+typedef struct {
+    char name[MAX_NAME_LEN];
+    PinHash cred;
+} AccountProfileV5;
+
+/* Combined record of snapshot versions 1 and 2 (slot was padding in 1) */
+typedef struct {
+    int accountNumber;
+    int pin;
+    double balance;
+    char name[MAX_NAME_LEN];
+    int loginAttempts;
+    int locked;
+    int slot;
+} AccountRecordV2;
+
+/* Hot record of snapshot version 3 */
 typedef struct {
-    int note2000;
-    int note500;
-    int note200;
-    int note100;
+    int accountNumber;
+    int pin;
+    double balance;
+    int loginAttempts;
+    int locked;
+    int slot;
+} AccountRecordV3;
+
+typedef struct {
+    char magic[8];              // ACC_SNAPSHOT_MAGIC
+    unsigned int version;       // ACC_SNAPSHOT_VERSION
+    unsigned int recordSize;    // sizeof(Account) of the writer
+    unsigned int endian;        // ACC_SNAPSHOT_ENDIAN as written
+    unsigned int count;         // records in use
+    unsigned int capacity;      // record slots in the file
+    unsigned int headerCheck;   // checksum of the fields above
+    unsigned char reserved[ACC_SNAPSHOT_HEADER - 32];
+} AccountSnapshotHeader;
+
+/* Note count per cassette; notes[k] holds notes of value denomValue[k] */
+typedef struct {
+    int notes[ATM_MAX_DENOMS];
 } ATM;
 
+/* Dispensable amounts of one machine, kept in step with its inventory, up
+   to DISPENSE_CACHE_UNITS. ways[a] is the number of note combinations
+   making a units (modulo 2^64): the coefficients of
+   prod_k (1 + x^d_k + ... + x^(c_k d_k)), c_k notes of d_k units. Each
+   factor is (1 - x^((c_k+1) d_k)) / (1 - x^d_k), so a change of c_k divides
+   by one binomial and multiplies by another, O(units) each.
+   bits[] has bit a set when ways[a] != 0. */
+typedef struct {
+    int notes[ATM_MAX_DENOMS];   // inventory the counts are for
+    int units;                   // highest amount covered, in denomUnit
+    unsigned long long *ways;
+    unsigned long long *bits;
+    int exact;                   // no count can have wrapped to 0
+    int valid;
+    pthread_mutex_t lock;
+} DispenseCache;
+
+/* One machine of a fleet; the inventory comes first so an ATM pointer into
+   the fleet leads back to its machine (see atmMachineId) */
+typedef struct {
+    ATM atm;
+    int id;
+    DispenseCache avail;  // amounts the machine can dispense
+} Machine;
+
+/* One journal file and its group-commit state; see "Write-ahead journal" */
+typedef struct {
+    FILE *fp;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *pending;
+    size_t pendingLen, pendingCap;
+    unsigned long nextSeq;     // last sequence number handed out
+    unsigned long durableSeq;  // last sequence number known on disk
+    int syncing;               // a leader is writing/fsyncing
+    int failed;                // sticky I/O error
+    int *dirty;                // account indices changed since checkpoint
+    int dirtyCount, dirtyCap;
+    unsigned char *dirtyMark;  // dirtyMark[idx] set if idx is in dirty
+    int dirtyMarkCap;
+} JournalShard;
+
+/* Kinds of transaction log record (stored as one byte) */
+typedef enum {
+    TXN_WITHDRAWAL = 1,
+    TXN_BALANCE_INQUIRY = 2,
+    TXN_INQUIRY_SUMMARY = 3  // `count` inquiries from firstTime to time
+} TxnType;
+#define TXN_TYPE_LAST TXN_INQUIRY_SUMMARY
+
 typedef struct {
     int accountNumber;
-    char type[32];
-    double amount;
-    double remainingBalance;
-    char datetime[64];
+    TxnType type;
+    Money amount;
+    Money remainingBalance;
+    long long time;          // seconds since the epoch
+    int count;               // TXN_INQUIRY_SUMMARY only
+    long long firstTime;     // TXN_INQUIRY_SUMMARY only
+    int machine;             // TXN_WITHDRAWAL: machine that paid out, -1 if not recorded
+    int notes[ATM_MAX_DENOMS]; // TXN_WITHDRAWAL: notes per cassette, when machine is known
 } Transaction;
 
-/* Global arrays (simple approach) */
-Account *accounts = NULL;
+/* Balance inquiries on one account not yet logged (see inquiryTally) */
+typedef struct {
+    int slot;
+    int count;
+    Money balance;
+    long long firstTime, lastTime;
+} InquiryTally;
+
+/* Place of a record in the transaction log: segment number and byte
+   offset within the segment's uncompressed stream */
+typedef long long TxnPos;
+#define TXN_POS_SHIFT 40
+#define TXN_POS(seg, off) (((TxnPos)(seg) << TXN_POS_SHIFT) | (TxnPos)(off))
+#define TXN_POS_SEGMENT(p) ((int)((p) >> TXN_POS_SHIFT))
+#define TXN_POS_OFFSET(p) ((long)((p) & ((1LL << TXN_POS_SHIFT) - 1)))
+
+typedef struct {
+    Transaction *items;
+    TxnPos *positions;  // log position of each item
+    int count, cap;
+} TxnList;
+
+typedef struct {
+    char magic[8];           // TXN_LOG_MAGIC
+    unsigned int version;
+    unsigned int segment;
+    long long baseTime;      // record times are stored relative to this
+    unsigned int flags;      // TXN_SEGMENT_COMPRESSED
+    unsigned char reserved[TXN_SEGMENT_HEADER - 28];
+} TxnSegmentHeader;
+
+/* Block of a compressed segment; a zero rawLen ends the blocks */
+typedef struct {
+    unsigned int rawOffset;  // segment offset of the block's first record
+    unsigned int rawLen;
+    unsigned int storedLen;  // equal to rawLen if stored uncompressed
+    unsigned int check;      // FNV-1a of the raw bytes
+} TxnBlockHeader;
+
+/* Sequential/positioned reader over one segment (see txnReaderOpen) */
+typedef struct {
+    FILE *fp;
+    int compressed;
+    long long baseTime;
+    unsigned char *buf;      // window of decoded bytes
+    size_t len, pos;         // bytes in the window and read position
+    size_t chunk;            // next raw read size
+    long bufOffset;          // segment offset of buf[0]
+    int eof;
+    unsigned char *packed;   // compressed block being read
+    unsigned int *table, tableCount; // block table, loaded on first seek
+} TxnReader;
+
+typedef struct {
+    char magic[8];           // HIST_STORE_MAGIC
+    unsigned int version;
+    unsigned int segment;
+    long long baseTime;      // of the segment the columns were built from
+    unsigned int rows;
+    unsigned int blocks;
+    unsigned int check;      // blockChecksum of the fields above and the zone map
+    unsigned char reserved[HIST_STORE_HEADER - 36];
+} HistStoreHeader;
+
+/* Zone map entry: bounds of one block of HIST_BLOCK_ROWS rows */
+typedef struct {
+    long long minTime, maxTime;
+    Money maxAmount;
+    int minAccount, maxAccount;
+    unsigned int types;      // bit 1 << type for each kind present
+    unsigned int reserved;
+} HistZone;
+
+/* Columns of one log segment, row r being its r-th record. Either mapped
+   from its column file (read only) or built in memory from the segment
+   itself (the active one, or a sealed one whose file is not built yet).
+   Notes per cassette are not kept; offset leads to the full record. */
+#define HIST_COLUMN_FIELDS(X) X(time) X(amount) X(balance) X(account) X(offset) X(machine) X(count) X(span) X(type)
+typedef struct {
+    int segment;
+    int state;               // histStore: 0 not opened yet, 1 open, -1 no usable file
+    unsigned int rows, blocks, cap;
+    HistZone *zones;
+    HistZone all;            // bounds of the whole segment
+    long long *time;
+    Money *amount;
+    Money *balance;
+    int *account;
+    unsigned int *offset;    // segment offset of the record, ascending
+    int *machine;            // -1 if not recorded
+    int *count;              // inquiries in a TXN_INQUIRY_SUMMARY, else 1
+    unsigned int *span;      // time - firstTime of a TXN_INQUIRY_SUMMARY
+    unsigned char *type;
+    void *map;               // column file, NULL if built in memory
+    size_t mapLen;
+    long end;                // in memory: segment offset read up to
+} HistSegment;
+
+/* Records a history query selects; every bound is inclusive */
+typedef struct {
+    int accountFrom, accountTo;
+    unsigned int types;      // bit 1 << type for each kind wanted
+    Money minAmount;
+    long long fromTime, toTime;
+} HistoryQuery;
+
+/* What a history query had to read */
+typedef struct {
+    long segments, segmentsSkipped, segmentsFromLog;
+    long blocks, blocksRead;
+    long lookups;            // records found through the account index
+} HistoryQueryStats;
+
+/* Outcome of a core operation (shared by the console and the server) */
+typedef enum {
+    ATM_OK = 0,
+    ATM_ERR_NO_ACCOUNT,
+    ATM_ERR_LOCKED,
+    ATM_ERR_BAD_PIN,
+    ATM_ERR_NOW_LOCKED,
+    ATM_ERR_THROTTLED,
+    ATM_ERR_BAD_AMOUNT,
+    ATM_ERR_NOT_MULTIPLE,
+    ATM_ERR_FUNDS,
+    ATM_ERR_ATM_CASH,
+    ATM_ERR_DENOMS,
+    ATM_ERR_IO
+} AtmStatus;
+
+/* Dispense policies. Each fills notes[] with a breakdown of the amount that
+   the inventory can cover and returns 0, or returns -1 if it cannot. */
+typedef enum {
+    DISPENSE_GREEDY = 0,     // highest notes first (drains big cassettes first)
+    DISPENSE_MIN_NOTES,      // fewest notes in total
+    DISPENSE_BALANCED,       // every cassette loses the same share of its notes
+    DISPENSE_RESERVE_SMALL,  // keep part of the small notes for odd amounts
+    DISPENSE_STRATEGY_COUNT
+} DispenseStrategy;
+
+/* Exact-change table for one ATM inventory, in units of denomUnit.
+   use[k][a] is the fewest notes of denomination k needed to make a units
+   with denominations 0..k, or -1 if that is impossible. Walking k from the
+   smallest denomination back to 0 recovers a breakdown in O(denominations). */
+typedef struct {
+    ATM inventory;   // inventory the table was built for
+    int units;       // highest amount covered (ATM total / denomUnit)
+    int *use[ATM_MAX_DENOMS];
+    int valid;
+    pthread_mutex_t lock;
+} DispenseTable;
+
+/* Columnar copy of the account book for reports, taken consistently with
+   withdrawals (see reportSnapshotTake). flags: REPORT_LOCKED, REPORT_FAILING. */
+typedef struct {
+    int count;
+    int *accountNumber;
+    Money *balance;
+    unsigned char *flags;
+} ReportSnapshot;
+
+#define REPORT_LOCKED 1u
+#define REPORT_FAILING 2u      // failed PIN attempts not yet cleared
+
+/* Aggregates over a range of a ReportSnapshot. Bucket b holds balances
+   from reportBounds[b - 1] up to (excluding) reportBounds[b]. */
+typedef struct {
+    long long accounts, locked, failing;
+    Money total, min, max;
+    long long bucketCount[REPORT_BUCKETS];
+    Money bucketTotal[REPORT_BUCKETS];
+} ReportTotals;
+
+/* Depletion model of one machine (see "Refill forecast") */
+typedef struct {
+    float notes[24][ATM_MAX_DENOMS];  // paid out in each local hour of the day over the window
+    double daySum[ATM_MAX_DENOMS];    // notes per day, over the days closed so far
+    double daySq[ATM_MAX_DENOMS];     //   and their squares
+    double dayOpen[ATM_MAX_DENOMS];   // notes of the day being tallied
+    long long day;                    // its number, -1 before the first
+    long withdrawals;
+} RefillModel;
+
+/* Models of the standalone machine and then each fleet machine, the
+   window they were learnt over and the local hours ahead of `now` */
+typedef struct {
+    RefillModel *models;
+    int count;
+    long long from, first, now;       // window start, its first record, end
+    double exposure[24];              // hours the window spent in each hour of the day
+    double hours;                     // first record to now, at least 1
+    double firstStep;                 // hours left in the current one
+    unsigned char hourAt[FORECAST_HORIZON_HOURS]; // hour of the day of each step ahead
+    long long hourStart, hourDay;     // forecastHour cache
+    int hour;
+} RefillForecast;
+
+/* Forecast and suggested load of one machine */
+typedef struct {
+    int machine;
+    long withdrawals;
+    double historyHours;
+    double emptyIn[ATM_MAX_DENOMS];   // hours until each cassette runs out, -1 beyond the horizon
+    double firstEmpty;                // the earliest of those, -1 if none
+    double demand[ATM_MAX_DENOMS];    // notes expected to be paid out before the next visit
+    int load[ATM_MAX_DENOMS];         // notes to add now
+} RefillPlan;
+
+/* SHA-256 in progress, and an HMAC-SHA256 key as the two states after
+   absorbing key ^ ipad and key ^ opad */
+typedef struct {
+    unsigned int state[8];
+    unsigned char block[64];
+    size_t used;
+    unsigned long long total;
+} Sha256;
+
+typedef struct {
+    Sha256 inner, outer;
+} HmacSha256;
+
+/* Login state of an account that is never persisted (see loginStateOf) */
+typedef struct {
+    unsigned long long pinTag;  // loginTag of the PIN last verified, 0 if none
+    double refilled;            // when tokens was last topped up
+    float tokens;               // PIN hashes the account may still start
+    int credDirty;              // credential changed since the snapshot was written
+} LoginState;
+
+/* Failure budget of one terminal (a client address, or the console) */
+typedef struct {
+    unsigned int terminal;
+    float tokens;
+    double refilled;
+} LoginTerminal;
+
+/* Most recent withdrawal amounts (a ring of DISPENSE_REPLAY_WINDOW) */
+typedef struct {
+    int *amounts;
+    int count, next;
+} ReplayWindow;
+
+/* Log positions of one account's records, oldest first */
+typedef struct {
+    int accountNumber;
+    TxnPos *positions;
+    int count;
+    int cap;
+} HistoryList;
+
+/* Timed stages of a session (see PROBE_START / PROBE_END) */
+typedef enum {
+    PROBE_PIN_CHECK,       // verifyLogin
+    PROBE_DISPENSE,        // denomination search in planWithdrawal
+    PROBE_JOURNAL,         // journal commit (fsync) of a withdrawal
+    PROBE_TXN_LOG,         // transaction log append
+    PROBE_CHECKPOINT,      // snapshot files rewritten by a checkpoint
+    PROBE_WITHDRAWAL,      // whole commitWithdrawal
+    PROBE_STAGE_COUNT
+} ProbeStage;
+
+typedef struct {
+    unsigned long count;
+    unsigned long long ticks;               // sum over all samples
+    unsigned long buckets[PROBE_BUCKETS];
+} ProbeHistogram;
+
+/* How far a transaction log record is pushed before recordTransaction returns */
+typedef enum {
+    TXN_FLUSH_LAZY = 0,  // left in the ring buffer for the background flusher
+    TXN_FLUSH_RECORD,    // written through to the OS (survives a process crash)
+    TXN_FLUSH_SYNC       // written and fsynced (survives a power loss)
+} TxnDurability;
+
+/* Account store. Record i is accountChunks[i / ACCOUNT_CHUNK][i % ACCOUNT_CHUNK]
+   (see accountAt), its profile and credential the same position in
+   profileChunks and credChunks. Chunks
+   are only added, never moved or freed while running, so an Account * held
+   by a session stays valid while the book grows. The first
+   accountChunksMapped chunks of each live inside accountsMap (the snapshot
+   mapped at startup); the rest are heap allocations. Appends are
+   serialised by accountStoreLock. */
+Account *accountChunks[ACCOUNT_MAX_CHUNKS];
+AccountProfile *profileChunks[ACCOUNT_MAX_CHUNKS];
+PinHash *credChunks[ACCOUNT_MAX_CHUNKS];
+int accountChunkCount = 0;
+int accountChunksMapped = 0;
 int accountCount = 0;
-ATM atm = {0,0,0,0};
+pthread_mutex_t accountStoreLock = PTHREAD_MUTEX_INITIALIZER;
+void *accountsMap = NULL;
+size_t accountsMapLen = 0;
+/* Shape of the snapshot file as last written (see snapshotWriteRecords) */
+unsigned int snapshotCapacity = 0;
+unsigned int snapshotCount = 0;
+
+static inline Account *accountAt(int idx) {
+    return &accountChunks[idx >> ACCOUNT_CHUNK_SHIFT][idx & (ACCOUNT_CHUNK - 1)];
+}
+
+static inline AccountProfile *profileAt(int idx) {
+    return &profileChunks[idx >> ACCOUNT_CHUNK_SHIFT][idx & (ACCOUNT_CHUNK - 1)];
+}
+
+static inline const char *accountName(int idx) {
+    return profileAt(idx)->name;
+}
+
+static inline PinHash *credAt(int idx) {
+    return &credChunks[idx >> ACCOUNT_CHUNK_SHIFT][idx & (ACCOUNT_CHUNK - 1)];
+}
+static const int denomValue[] = ATM_DENOMINATIONS;
+static const int denomDefault[ATM_MAX_DENOMS] = ATM_DEFAULT_COUNTS;
+int denomUnit = 100;  // gcd of the denominations, set by checkDenominations
+ATM atm = {{0}};
+
+/* Write-ahead journal state, split into shards by account number (one
+   journal file each; see jnlShardOf). Committers append to their shard's
+   pending buffer and one of them (the leader) writes and fsyncs everything
+   pending at once, so concurrent commits share a single fsync and shards
+   sync in parallel. */
+JournalShard jnlShards[JNL_MAX_SHARDS];
+int jnlShardCount = 1;            // fixed before startSystem
+int jnlSinceCheckpoint = 0;       // records since the last checkpoint (atomic)
+int jnlCheckpointInterval = JNL_CHECKPOINT_INTERVAL;
+int jnlDeferSync = 0;             // batch mode: commit returns before fsync
+unsigned long jnlRecordSeq = 0;   // label for W records (atomic)
+/* Files the journal and its checkpoints write (the benchmarks point them
+   at their own) */
+const char *jnlPrefix = JNL_PREFIX;
+const char *jnlSnapshotFile = ACC_SNAPSHOT_FILE;
+const char *jnlAtmFile = ATM_FILE;
+/* Checkpoint generation, written to the inventory files and to each shard's
+   C record. Inventories are deltas in the journal, so a shard whose
+   generation is older than an inventory file's was already folded into it
+   (the checkpoint stopped between saving the file and resetting the shard). */
+unsigned long jnlCheckpointGen = 0;
+unsigned long atmSavedGen = 0;    // generation atm.txt was loaded with
+unsigned long fleetSavedGen = 0;  // generation fleet.txt was loaded with
+
+/* Background checkpointer (see checkpointerMain), protected by
+   checkpointerLock. Sessions request checkpoints and go on; the journal
+   records not yet checkpointed are the queue, bounded by back-pressure in
+   awaitCheckpointBacklog. */
+pthread_t checkpointer;
+pthread_mutex_t checkpointerLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpointerWake = PTHREAD_COND_INITIALIZER;  // request or stop
+pthread_cond_t checkpointerDone = PTHREAD_COND_INITIALIZER;  // a checkpoint finished
+int checkpointerRunning = 0;
+int checkpointerStopping = 0;
+int checkpointRequested = 0;
+unsigned long checkpointsDone = 0;
+unsigned long checkpointStalls = 0;  // withdrawals held back by the backlog
+
+/* Fleet mode (--fleet): many machines in one process, each with its own
+   inventory, sorted by id. Elsewhere the fleet is empty and the single
+   `atm` above is machine 0. */
+Machine *fleet = NULL;
+int fleetCount = 0;
+
+/* Concurrency control for sessions running in parallel:
+   - accountLocks: one striped mutex per account, held while an account's
+     fields are read or changed
+   - ATM note counts are only changed with compare-and-swap (reserveNotes),
+     so withdrawals on different accounts contend only on the cassettes
+   - checkpointLock: withdrawals hold it shared from reservation until
+     their journal record is written; a checkpoint holds it exclusively so
+     the snapshot files never contain half of an in-flight withdrawal
+   Lock order: checkpointLock -> accountLocks -> journal shard lock -> inquiryLock
+   -> txnLock */
+pthread_mutex_t accountLocks[ACCOUNT_LOCK_STRIPES];
+pthread_rwlock_t checkpointLock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Transaction log writer state (see recordTransaction) */
+FILE *txnFp = NULL;
+pthread_mutex_t txnLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t txnCond = PTHREAD_COND_INITIALIZER;
+pthread_t txnFlusher;
+char txnRing[TXN_RING_SIZE];
+size_t txnHead = 0;   // next write position in txnRing
+size_t txnLen = 0;    // bytes buffered and not yet written
+int txnStop = 0;
+int txnFlusherRunning = 0;
+long txnLogEnd = 0;   // active segment size including buffered bytes
+const char *txnLogPrefix = TXN_LOG_PREFIX;
+int txnFirstSegment = 1;
+int txnSegment = 0;   // active segment (0 until the log is open)
+long long txnSegmentBase = 0;
+int txnCompressNext = 1; // lowest segment the flusher may still compress
+long txnRotateBytes = TXN_SEGMENT_BYTES;
+long long txnRotateSeconds = TXN_SEGMENT_SECONDS;
+#ifdef ATM_TXN_NO_COMPRESS
+int txnCompressSealed = 0;
+#else
+int txnCompressSealed = 1;
+#endif
+
+/* Exact-change tables, rebuilt lazily whenever the inventory one was
+   computed for no longer matches. An inventory maps to a table by hash, so
+   the machines of a fleet mostly keep their own table and lock rather than
+   rebuilding one shared table for each other. */
+#define DISPENSE_TABLES 16
+DispenseTable dispenseTables[DISPENSE_TABLES];
+pthread_once_t dispenseTablesOnce = PTHREAD_ONCE_INIT;
+
+/* Dispensable amounts of the standalone machine (fleet machines keep
+   theirs in Machine.avail) */
+DispenseCache atmAvail = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Per-account history index (protected by txnLock). histSlots is an
+   open-addressing table over histLists, storing list index + 1. */
+HistoryList *histLists = NULL;
+int histListCount = 0, histListCap = 0;
+int *histSlots = NULL;
+int histSlotCap = 0;
+
+/* History store: segment s is histStore[s - txnFirstSegment], its column
+   file mapped on first use; histTail holds the columns of the active
+   segment, extended by each query with what was logged since. Queries are
+   serialised by histStoreLock; mappings stay until txnLogClose. The
+   flusher builds the files of sealed segments from histStoreNext up. */
+HistSegment *histStore = NULL;
+int histStoreCap = 0;
+HistSegment histTail;
+pthread_mutex_t histStoreLock = PTHREAD_MUTEX_INITIALIZER;
+int histStoreNext = 1;
+int histStoreSealed = 1;  // build column files in the flusher
+
+/* Login state kept only in memory, chunked like the account store and
+   allocated per chunk on first use (loginChunkLock). An entry is guarded by
+   its account's lock. Terminals hash into loginTerminals (loginTerminalLock).
+   Counters are atomic. */
+LoginState *loginChunks[ACCOUNT_MAX_CHUNKS];
+pthread_mutex_t loginChunkLock = PTHREAD_MUTEX_INITIALIZER;
+LoginTerminal loginTerminals[LOGIN_TERMINAL_SLOTS];
+pthread_mutex_t loginTerminalLock = PTHREAD_MUTEX_INITIALIZER;
+HmacSha256 loginTagKey;               // random per process
+pthread_once_t loginTagOnce = PTHREAD_ONCE_INIT;
+unsigned long loginHashes = 0, loginCacheHits = 0, loginThrottled = 0;
+
+/* Worker threads for admin reports (0 = one per core) */
+int reportThreadLimit = 0;
+
+/* Durability per record kind. Withdrawals can stay lazy: their journal
+   record is the commit point, recovery re-appends any the log lost from
+   the journal, and a checkpoint fsyncs the log (txnLogSync) before it
+   truncates the journal. */
+TxnDurability txnInquiryDurability = TXN_FLUSH_LAZY;
+TxnDurability txnWithdrawalDurability = TXN_FLUSH_LAZY;
+
+/* Pending balance inquiries (protected by inquiryLock). inquiryOf maps an
+   account slot to its tally index + 1. Build with -DATM_INQUIRY_LOG_EACH
+   to log every inquiry as its own record by default. */
+#ifdef ATM_INQUIRY_LOG_EACH
+int inquirySummaries = 0;
+#else
+int inquirySummaries = 1;
+#endif
+pthread_mutex_t inquiryLock = PTHREAD_MUTEX_INITIALIZER;
+InquiryTally *inquiryTallies = NULL;
+int inquiryTallyCount = 0, inquiryTallyCap = 0;
+int *inquiryOf = NULL;
+int inquiryOfCap = 0;
+long long inquiryFlushDue = 0;
+
+/* Account number -> array index lookup table.
+   Open addressing with linear probing; each slot holds (index + 1) so that
+   0 marks an empty slot. Capacity is always a power of two and kept at most
+   half full so probe sequences stay short. */
+int *accIndexSlots = NULL;
+int accIndexCap = 0;
+int accIndexUsed = 0;
 
 /* Utility prototypes */
 int loadAccounts(const char *filename);
 int saveAccounts(const char *filename);
+int snapshotLoad(const char *filename);
+int snapshotSave(const char *filename);
+int snapshotWriteRecords(const char *filename, const int *indices, const Account *records, const PinHash *creds,
+                         int n);
+int snapshotSaveRecord(const char *filename, int idx);
+void releaseAccounts(void);
+int accountCreate(const Account *init, const char *name);
 int loadATM(const char *filename);
 int saveATM(const char *filename);
-void recordTransaction(const Transaction *t);
-void showTransactionHistory(int accNum);
+int loadFleet(const char *filename, int machines);
+int saveFleet(const char *filename);
+Machine *findMachine(int id);
+ATM *machineInventory(int id);
+int atmMachineId(const ATM *inv);
+void recordTransaction(const Transaction *t, TxnDurability durability);
+int txnLogOpen(void);
+void txnLogFlush(void);
+int txnLogSync(void);
+void txnLogClose(void);
+TxnPos txnLogPosition(void);
+TxnPos txnLogScan(TxnPos from, int (*fn)(const Transaction *t, TxnPos pos, void *ctx), void *ctx);
+TxnPos txnLogSince(long long when);
+int dumpTransactionLog(FILE *out);
+const char *txnTypeName(TxnType type);
+const char *formatTime(long long when, char *buf);
+void showTransactionHistory(int accNum, int lastN);
+int historyIndexFirstSegment(void);
+TxnPos historyIndexLoad(void);
+int historyIndexSave(void);
+int historyIndexAdd(int accNum, TxnPos position);
+int historyIndexReserve(int accNum, int extra);
+HistoryList *historyIndexFind(int accNum);
+void historyIndexFree(void);
+int historyStoreBuild(int segment);
+int historyQuery(const HistoryQuery *q, int (*fn)(const Transaction *t, TxnPos pos, void *ctx), void *ctx,
+                 HistoryQueryStats *stats);
+void historyStoreFree(void);
+void printHistoryQuery(void);
+int journalOpen(void);
+int journalCommit(int accNum, const char *record);
+int journalSync(void);
+int journalWithdrawal(int idx, const Transaction *t, const int taken[], int machine);
+int journalLoginState(int idx);
+int journalCheckpoint(void);
+int startCheckpointer(void);
+void stopCheckpointer(void);
+void requestCheckpoint(void);
+void awaitCheckpointBacklog(void);
+int recoverJournal(void);
+int journalCoversAccounts(int *accNums, int n);
+void journalClose(void);
 int findAccountIndex(int accNum);
+void initAccountLocks(void);
+void lockAccount(int idx);
+void unlockAccount(int idx);
+void snapshotATM(const ATM *atm, ATM *out);
+int reserveNotes(ATM *atm, const int notes[]);
+void releaseNotes(ATM *atm, const int notes[]);
+int buildAccountIndex(void);
+int indexInsertAccount(int idx);
+void indexRemoveAccount(int accNum);
 int safeScanInt(const char *prompt);
-double safeScanDouble(const char *prompt);
+Money safeScanMoney(const char *prompt);
+const char *formatMoney(Money m, char *buf);
 void flushStdin(void);
 void printLine(void);
 
 /* Core prototypes */
+const char *atmStatusText(AtmStatus st);
+AtmStatus verifyLogin(int accNum, int pin, unsigned int terminal, int *accIndex, int *attemptsLeft);
+int accountSetPin(int idx, int pin);
+void recordBalanceInquiry(const Account *acc);
+void inquiryFlushAccount(int idx);
+void inquiryFlushAll(void);
+AtmStatus planWithdrawal(const Account *acc, const ATM *atm, int amount, int notes[]);
+AtmStatus commitWithdrawal(Account *acc, ATM *atm, int amount, const int notes[]);
+AtmStatus performWithdrawal(Account *acc, ATM *atm, int amount, int notes[]);
+void endSession(int accIndex);
+int forEachTransaction(int accNum, int lastN, void (*fn)(const Transaction *t, void *ctx), void *ctx);
 int login(int *accIndex);
 void showBalance(const Account *acc);
 void withdrawCash(Account *acc, ATM *atm);
-void calculateDenominations(int amount, ATM *atm, int *n2000, int *n500, int *n200, int *n100, int *possible);
+int checkDenominations(void);
+long atmTotalCash(const ATM *atm);
+void calculateDenominations(int amount, const ATM *atm, int notes[], int *possible);
+int solveExactChange(int amount, const ATM *atm, int notes[]);
+int solveMinNotes(int amount, const int limits[], int notes[]);
+int canDispense(const ATM *atm, const ATM *inv, int amount);
+int nearestDispensable(const ATM *atm, const ATM *inv, int amount, int limit, int *below, int *above);
+void dispenseCacheFree(DispenseCache *c);
+void evaluateDispenseStrategies(void);
+int reportSnapshotTake(ReportSnapshot *snap, double *pausedMs);
+void reportSnapshotFree(ReportSnapshot *snap);
+void reportTotals(const ReportSnapshot *snap, ReportTotals *out);
+void reportListAccounts(const ReportSnapshot *snap, unsigned char flagMask);
+void printAccountReport(void);
+int refillForecastBuild(RefillForecast *f, long long now);
+void refillForecastFree(RefillForecast *f);
+void refillPlanFor(const RefillForecast *f, int index, const ATM *inv, double cycleHours, RefillPlan *out);
+int refillPlanMachine(int id, const ATM *inv, double cycleHours, RefillPlan *out);
+void printRefillPlan(const RefillPlan *p, const ATM *inv, double cycleHours);
+int runRefillPlan(double cycleHours);
 void adminMenu();
+int startSystem(void);
+void shutdownSystem(void);
+void runConsole(void);
+int runBatch(const char *path);
+int runBenchmarks(int maxAccounts);
+void probeInit(void);
+void printLatencyReport(void);
+int writeMetrics(FILE *fp);
+double monotonicSeconds(void);
+int runServer(int port, int threads);
+int runLoadGenerator(const char *target, int customers, long requests, const char *mix);
 
 /* --------------------- Implementation --------------------- */
 
+/* Heap allocation counter for the benchmarks. Only in a build with
+   -DATM_ALLOC_COUNT on glibc, where the allocator entry points are wrapped
+   so every allocation a thread makes while its allocCounting is set
+   (including those inside stdio) is counted, and background threads (log
+   flusher, checkpointer) are left out; otherwise allocations are not
+   reported and the process keeps the C library's allocator untouched. */
+ATM_THREAD_LOCAL int allocCounting = 0;
+unsigned long allocCount = 0;
+#if defined(ATM_ALLOC_COUNT) && !defined(__GLIBC__)
+#undef ATM_ALLOC_COUNT
+#endif
+#ifdef ATM_ALLOC_COUNT
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    if (allocCounting) __atomic_add_fetch(&allocCount, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (allocCounting) __atomic_add_fetch(&allocCount, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (allocCounting) __atomic_add_fetch(&allocCount, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+#endif
+
+/* --------------------- Latency probes ---------------------
+   PROBE_START/PROBE_END bracket a stage and add its duration to that
+   stage's histogram with three relaxed atomic increments. Durations are
+   taken in TSC ticks where available (monotonic nanoseconds otherwise) and
+   only converted to time when a report is produced. */
+ProbeHistogram probeStats[PROBE_STAGE_COUNT];
+static const char *probeStageNames[PROBE_STAGE_COUNT] = {
+    "pin_check", "dispense", "journal_commit", "txn_log", "checkpoint", "withdrawal",
+};
+unsigned long long probeStartTicks = 0;
+double probeStartSeconds = 0;
+
+static inline unsigned long long probeTicks(void) {
+#ifdef PROBE_USE_TSC
+    return __rdtsc();
+#else
+    return (unsigned long long)(monotonicSeconds() * 1e9);
+#endif
+}
+
+#ifndef ATM_NO_PROBES
+#define PROBE_START(var) unsigned long long var = probeTicks()
+#define PROBE_END(stage, var) probeRecord((stage), probeTicks() - (var))
+#else
+#define PROBE_START(var) do { } while (0)
+#define PROBE_END(stage, var) do { } while (0)
+#endif
+
+/* Histogram bucket of a duration: exact below 4 ticks, then four buckets
+   per power of two */
+static int probeBucket(unsigned long long ticks) {
+    if (ticks < 4) return (int)ticks;
+    int msb = 63 - __builtin_clzll(ticks);
+    return msb * 4 + (int)((ticks >> (msb - 2)) & 3);
+}
+
+/* Smallest duration (ticks) that falls in bucket b */
+static double probeBucketLow(int b) {
+    if (b < 4) return b;
+    int msb = b / 4;
+    return (double)(4 + (b & 3)) * (double)(1ULL << (msb - 2));
+}
+
+static inline void probeRecord(ProbeStage stage, unsigned long long ticks) {
+    ProbeHistogram *h = &probeStats[stage];
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->ticks, ticks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->buckets[probeBucket(ticks)], 1, __ATOMIC_RELAXED);
+}
+
+/* Remember a reference point for converting ticks to seconds */
+void probeInit(void) {
+    probeStartTicks = probeTicks();
+    probeStartSeconds = monotonicSeconds();
+}
+
+/* Ticks per second, measured against the monotonic clock since probeInit
+   (waiting briefly if that was too recent to be accurate) */
+static double probeTicksPerSecond(void) {
+#ifdef PROBE_USE_TSC
+    if (probeStartSeconds == 0) probeInit();
+    while (monotonicSeconds() - probeStartSeconds < 0.01) {
+    }
+    return (double)(probeTicks() - probeStartTicks) / (monotonicSeconds() - probeStartSeconds);
+#else
+    return 1e9;
+#endif
+}
+
+/* Approximate quantile q of a stage in ticks (middle of the bucket) */
+static double probeQuantile(const ProbeHistogram *h, double q) {
+    unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (count == 0) return 0;
+    /* rank of the sample at quantile q, 1-based and rounded up */
+    unsigned long rank = (unsigned long)(q * (double)count), seen = 0;
+    if ((double)rank < q * (double)count || rank == 0) rank++;
+    for (int b = 0; b < PROBE_BUCKETS; ++b) {
+        seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        if (seen >= rank) return (probeBucketLow(b) + probeBucketLow(b + 1)) / 2;
+    }
+    return probeBucketLow(PROBE_BUCKETS - 1);
+}
+
+/* Per-stage latency table for the admin menu */
+void printLatencyReport(void) {
+    double usPerTick = 1e6 / probeTicksPerSecond();
+    printLine();
+    printf("Latency by stage (microseconds):\n");
+    printf("%-16s %10s %10s %10s %10s %10s\n", "stage", "count", "mean", "p50", "p99", "p99.9");
+    for (int i = 0; i < PROBE_STAGE_COUNT; ++i) {
+        const ProbeHistogram *h = &probeStats[i];
+        unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        double mean = count ? (double)__atomic_load_n(&h->ticks, __ATOMIC_RELAXED) / (double)count : 0;
+        printf("%-16s %10lu %10.1f %10.1f %10.1f %10.1f\n", probeStageNames[i], count, mean * usPerTick,
+               probeQuantile(h, 0.50) * usPerTick, probeQuantile(h, 0.99) * usPerTick,
+               probeQuantile(h, 0.999) * usPerTick);
+    }
+#ifdef ATM_NO_PROBES
+    printf("(built with ATM_NO_PROBES: no samples are collected)\n");
+#endif
+    printLine();
+}
+
+/* Prometheus text exposition of the stage histograms. Bucket bounds are
+   fixed so series stay stable between scrapes; a sample is counted under
+   a bound once its whole histogram bucket lies below it. */
+int writeMetrics(FILE *fp) {
+    static const double bounds[] = {
+        1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+        1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5,
+    };
+    const int boundCount = (int)(sizeof(bounds) / sizeof(bounds[0]));
+    double tps = probeTicksPerSecond();
+    fprintf(fp, "# HELP atm_stage_latency_seconds Time spent in each session stage.\n");
+    fprintf(fp, "# TYPE atm_stage_latency_seconds histogram\n");
+    for (int i = 0; i < PROBE_STAGE_COUNT; ++i) {
+        const ProbeHistogram *h = &probeStats[i];
+        unsigned long buckets[PROBE_BUCKETS];
+        for (int b = 0; b < PROBE_BUCKETS; ++b) buckets[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        unsigned long cumulative = 0, total = 0;
+        for (int b = 0; b < PROBE_BUCKETS; ++b) total += buckets[b];
+        int b = 0;
+        for (int j = 0; j < boundCount; ++j) {
+            while (b < PROBE_BUCKETS && probeBucketLow(b + 1) <= bounds[j] * tps) cumulative += buckets[b++];
+            fprintf(fp, "atm_stage_latency_seconds_bucket{machine=\"%s\",stage=\"%s\",le=\"%g\"} %lu\n",
+                    ATM_MACHINE_ID, probeStageNames[i], bounds[j], cumulative);
+        }
+        fprintf(fp, "atm_stage_latency_seconds_bucket{machine=\"%s\",stage=\"%s\",le=\"+Inf\"} %lu\n",
+                ATM_MACHINE_ID, probeStageNames[i], total);
+        fprintf(fp, "atm_stage_latency_seconds_sum{machine=\"%s\",stage=\"%s\"} %.9f\n",
+                ATM_MACHINE_ID, probeStageNames[i], (double)__atomic_load_n(&h->ticks, __ATOMIC_RELAXED) / tps);
+        fprintf(fp, "atm_stage_latency_seconds_count{machine=\"%s\",stage=\"%s\"} %lu\n",
+                ATM_MACHINE_ID, probeStageNames[i], total);
+    }
+    fprintf(fp, "# HELP atm_journal_backlog_records Journaled records not yet checkpointed.\n");
+    fprintf(fp, "# TYPE atm_journal_backlog_records gauge\n");
+    fprintf(fp, "atm_journal_backlog_records{machine=\"%s\"} %d\n", ATM_MACHINE_ID,
+            __atomic_load_n(&jnlSinceCheckpoint, __ATOMIC_RELAXED));
+    pthread_mutex_lock(&checkpointerLock);
+    unsigned long done = checkpointsDone, stalls = checkpointStalls;
+    pthread_mutex_unlock(&checkpointerLock);
+    fprintf(fp, "# HELP atm_checkpoints_total Background checkpoints completed.\n");
+    fprintf(fp, "# TYPE atm_checkpoints_total counter\n");
+    fprintf(fp, "atm_checkpoints_total{machine=\"%s\"} %lu\n", ATM_MACHINE_ID, done);
+    fprintf(fp, "# HELP atm_checkpoint_stalls_total Withdrawals that waited for the checkpointer to catch up.\n");
+    fprintf(fp, "# TYPE atm_checkpoint_stalls_total counter\n");
+    fprintf(fp, "atm_checkpoint_stalls_total{machine=\"%s\"} %lu\n", ATM_MACHINE_ID, stalls);
+    fprintf(fp, "# HELP atm_login_hashes_total PIN hashes computed (logins and PIN changes).\n");
+    fprintf(fp, "# TYPE atm_login_hashes_total counter\n");
+    fprintf(fp, "atm_login_hashes_total{machine=\"%s\"} %lu\n", ATM_MACHINE_ID,
+            __atomic_load_n(&loginHashes, __ATOMIC_RELAXED));
+    fprintf(fp, "# HELP atm_login_cache_hits_total Logins accepted without rehashing the PIN.\n");
+    fprintf(fp, "# TYPE atm_login_cache_hits_total counter\n");
+    fprintf(fp, "atm_login_cache_hits_total{machine=\"%s\"} %lu\n", ATM_MACHINE_ID,
+            __atomic_load_n(&loginCacheHits, __ATOMIC_RELAXED));
+    fprintf(fp, "# HELP atm_login_throttled_total Login attempts refused by the account or terminal budget.\n");
+    fprintf(fp, "# TYPE atm_login_throttled_total counter\n");
+    fprintf(fp, "atm_login_throttled_total{machine=\"%s\"} %lu\n", ATM_MACHINE_ID,
+            __atomic_load_n(&loginThrottled, __ATOMIC_RELAXED));
+    return ferror(fp) ? -1 : 0;
+}
+
 void printLine(void) {
     printf("--------------------------------------------------\n");
 }
@@ -108,10 +1289,138 @@ int safeScanInt(const char *prompt) {
     }
 }
 
-/* Safe double input with prompt (for amounts) */
-double safeScanDouble(const char *prompt) {
+/* --------------------- Money text ---------------------
+   Amounts are written and read as rupees.paise ("1234.50") by the integer
+   routines below instead of printf/strtod, which dominate bulk persistence
+   and history rendering otherwise. */
+
+/* Append v in decimal; returns the new end */
+static char *putInt(char *p, long long v) {
+    char tmp[20];
+    int n = 0;
+    unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+    if (v < 0) *p++ = '-';
+    do {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    while (n) *p++ = tmp[--n];
+    return p;
+}
+
+static char *putMoney(char *p, Money m) {
+    unsigned long long u = m < 0 ? 0ULL - (unsigned long long)m : (unsigned long long)m;
+    if (m < 0) *p++ = '-';
+    p = putInt(p, (long long)(u / PAISE));
+    *p++ = '.';
+    *p++ = (char)('0' + u % PAISE / 10);
+    *p++ = (char)('0' + u % 10);
+    return p;
+}
+
+static char *putText(char *p, const char *s) {
+    while (*s) *p++ = *s++;
+    return p;
+}
+
+static char *putHex(char *p, const unsigned char *bytes, int n) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < n; ++i) {
+        *p++ = digits[bytes[i] >> 4];
+        *p++ = digits[bytes[i] & 15];
+    }
+    return p;
+}
+
+/* Copy n chars right-aligned in a field of `width` (left-aligned if left);
+   returns NULL if they do not fit */
+static char *putField(char *p, const char *s, int n, int width, int left) {
+    if (n > width) return NULL;
+    if (!left) {
+        memset(p, ' ', (size_t)(width - n));
+        p += width - n;
+    }
+    memcpy(p, s, (size_t)n);
+    p += n;
+    if (left) {
+        memset(p, ' ', (size_t)(width - n));
+        p += width - n;
+    }
+    return p;
+}
+
+/* NUL-terminated rupees.paise in buf (MONEY_BUF bytes), for printf */
+const char *formatMoney(Money m, char *buf) {
+    *putMoney(buf, m) = '\0';
+    return buf;
+}
+
+/* Parse a decimal int after optional blanks; returns the end or NULL */
+static const char *parseInt(const char *s, int *out) {
+    while (*s == ' ' || *s == '\t') s++;
+    int neg = *s == '-';
+    if (*s == '-' || *s == '+') s++;
+    if (!isdigit((unsigned char)*s)) return NULL;
+    long long v = 0;
+    while (isdigit((unsigned char)*s)) {
+        v = v * 10 + (*s++ - '0');
+        if (v > (long long)INT_MAX + 1) return NULL;
+    }
+    if (neg) v = -v;
+    if (v > INT_MAX || v < INT_MIN) return NULL;
+    *out = (int)v;
+    return s;
+}
+
+/* Parse exactly 2 * n hex digits into bytes; returns the end or NULL */
+static const char *parseHex(const char *s, unsigned char *bytes, int n) {
+    for (int i = 0; i < 2 * n; ++i, ++s) {
+        int v;
+        if (*s >= '0' && *s <= '9') v = *s - '0';
+        else if (*s >= 'a' && *s <= 'f') v = *s - 'a' + 10;
+        else if (*s >= 'A' && *s <= 'F') v = *s - 'A' + 10;
+        else return NULL;
+        bytes[i / 2] = (unsigned char)(i % 2 ? bytes[i / 2] << 4 | v : v);
+    }
+    return s;
+}
+
+/* Parse rupees with optional paise ("150", "150.5", "150.50") after
+   optional blanks. Further decimals round half up. Returns the end or
+   NULL if there is no number or it is out of range. */
+static const char *parseMoney(const char *s, Money *out) {
+    while (*s == ' ' || *s == '\t') s++;
+    int neg = *s == '-';
+    if (*s == '-' || *s == '+') s++;
+    long long rupees = 0;
+    int digits = 0;
+    for (; isdigit((unsigned char)*s); ++s, ++digits) {
+        if (rupees > LLONG_MAX / (10 * PAISE)) return NULL;
+        rupees = rupees * 10 + (*s - '0');
+    }
+    int paise = 0, decimals = 0, roundUp = 0;
+    if (*s == '.') {
+        for (++s; isdigit((unsigned char)*s); ++s, ++decimals) {
+            if (decimals < 2) paise = paise * 10 + (*s - '0');
+            else if (decimals == 2) roundUp = *s >= '5';
+        }
+        if (decimals == 1) paise *= 10;
+    }
+    if (digits == 0 && decimals == 0) return NULL;
+    Money m = rupees * PAISE + paise + roundUp;
+    *out = neg ? -m : m;
+    return s;
+}
+
+/* Nearest paise of an amount from an older double field */
+static Money moneyFromDouble(double v) {
+    return (Money)(v * PAISE + (v < 0 ? -0.5 : 0.5));
+}
+
+/* Safe money input with prompt (for amounts) */
+Money safeScanMoney(const char *prompt) {
     char line[MAX_LINE];
-    double val;
+    Money val;
     while (1) {
         if (prompt) printf("%s", prompt);
         if (!fgets(line, sizeof(line), stdin)) {
@@ -124,8 +1433,11 @@ double safeScanDouble(const char *prompt) {
             printf("Empty input. Try again.\n");
             continue;
         }
-        char extra;
-        if (sscanf(line, "%lf %c", &val, &extra) == 1) {
+        const char *end = parseMoney(p, &val);
+        if (end) {
+            while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n') end++;
+        }
+        if (end && *end == '\0') {
             return val;
         } else {
             printf("Invalid number. Try again.\n");
@@ -133,478 +1445,7407 @@ double safeScanDouble(const char *prompt) {
     }
 }
 
-/* Load accounts from text file
+/* Account line of the text format: fields separated by blanks, the name
+   a single word (cut to MAX_NAME_LEN-1), then an optional hashed PIN
+   (iterations 0 in *cred if there is none). Returns 0 if it parsed. */
+static int parseAccountLine(const char *line, Account *a, char *name, PinHash *cred) {
+    const char *p = line;
+    if (!(p = parseInt(p, &a->accountNumber)) || !(p = parseInt(p, &a->pin)) ||
+        !(p = parseMoney(p, &a->balance))) return -1;
+    while (*p == ' ' || *p == '\t') p++;
+    int n = 0;
+    for (; *p && !isspace((unsigned char)*p); ++p) {
+        if (n < MAX_NAME_LEN - 1) name[n++] = *p;
+    }
+    name[n] = '\0';
+    if (n == 0 || !(p = parseInt(p, &a->loginAttempts)) || !(p = parseInt(p, &a->locked))) return -1;
+    memset(cred, 0, sizeof(*cred));
+    while (*p == ' ' || *p == '\t') p++;
+    if (strncmp(p, ACC_CRED_TAG, strlen(ACC_CRED_TAG)) != 0) return 0;
+    int iterations;
+    if (!(p = parseInt(p + strlen(ACC_CRED_TAG), &iterations)) || iterations <= 0 || *p != '$' ||
+        !(p = parseHex(p + 1, cred->salt, PIN_SALT_LEN)) || *p != '$' ||
+        !parseHex(p + 1, cred->hash, PIN_HASH_LEN)) return -1;
+    cred->iterations = (unsigned int)iterations;
+    return 0;
+}
+
+static unsigned int credChecksum(const PinHash *c, unsigned int slot);
+
+/* Import accounts from a text file
    File format (one account per line):
-   accountNumber pin balance name loginAttempts locked
+   accountNumber pin balance name loginAttempts locked [credential]
    Example:
    1001 1234 15000.50 John_Doe 0 0
+   An exported account with a hashed PIN has pin 0 and the credential
+   pbkdf2-sha256$<iterations>$<salt hex>$<hash hex>; a plain PIN is hashed
+   at the account's first login.
 */
 int loadAccounts(const char *filename) {
-    FILE *fp = fopen(filename, "r");
+    releaseAccounts();
+    FILE *fp = fopen(filename, "rb");
     if (!fp) {
         /* No file - start with zero accounts */
-        accountCount = 0;
-        accounts = NULL;
         return 0;
     }
-    accounts = malloc(sizeof(Account) * MAX_ACCOUNTS);
-    if (!accounts) {
-        printf("Memory allocation failed while loading accounts.\n");
-        fclose(fp);
-        return -1;
-    }
-    accountCount = 0;
+    char line[MAX_LINE];
     char namebuf[MAX_NAME_LEN];
-    while (!feof(fp) && accountCount < MAX_ACCOUNTS) {
-        int accNum, pin, loginAttempts, locked;
-        double balance;
-        if (fscanf(fp, "%d %d %lf %49s %d %d",
-                   &accNum, &pin, &balance, namebuf, &loginAttempts, &locked) == 6) {
-            accounts[accountCount].accountNumber = accNum;
-            accounts[accountCount].pin = pin;
-            accounts[accountCount].balance = balance;
-            strncpy(accounts[accountCount].name, namebuf, MAX_NAME_LEN-1);
-            accounts[accountCount].name[MAX_NAME_LEN-1] = '\0';
-            accounts[accountCount].loginAttempts = loginAttempts;
-            accounts[accountCount].locked = locked;
-            accountCount++;
-        } else {
-            /* skip weird line */
-            char skip[MAX_LINE];
-            if (!fgets(skip, sizeof(skip), fp)) break;
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), fp)) {
+        Account a;
+        PinHash cred;
+        memset(&a, 0, sizeof(a));
+        if (parseAccountLine(line, &a, namebuf, &cred) == 0) {
+            int idx = accountCreate(&a, namebuf);
+            if (idx != -1 && cred.iterations) {
+                cred.check = credChecksum(&cred, (unsigned int)idx);
+                *credAt(idx) = cred;
+            } else if (idx == -1) {
+                if (findAccountIndex(a.accountNumber) != -1) {
+                    printf("Warning: duplicate account %d skipped.\n", a.accountNumber);
+                } else {
+                    printf("Memory allocation failed while loading accounts.\n");
+                    rc = -1;
+                }
+            }
         }
+        /* else skip weird line */
     }
     fclose(fp);
-    return 0;
+    return rc;
+}
+
+/* Format one account as a fixed-width record, followed by its hashed PIN
+   if it has one; returns the length, or -1 if it does not fit */
+static int formatAccountRecord(int idx, char *buf, size_t size) {
+    const Account *a = accountAt(idx);
+    const char *name = accountName(idx);
+    const PinHash *cred = credAt(idx);
+    char num[MONEY_BUF];
+    char *p = buf;
+    if (size < ACC_RECORD_LEN + ACC_CRED_LEN) return -1;
+    /* widths: 11, 11, 15, 49 (left-aligned), 3, 1 */
+    if (!(p = putField(p, num, (int)(putInt(num, a->accountNumber) - num), 11, 0))) return -1;
+    *p++ = ' ';
+    if (!(p = putField(p, num, (int)(putInt(num, a->pin) - num), 11, 0))) return -1;
+    *p++ = ' ';
+    if (!(p = putField(p, num, (int)(putMoney(num, a->balance) - num), 15, 0))) return -1;
+    *p++ = ' ';
+    if (!(p = putField(p, name, (int)strlen(name), MAX_NAME_LEN - 1, 1))) return -1;
+    *p++ = ' ';
+    if (!(p = putField(p, num, (int)(putInt(num, a->loginAttempts) - num), 3, 0))) return -1;
+    *p++ = ' ';
+    if (!(p = putField(p, num, (int)(putInt(num, a->locked) - num), 1, 0))) return -1;
+    if (p - buf != ACC_RECORD_LEN - 1) return -1;
+    if (cred->iterations) {
+        p = putText(p, " " ACC_CRED_TAG);
+        p = putInt(p, cred->iterations);
+        *p++ = '$';
+        p = putHex(p, cred->salt, PIN_SALT_LEN);
+        *p++ = '$';
+        p = putHex(p, cred->hash, PIN_HASH_LEN);
+    }
+    *p++ = '\n';
+    return (int)(p - buf);
 }
 
-/* Save accounts back to file */
+/* Save accounts back to file (full rewrite) */
 int saveAccounts(const char *filename) {
-    FILE *fp = fopen(filename, "w");
+    FILE *fp = fopen(filename, "wb");
     if (!fp) {
         printf("Error: Unable to open accounts file for writing.\n");
         return -1;
     }
+    char rec[ACC_RECORD_LEN + ACC_CRED_LEN];
     for (int i = 0; i < accountCount; ++i) {
-        fprintf(fp, "%d %d %.2f %s %d %d\n",
-                accounts[i].accountNumber,
-                accounts[i].pin,
-                accounts[i].balance,
-                accounts[i].name,
-                accounts[i].loginAttempts,
-                accounts[i].locked);
+        int len = formatAccountRecord(i, rec, sizeof(rec));
+        if (len < 0) {
+            printf("Error: Account %d does not fit the record layout.\n", accountAt(i)->accountNumber);
+            fclose(fp);
+            return -1;
+        }
+        fwrite(rec, 1, (size_t)len, fp);
     }
     fclose(fp);
     return 0;
 }
 
-/* Load ATM inventory from file
-   Format: note2000 note500 note200 note100
-   Example: 10 20 30 40
-*/
-int loadATM(const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        /* default inventory if file missing */
-        atm.note2000 = 10;
-        atm.note500  = 20;
-        atm.note200  = 50;
-        atm.note100  = 100;
-        return 0;
+/* Checksum of one account's fields and name (FNV-1a), seeded with its slot
+   so a record written to the wrong place is caught too. Padding and the
+   bytes after the name's terminator are not covered. The balance is hashed
+   as its 8 stored bytes, so the same function checks the older layouts
+   whose balance was a double. */
+static unsigned int recordChecksum(unsigned int slot, int accountNumber, int pin, const void *balance,
+                                   const char *name, int loginAttempts, int locked) {
+    unsigned int h = 2166136261u ^ slot;
+    const unsigned char *p;
+#define FNV_BYTES(ptr, len) \
+    for (p = (const unsigned char *)(ptr); p < (const unsigned char *)(ptr) + (len); ++p) h = (h ^ *p) * 16777619u
+    FNV_BYTES(&accountNumber, sizeof(accountNumber));
+    FNV_BYTES(&pin, sizeof(pin));
+    FNV_BYTES(balance, 8);
+    FNV_BYTES(name, strnlen(name, MAX_NAME_LEN));
+    FNV_BYTES(&loginAttempts, sizeof(loginAttempts));
+    FNV_BYTES(&locked, sizeof(locked));
+#undef FNV_BYTES
+    return h;
+}
+
+static unsigned int accountChecksum(const Account *a, const char *name, unsigned int slot) {
+    return recordChecksum(slot, a->accountNumber, a->pin, &a->balance, name, a->loginAttempts, a->locked);
+}
+
+static unsigned int credChecksum(const PinHash *c, unsigned int slot) {
+    unsigned int h = 2166136261u ^ slot;
+    const unsigned char *p = (const unsigned char *)c;
+    for (size_t i = 0; i < offsetof(PinHash, check); ++i) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+/* A hashed credential is intact; an unhashed one is all zero */
+static int credValid(const PinHash *c, unsigned int slot) {
+    return c->iterations == 0 || credChecksum(c, slot) == c->check;
+}
+
+static unsigned int snapshotHeaderChecksum(const AccountSnapshotHeader *hdr) {
+    unsigned int h = 2166136261u;
+    const unsigned char *p = (const unsigned char *)hdr;
+    for (size_t i = 0; i < offsetof(AccountSnapshotHeader, headerCheck); ++i) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+/* File offsets of a slot's hot record, profile, credential and checksum */
+static long snapshotRecordOffset(unsigned int slot) {
+    return ACC_SNAPSHOT_HEADER + (long)slot * (long)sizeof(Account);
+}
+
+static long snapshotProfileOffset(unsigned int capacity, unsigned int slot) {
+    return snapshotRecordOffset(capacity) + (long)slot * (long)sizeof(AccountProfile);
+}
+
+static long snapshotCredOffset(unsigned int capacity, unsigned int slot) {
+    return snapshotProfileOffset(capacity, capacity) + (long)slot * (long)sizeof(PinHash);
+}
+
+static long snapshotChecksumOffset(unsigned int capacity, unsigned int slot) {
+    return snapshotCredOffset(capacity, capacity) + (long)slot * 4;
+}
+
+/* Hot chunks on the heap are aligned like the mapped ones (the table starts
+   ACC_SNAPSHOT_HEADER bytes into the file), so every cache line holds two
+   whole records; plain malloc only promises 16 bytes and leaves a record
+   straddling lines. */
+static Account *hotChunkAlloc(void) {
+#ifdef _WIN32
+    return _aligned_malloc(sizeof(Account) * ACCOUNT_CHUNK, ACCOUNT_CHUNK_ALIGN);
+#else
+    void *p;
+    return posix_memalign(&p, ACCOUNT_CHUNK_ALIGN, sizeof(Account) * ACCOUNT_CHUNK) == 0 ? p : NULL;
+#endif
+}
+
+static void hotChunkFree(Account *chunk) {
+#ifdef _WIN32
+    _aligned_free(chunk);
+#else
+    free(chunk);
+#endif
+}
+
+/* Drop every account and the lookup table: heap chunks are freed and the
+   snapshot unmapped. Only for startup/shutdown, never while sessions hold
+   Account pointers. */
+void releaseAccounts(void) {
+    free(accIndexSlots);
+    accIndexSlots = NULL;
+    accIndexCap = accIndexUsed = 0;
+    for (int c = accountChunksMapped; c < accountChunkCount; ++c) {
+        hotChunkFree(accountChunks[c]);
+        free(profileChunks[c]);
+        free(credChunks[c]);
     }
-    if (fscanf(fp, "%d %d %d %d", &atm.note2000, &atm.note500, &atm.note200, &atm.note100) != 4) {
-        /* fallback defaults on parse fail */
-        atm.note2000 = 10;
-        atm.note500  = 20;
-        atm.note200  = 50;
-        atm.note100  = 100;
+    memset(accountChunks, 0, sizeof(Account *) * (size_t)accountChunkCount);
+    memset(profileChunks, 0, sizeof(AccountProfile *) * (size_t)accountChunkCount);
+    memset(credChunks, 0, sizeof(PinHash *) * (size_t)accountChunkCount);
+    for (int c = 0; c < ACCOUNT_MAX_CHUNKS; ++c) {
+        free(loginChunks[c]);
+        loginChunks[c] = NULL;
+    }
+    accountChunkCount = accountChunksMapped = 0;
+    accountCount = 0;
+    if (accountsMap) {
+#ifdef _WIN32
+        free(accountsMap);
+#else
+        munmap(accountsMap, accountsMapLen);
+#endif
+        accountsMap = NULL;
+        accountsMapLen = 0;
     }
-    fclose(fp);
-    return 0;
 }
 
-/* Save ATM inventory to file */
-int saveATM(const char *filename) {
-    FILE *fp = fopen(filename, "w");
-    if (!fp) {
-        printf("Error: Unable to open ATM file for writing.\n");
+/* Add one chunk to each store (accountStoreLock held) */
+static int accountStoreGrow(void) {
+    if (accountChunkCount == ACCOUNT_MAX_CHUNKS) return -1;
+    Account *hot = hotChunkAlloc();
+    AccountProfile *cold = malloc(sizeof(AccountProfile) * ACCOUNT_CHUNK);
+    PinHash *creds = malloc(sizeof(PinHash) * ACCOUNT_CHUNK);
+    if (!hot || !cold || !creds) {
+        hotChunkFree(hot);
+        free(cold);
+        free(creds);
         return -1;
     }
-    fprintf(fp, "%d %d %d %d\n", atm.note2000, atm.note500, atm.note200, atm.note100);
-    fclose(fp);
+    accountChunks[accountChunkCount] = hot;
+    profileChunks[accountChunkCount] = cold;
+    credChunks[accountChunkCount] = creds;
+    accountChunkCount++;
     return 0;
 }
 
-/* Append a transaction to transactions file */
-void recordTransaction(const Transaction *t) {
-    FILE *fp = fopen(TXN_FILE, "a");
-    if (!fp) {
-        printf("Warning: unable to open transaction file. Transaction not logged.\n");
+/* Append a copy of *init (with the next free slot) under `name` and index
+   it. Existing records never move. Returns the new index, or -1 if the
+   account number is taken or the store cannot grow. */
+int accountCreate(const Account *init, const char *name) {
+    pthread_mutex_lock(&accountStoreLock);
+    int idx = -1;
+    if (findAccountIndex(init->accountNumber) != -1) {
+        /* number already in use */
+    } else if ((accountCount >> ACCOUNT_CHUNK_SHIFT) < accountChunkCount || accountStoreGrow() == 0) {
+        Account *a = accountAt(accountCount);
+        *a = *init;
+        a->slot = accountCount;
+        AccountProfile *profile = &profileChunks[accountCount >> ACCOUNT_CHUNK_SHIFT][accountCount & (ACCOUNT_CHUNK - 1)];
+        memset(profile, 0, sizeof(*profile));
+        strncpy(profile->name, name, MAX_NAME_LEN - 1);
+        memset(credAt(accountCount), 0, sizeof(PinHash));
+        if (indexInsertAccount(accountCount) == 0) idx = accountCount++;
+    }
+    pthread_mutex_unlock(&accountStoreLock);
+    return idx;
+}
+
+/* Check and import the records of an older snapshot (combined records
+   for versions 1/2, split with a double balance for 3, without credentials
+   for 4, with the credential in the profile for 5) into heap chunks.
+   Returns the number of damaged records. */
+static unsigned int snapshotConvertLegacy(const AccountSnapshotHeader *hdr, const char *base) {
+    int combined = hdr->version < 3;
+    const char *records = base + ACC_SNAPSHOT_HEADER;
+    const char *profiles = records + (size_t)hdr->capacity * hdr->recordSize;
+    size_t profileSize = combined ? 0 : hdr->version < 5 ? sizeof(AccountProfile) : sizeof(AccountProfileV5);
+    const unsigned int *sums = (const unsigned int *)(profiles + (size_t)hdr->capacity * profileSize);
+    unsigned int bad = 0;
+    for (unsigned int i = 0; i < hdr->count; ++i) {
+        Account a;
+        char name[MAX_NAME_LEN];
+        double balance;
+        int slot;
+        const PinHash *cred = NULL;
+        memset(&a, 0, sizeof(a));
+        if (combined) {
+            const AccountRecordV2 *r = (const AccountRecordV2 *)records + i;
+            a.accountNumber = r->accountNumber;
+            a.pin = r->pin;
+            balance = r->balance;
+            a.loginAttempts = r->loginAttempts;
+            a.locked = r->locked;
+            slot = hdr->version > 1 ? r->slot : (int)i;
+            memcpy(name, r->name, MAX_NAME_LEN);
+        } else if (hdr->version >= 4) {
+            a = ((const Account *)records)[i];
+            slot = a.slot;
+            memcpy(&balance, &a.balance, sizeof(balance)); /* hashed as its stored bytes */
+            memcpy(name, profiles + i * profileSize, MAX_NAME_LEN);
+            if (hdr->version == 5) cred = &((const AccountProfileV5 *)profiles)[i].cred;
+        } else {
+            const AccountRecordV3 *r = (const AccountRecordV3 *)records + i;
+            a.accountNumber = r->accountNumber;
+            a.pin = r->pin;
+            balance = r->balance;
+            a.loginAttempts = r->loginAttempts;
+            a.locked = r->locked;
+            slot = r->slot;
+            memcpy(name, profiles + i * profileSize, MAX_NAME_LEN);
+        }
+        name[MAX_NAME_LEN - 1] = '\0';
+        if (hdr->version < 4) a.balance = moneyFromDouble(balance);
+        if (recordChecksum(i, a.accountNumber, a.pin, &balance, name, a.loginAttempts, a.locked) != sums[i] ||
+            slot != (int)i || (cred && !credValid(cred, i))) bad++;
+        else if (accountCreate(&a, name) != (int)i) bad++;
+        else if (cred) *credAt((int)i) = *cred;
+    }
+    return bad;
+}
+
+/* Load the binary snapshot. The file is mapped copy-on-write and its
+   chunks are used in place, so only the checksum pass touches every page.
+   Files of older versions are converted and rewritten.
+   A checkpoint that died part way leaves records whose checksum does not
+   match; those are kept if the journal still holds a record for each
+   account, since replay then sets what the checkpoint was writing and
+   the next checkpoint rewrites them.
+   Returns 0 on success, 1 if there is no file (silently), -1 if the file
+   exists but is unusable; it is then left as it is for the operator. */
+int snapshotLoad(const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp && errno == ENOENT) return 1;
+    if (!fp) {
+        printf("Error: unable to open %s.\n", filename);
+        return -1;
+    }
+    AccountSnapshotHeader hdr;
+    const char *problem = NULL;
+    long size = -1, need = 0;
+    int legacy = 0;
+    size_t recordSize = 0;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) problem = "truncated header";
+    else if (memcmp(hdr.magic, ACC_SNAPSHOT_MAGIC, sizeof(ACC_SNAPSHOT_MAGIC)) != 0) problem = "not a snapshot";
+    else if (hdr.headerCheck != snapshotHeaderChecksum(&hdr)) problem = "header checksum mismatch";
+    else if (hdr.version < 1 || hdr.version > ACC_SNAPSHOT_VERSION || hdr.endian != ACC_SNAPSHOT_ENDIAN ||
+             hdr.recordSize != (recordSize = hdr.version < 3 ? sizeof(AccountRecordV2)
+                                           : hdr.version == 3 ? sizeof(AccountRecordV3) : sizeof(Account)))
+        problem = "written by an incompatible build";
+    else if (hdr.count > hdr.capacity || hdr.count > (unsigned int)ACCOUNT_MAX_CHUNKS * ACCOUNT_CHUNK ||
+             (!(legacy = hdr.version < ACC_SNAPSHOT_VERSION) && hdr.capacity % ACCOUNT_CHUNK != 0))
+        problem = "bad record count";
+    else {
+        size_t profileSize = hdr.version < 3 ? 0 : hdr.version < 5 ? sizeof(AccountProfile)
+                           : hdr.version == 5 ? sizeof(AccountProfileV5) : sizeof(AccountProfile) + sizeof(PinHash);
+        need = ACC_SNAPSHOT_HEADER + (long)hdr.capacity * (long)(recordSize + 4 + profileSize);
+        if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < need) problem = "truncated records";
+    }
+    if (problem) {
+        fclose(fp);
+        printf("Error: %s is unusable (%s).\n", filename, problem);
+        return -1;
+    }
+    releaseAccounts();
+#ifdef _WIN32
+    /* no mmap: read the file in one go */
+    char *base = malloc((size_t)size);
+    int ok = base && fseek(fp, 0, SEEK_SET) == 0 && fread(base, 1, (size_t)size, fp) == (size_t)size;
+    fclose(fp);
+    if (!ok) {
+        free(base);
+        printf("Error: unable to read %s.\n", filename);
+        return -1;
+    }
+#else
+    void *map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+    fclose(fp);
+    if (map == MAP_FAILED) {
+        printf("Error: unable to map %s.\n", filename);
+        return -1;
+    }
+    char *base = map;
+#endif
+    accountsMap = base;
+    accountsMapLen = (size_t)size;
+    unsigned int bad = 0;
+    int *torn = NULL, tornCount = 0, tornCap = 0;
+    if (legacy) {
+        bad = snapshotConvertLegacy(&hdr, base);
+    } else {
+        Account *records = (Account *)(base + snapshotRecordOffset(0));
+        AccountProfile *profiles = (AccountProfile *)(base + snapshotProfileOffset(hdr.capacity, 0));
+        PinHash *creds = (PinHash *)(base + snapshotCredOffset(hdr.capacity, 0));
+        const unsigned int *sums = (const unsigned int *)(base + snapshotChecksumOffset(hdr.capacity, 0));
+        for (unsigned int i = 0; i < hdr.count; ++i) {
+            profiles[i].name[MAX_NAME_LEN - 1] = '\0';
+            if (records[i].slot != (int)i || !credValid(&creds[i], i)) {
+                bad++;
+            } else if (accountChecksum(&records[i], profiles[i].name, i) != sums[i]) {
+                if (tornCount == tornCap) {
+                    int cap = tornCap ? tornCap * 2 : 16;
+                    int *grown = realloc(torn, sizeof(int) * cap);
+                    if (!grown) {
+                        bad++;
+                        continue;
+                    }
+                    torn = grown;
+                    tornCap = cap;
+                }
+                torn[tornCount++] = records[i].accountNumber;
+            }
+        }
+        if (tornCount > 0 && bad == 0 && journalCoversAccounts(torn, tornCount)) {
+            printf("Warning: %s has %d record(s) from an unfinished checkpoint; replaying them from the journal.\n",
+                   filename, tornCount);
+        } else {
+            bad += (unsigned int)tornCount;
+        }
+        free(torn);
+        int needed = (int)((hdr.count + ACCOUNT_CHUNK - 1) / ACCOUNT_CHUNK);
+        for (int c = 0; c < needed; ++c) {
+            accountChunks[c] = records + (size_t)c * ACCOUNT_CHUNK;
+            profileChunks[c] = profiles + (size_t)c * ACCOUNT_CHUNK;
+            credChunks[c] = creds + (size_t)c * ACCOUNT_CHUNK;
+        }
+        accountChunkCount = accountChunksMapped = needed;
+        accountCount = (int)hdr.count;
+    }
+    if (bad) {
+        releaseAccounts();
+        printf("Error: %s has %u damaged record(s).\n", filename, bad);
+        return -1;
+    }
+    snapshotCapacity = hdr.capacity;
+    snapshotCount = hdr.count;
+    if (legacy) {
+        /* everything now lives on the heap: drop the old file's mapping and
+           rewrite it in the current format */
+#ifdef _WIN32
+        free(accountsMap);
+#else
+        munmap(accountsMap, accountsMapLen);
+#endif
+        accountsMap = NULL;
+        accountsMapLen = 0;
+        printf("Converting %s to snapshot format %d.\n", filename, ACC_SNAPSHOT_VERSION);
+        if (snapshotSave(filename) != 0) return -1;
+        return 0;
+    }
+    return buildAccountIndex();
+}
+
+static void snapshotHeaderInit(AccountSnapshotHeader *hdr, unsigned int count, unsigned int capacity) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, ACC_SNAPSHOT_MAGIC, sizeof(ACC_SNAPSHOT_MAGIC));
+    hdr->version = ACC_SNAPSHOT_VERSION;
+    hdr->recordSize = sizeof(Account);
+    hdr->endian = ACC_SNAPSHOT_ENDIAN;
+    hdr->count = count;
+    hdr->capacity = capacity;
+    hdr->headerCheck = snapshotHeaderChecksum(hdr);
+}
+
+/* Write `used` records of a chunk followed by zeroed slots up to a whole
+   chunk (for every table alike) */
+static int snapshotWriteChunk(FILE *fp, const void *chunk, size_t recSize, unsigned int used, const void *blank) {
+    if (used && fwrite(chunk, recSize, used, fp) != used) return 0;
+    return used == ACCOUNT_CHUNK || fwrite(blank, recSize, ACCOUNT_CHUNK - used, fp) == ACCOUNT_CHUNK - used;
+}
+
+/* Write a complete snapshot with room to grow (a quarter more, rounded up
+   to whole chunks), through a temporary file that replaces the old one
+   only once it is on disk */
+int snapshotSave(const char *filename) {
+    char tmp[MAX_LINE];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        printf("Error: Unable to open %s for writing.\n", tmp);
+        return -1;
+    }
+    unsigned int count = (unsigned int)accountCount;
+    unsigned int chunks = (count + count / 4) / ACCOUNT_CHUNK + 1;
+    AccountSnapshotHeader hdr;
+    snapshotHeaderInit(&hdr, count, chunks * ACCOUNT_CHUNK);
+    int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    void *blank = calloc(ACCOUNT_CHUNK, sizeof(PinHash) > sizeof(AccountProfile) ? sizeof(PinHash) : sizeof(AccountProfile));
+    if (!blank) ok = 0;
+    for (int table = 0; table < 3; ++table) {
+        for (unsigned int c = 0; ok && c < chunks; ++c) {
+            unsigned int base = c * ACCOUNT_CHUNK;
+            unsigned int used = count > base ? count - base : 0;
+            if (used > ACCOUNT_CHUNK) used = ACCOUNT_CHUNK;
+            ok = table == 0 ? snapshotWriteChunk(fp, accountChunks[c], sizeof(Account), used, blank)
+               : table == 1 ? snapshotWriteChunk(fp, profileChunks[c], sizeof(AccountProfile), used, blank)
+                            : snapshotWriteChunk(fp, credChunks[c], sizeof(PinHash), used, blank);
+        }
+    }
+    free(blank);
+    for (unsigned int i = 0; ok && i < hdr.capacity; ++i) {
+        unsigned int sum = i < count ? accountChecksum(accountAt((int)i), accountName((int)i), i) : 0;
+        ok = fwrite(&sum, 4, 1, fp) == 1;
+    }
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0) ok = 0;
+#ifdef _WIN32
+    if (ok) remove(filename);
+#endif
+    if (!ok || rename(tmp, filename) != 0) {
+        printf("Error: Unable to write account snapshot %s.\n", filename);
+        remove(tmp);
+        return -1;
+    }
+    snapshotCapacity = hdr.capacity;
+    snapshotCount = count;
+    return 0;
+}
+
+/* Overwrite slots indices[0..n-1] with records[0..n-1] (and their
+   checksums) in place and sync, and their credentials with creds[i] where
+   creds is given and creds[i] is hashed. Slots appended since the file was
+   written also get their profile and extend its count; the header is only
+   rewritten after they are on disk. Falls back to a full snapshot if the
+   file is missing or an index is past its capacity. */
+int snapshotWriteRecords(const char *filename, const int *indices, const Account *records, const PinHash *creds,
+                         int n) {
+    unsigned int count = snapshotCount;
+    for (int i = 0; i < n; ++i) {
+        if ((unsigned int)indices[i] >= snapshotCapacity) return snapshotSave(filename);
+        if ((unsigned int)indices[i] >= count) count = (unsigned int)indices[i] + 1;
+    }
+    FILE *fp = fopen(filename, "rb+");
+    if (!fp) return snapshotSave(filename);
+    int ok = 1;
+    for (int i = 0; ok && i < n; ++i) {
+        unsigned int slot = (unsigned int)indices[i];
+        const char *name = accountName((int)slot);
+        unsigned int sum = accountChecksum(&records[i], name, slot);
+        ok = fseek(fp, snapshotRecordOffset(slot), SEEK_SET) == 0 &&
+             fwrite(&records[i], sizeof(Account), 1, fp) == 1 &&
+             fseek(fp, snapshotChecksumOffset(snapshotCapacity, slot), SEEK_SET) == 0 &&
+             fwrite(&sum, 4, 1, fp) == 1;
+        const PinHash *cred = creds && creds[i].iterations ? &creds[i] : NULL;
+        PinHash none;
+        if (ok && slot >= snapshotCount) {
+            /* the name never changes, so it is only written for a new slot,
+               with a cleared credential unless creds has one */
+            AccountProfile profile;
+            memset(&profile, 0, sizeof(profile));
+            memcpy(profile.name, name, MAX_NAME_LEN);
+            ok = fseek(fp, snapshotProfileOffset(snapshotCapacity, slot), SEEK_SET) == 0 &&
+                 fwrite(&profile, sizeof(AccountProfile), 1, fp) == 1;
+            if (!cred) {
+                memset(&none, 0, sizeof(none));
+                cred = &none;
+            }
+        }
+        if (ok && cred) {
+            ok = fseek(fp, snapshotCredOffset(snapshotCapacity, slot), SEEK_SET) == 0 &&
+                 fwrite(cred, sizeof(PinHash), 1, fp) == 1;
+        }
+    }
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (ok && count != snapshotCount) {
+        AccountSnapshotHeader hdr;
+        snapshotHeaderInit(&hdr, count, snapshotCapacity);
+        ok = fseek(fp, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+             fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        if (ok) snapshotCount = count;
+    }
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok) {
+        printf("Error: Unable to update account snapshot.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Persist a single account in place, credential included (its account
+   lock held) */
+int snapshotSaveRecord(const char *filename, int idx) {
+    return snapshotWriteRecords(filename, &idx, accountAt(idx), credAt(idx), 1);
+}
+
+/* Load ATM inventory from file
+   Format: one note count per cassette, highest denomination first, then
+   the checkpoint generation it was saved at
+   Example (2000 500 200 100): 10 20 30 40
+                               checkpoint 12
+*/
+int loadATM(const char *filename) {
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) atm.notes[k] = denomDefault[k];
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        /* default inventory if file missing */
+        return 0;
+    }
+    ATM loaded = {{0}};
+    int k = 0;
+    while (k < ATM_NUM_DENOMS && fscanf(fp, "%d", &loaded.notes[k]) == 1) k++;
+    /* fallback defaults on parse fail */
+    if (k == ATM_NUM_DENOMS) atm = loaded;
+    if (k < ATM_NUM_DENOMS || fscanf(fp, " checkpoint %lu", &atmSavedGen) != 1) atmSavedGen = 0;
+    fclose(fp);
+    return 0;
+}
+
+/* Save ATM inventory to file, beside the old one and renamed over it like
+   saveFleet, so a checkpoint never resets the journal over a torn file */
+int saveATM(const char *filename) {
+    char tmp[MAX_LINE];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        printf("Error: Unable to open ATM file for writing.\n");
+        return -1;
+    }
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        fprintf(fp, k ? " %d" : "%d", atm.notes[k]);
+    }
+    fprintf(fp, "\ncheckpoint %lu\n", jnlCheckpointGen);
+    int ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp, filename) != 0) {
+        printf("Error: Unable to write %s.\n", filename);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int compareMachines(const void *a, const void *b) {
+    int x = ((const Machine *)a)->id, y = ((const Machine *)b)->id;
+    return (x > y) - (x < y);
+}
+
+/* Load the fleet for --fleet
+   Format: one machine per line, its id then one note count per cassette,
+   and a line with the checkpoint generation it was saved at
+   Example (2000 500 200 100): checkpoint 12
+                               7 10 20 30 40
+   Without the file, machines 1..`machines` start with the default
+   inventory. Returns 0 if at least one machine was loaded. */
+int loadFleet(const char *filename, int machines) {
+    FILE *fp = fopen(filename, "r");
+    int cap = fp ? 64 : machines;
+    if (cap < 1 || cap > FLEET_MAX_MACHINES) {
+        printf("Error: fleet size must be between 1 and %d.\n", FLEET_MAX_MACHINES);
+        if (fp) fclose(fp);
+        return -1;
+    }
+    fleet = calloc((size_t)cap, sizeof(Machine));
+    if (!fleet) {
+        if (fp) fclose(fp);
+        return -1;
+    }
+    if (!fp) {
+        for (int i = 0; i < machines; ++i) {
+            fleet[i].id = i + 1;
+            for (int k = 0; k < ATM_NUM_DENOMS; ++k) fleet[i].atm.notes[k] = denomDefault[k];
+            pthread_mutex_init(&fleet[i].avail.lock, NULL);
+        }
+        fleetCount = machines;
+        return 0;
+    }
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), fp) && fleetCount < FLEET_MAX_MACHINES) {
+        Machine m;
+        char *p = line, *end;
+        if (sscanf(line, "checkpoint %lu", &fleetSavedGen) == 1) continue;
+        m.id = (int)strtol(p, &end, 10);
+        if (end == p || m.id <= 0) continue;
+        int k = 0;
+        for (; k < ATM_NUM_DENOMS; ++k) {
+            p = end;
+            m.atm.notes[k] = (int)strtol(p, &end, 10);
+            if (end == p || m.atm.notes[k] < 0) break;
+        }
+        if (k < ATM_NUM_DENOMS) continue;
+        if (fleetCount == cap) {
+            Machine *grown = realloc(fleet, sizeof(Machine) * (size_t)cap * 2);
+            if (!grown) break;
+            fleet = grown;
+            cap *= 2;
+        }
+        fleet[fleetCount++] = m;
+    }
+    fclose(fp);
+    qsort(fleet, (size_t)fleetCount, sizeof(Machine), compareMachines);
+    int kept = 0;
+    for (int i = 0; i < fleetCount; ++i) {
+        if (kept > 0 && fleet[kept - 1].id == fleet[i].id) continue; // first line wins
+        fleet[kept++] = fleet[i];
+    }
+    fleetCount = kept;
+    for (int i = 0; i < fleetCount; ++i) {
+        memset(&fleet[i].avail, 0, sizeof(fleet[i].avail));
+        pthread_mutex_init(&fleet[i].avail.lock, NULL);
+    }
+    if (fleetCount == 0) printf("Error: no machines in %s.\n", filename);
+    return fleetCount > 0 ? 0 : -1;
+}
+
+/* Save every machine's inventory (checkpointLock held exclusively). The
+   file is written beside the old one and renamed over it, so a crash
+   leaves one complete generation or the other. */
+int saveFleet(const char *filename) {
+    char tmp[MAX_LINE];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        printf("Error: Unable to open fleet file for writing.\n");
+        return -1;
+    }
+    fprintf(fp, "checkpoint %lu\n", jnlCheckpointGen);
+    for (int i = 0; i < fleetCount; ++i) {
+        fprintf(fp, "%d", fleet[i].id);
+        for (int k = 0; k < ATM_NUM_DENOMS; ++k) fprintf(fp, " %d", fleet[i].atm.notes[k]);
+        fprintf(fp, "\n");
+    }
+    int ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp, filename) != 0) {
+        printf("Error: Unable to write %s.\n", filename);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+Machine *findMachine(int id) {
+    int lo = 0, hi = fleetCount - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (fleet[mid].id == id) return &fleet[mid];
+        if (fleet[mid].id < id) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
+/* Inventory of machine `id` (0 is the standalone machine), or NULL */
+ATM *machineInventory(int id) {
+    if (id == 0) return &atm;
+    Machine *m = findMachine(id);
+    return m ? &m->atm : NULL;
+}
+
+/* Machine id of an inventory handed to the withdrawal path */
+int atmMachineId(const ATM *inv) {
+    if (fleetCount > 0 && (const Machine *)inv >= fleet && (const Machine *)inv < fleet + fleetCount) {
+        return ((const Machine *)inv)->id;
+    }
+    return 0;
+}
+
+/* --------------------- Transaction log ---------------------
+   The log is a numbered series of segment files, transactions.NNNNNN.log,
+   each a TXN_SEGMENT_HEADER byte header (magic, version, segment number,
+   base time) followed by records
+     [payload length][type][account][time - base][amount][balance after]
+   with every field after the type a varint (signed ones zigzag-encoded):
+   12-16 bytes against ~55 for the old text line. A withdrawal adds
+   [machine][notes from each cassette], another 5 or so. Readers skip any
+   fields they do not know, so later fields can be added at the end.
+   Only the highest segment is appended to. It is sealed once it reaches
+   txnRotateBytes or is txnRotateSeconds old, and the background flusher
+   then rewrites it as transactions.NNNNNN.lgz: the same byte stream cut
+   into blocks at record boundaries, each compressed with the LZ coder
+   below, followed by a block table. Offsets within a segment always refer
+   to the uncompressed stream, so a TxnPos stays valid when its segment is
+   compressed. Readers (TxnReader) hold one block at a time and never load
+   a whole segment.
+*/
+
+const char *txnTypeName(TxnType type) {
+    switch (type) {
+    case TXN_WITHDRAWAL:      return "Withdrawal";
+    case TXN_BALANCE_INQUIRY: return "Balance Inquiry";
+    case TXN_INQUIRY_SUMMARY: return "Inquiry Summary";
+    }
+    return "Unknown";
+}
+
+/* Per-thread cache of the minute last formatted: the "YYYY-mm-dd HH:MM:"
+   prefix and the epoch second it starts at. Zone offsets and DST changes
+   fall on minute boundaries, so any time inside that minute only needs
+   its seconds patched in; localtime (which takes the C library's timezone
+   lock) runs once per minute per thread instead of once per record. */
+#define TIME_PREFIX_LEN 17
+static ATM_THREAD_LOCAL long long timeCacheMinute = LLONG_MIN;
+static ATM_THREAD_LOCAL char timeCachePrefix[TIME_BUF];
+
+/* Local "YYYY-mm-dd HH:MM:SS" in buf (TIME_BUF bytes) */
+const char *formatTime(long long when, char *buf) {
+    /* no subtraction until the cache holds a minute at or before `when` */
+    long long sec = timeCacheMinute == LLONG_MIN || when < timeCacheMinute ? -1 : when - timeCacheMinute;
+    if (sec < 0 || sec >= 60) {
+        time_t tt = (time_t)when;
+        struct tm tm;
+#ifdef _WIN32
+        localtime_s(&tm, &tt);
+#else
+        localtime_r(&tt, &tm);
+#endif
+        if (strftime(buf, TIME_BUF, "%Y-%m-%d %H:%M:%S", &tm) != TIME_PREFIX_LEN + 2 || tm.tm_sec > 59) {
+            timeCacheMinute = LLONG_MIN;    // unusual year or leap second
+            return buf;
+        }
+        memcpy(timeCachePrefix, buf, TIME_PREFIX_LEN);
+        timeCacheMinute = when - tm.tm_sec;
+        sec = tm.tm_sec;
+    }
+    memcpy(buf, timeCachePrefix, TIME_PREFIX_LEN);
+    buf[TIME_PREFIX_LEN] = (char)('0' + sec / 10);
+    buf[TIME_PREFIX_LEN + 1] = (char)('0' + sec % 10);
+    buf[TIME_PREFIX_LEN + 2] = '\0';
+    return buf;
+}
+
+/* Parse a local "YYYY-mm-dd HH:MM:SS" (older text records); 0 if valid */
+static int parseTime(const char *s, long long *out) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(s, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    time_t tt = mktime(&tm);
+    if (tt == (time_t)-1) return -1;
+    *out = (long long)tt;
+    return 0;
+}
+
+/* Render a transaction as a text line: acc;type;amt;bal;datetime\n, and
+   for a withdrawal whose machine is known ;machine;notes per cassette */
+static int formatTransactionLine(const Transaction *t, char *buf, size_t size) {
+    /* fields are bounded: 11 + 15 + 2 * 21 + 19 + separators, and for a
+       summary 10 + 19 more, for a withdrawal 11 per cassette and machine */
+    if (size < TXN_LINE_MAX) return -1;
+    char when[TIME_BUF];
+    char *p = putInt(buf, t->accountNumber);
+    *p++ = ';';
+    p = putText(p, txnTypeName(t->type));
+    *p++ = ';';
+    p = putMoney(p, t->amount);
+    *p++ = ';';
+    p = putMoney(p, t->remainingBalance);
+    *p++ = ';';
+    p = putText(p, formatTime(t->time, when));
+    if (t->type == TXN_INQUIRY_SUMMARY) {
+        *p++ = ';';
+        p = putInt(p, t->count);
+        *p++ = ';';
+        p = putText(p, formatTime(t->firstTime, when));
+    } else if (t->type == TXN_WITHDRAWAL && t->machine >= 0) {
+        *p++ = ';';
+        p = putInt(p, t->machine);
+        for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+            *p++ = ';';
+            p = putInt(p, t->notes[k]);
+        }
+    }
+    *p++ = '\n';
+    *p = '\0';
+    return (int)(p - buf);
+}
+
+/* Parse a line of the old text log; returns 0 if complete */
+static int parseTransactionLine(const char *line, Transaction *t) {
+    const char *p = parseInt(line, &t->accountNumber);
+    if (!p || *p++ != ';') return -1;
+    size_t n = strcspn(p, ";\n");
+    if (p[n] != ';') return -1;
+    if (n == 10 && strncmp(p, "Withdrawal", n) == 0) t->type = TXN_WITHDRAWAL;
+    else if (n == 15 && strncmp(p, "Balance Inquiry", n) == 0) t->type = TXN_BALANCE_INQUIRY;
+    else return -1;
+    p += n + 1;
+    if (!(p = parseMoney(p, &t->amount)) || *p++ != ';') return -1;
+    if (!(p = parseMoney(p, &t->remainingBalance)) || *p++ != ';') return -1;
+    t->machine = -1;
+    return parseTime(p, &t->time);
+}
+
+static unsigned char *putVarint(unsigned char *p, unsigned long long v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static const unsigned char *getVarint(const unsigned char *p, const unsigned char *end, unsigned long long *v) {
+    unsigned long long r = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char b = *p++;
+        r |= (unsigned long long)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = r;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#define ZIGZAG(v) (((unsigned long long)(v) << 1) ^ (unsigned long long)((long long)(v) >> 63))
+#define UNZIGZAG(u) ((long long)((u) >> 1) ^ -(long long)((u) & 1))
+
+/* Encode one record relative to a segment's base time; returns its length */
+static int txnEncode(const Transaction *t, long long base, unsigned char *out) {
+    unsigned char *p = out + 1;
+    *p++ = (unsigned char)t->type;
+    p = putVarint(p, ZIGZAG(t->accountNumber));
+    p = putVarint(p, ZIGZAG(t->time - base));
+    p = putVarint(p, ZIGZAG(t->amount));
+    p = putVarint(p, ZIGZAG(t->remainingBalance));
+    if (t->type == TXN_INQUIRY_SUMMARY) {
+        p = putVarint(p, (unsigned long long)t->count);
+        p = putVarint(p, ZIGZAG(t->time - t->firstTime));
+    } else if (t->type == TXN_WITHDRAWAL && t->machine >= 0) {
+        p = putVarint(p, (unsigned long long)t->machine);
+        for (int k = 0; k < ATM_NUM_DENOMS; ++k) p = putVarint(p, (unsigned long long)t->notes[k]);
+    }
+    out[0] = (unsigned char)(p - out - 1);
+    return (int)(p - out);
+}
+
+/* Decode the record at p; returns its length, 0 if the n bytes hold only
+   part of it, or -1 if it is malformed */
+static int txnDecode(const unsigned char *p, size_t n, long long base, Transaction *t) {
+    if (n == 0) return 0;
+    size_t len = p[0];
+    if (len < TXN_PAYLOAD_MIN || len >= 0x80) return -1;
+    if (n < len + 1) return 0;
+    const unsigned char *q = p + 2, *end = p + 1 + len;
+    unsigned long long acc, dt, amt, bal, count = 1, span = 0;
+    if (p[1] < TXN_WITHDRAWAL || p[1] > TXN_TYPE_LAST) return -1;
+    if (!(q = getVarint(q, end, &acc)) || !(q = getVarint(q, end, &dt)) ||
+        !(q = getVarint(q, end, &amt)) || !(q = getVarint(q, end, &bal))) return -1;
+    if (p[1] == TXN_INQUIRY_SUMMARY &&
+        (!(q = getVarint(q, end, &count)) || !getVarint(q, end, &span) || count == 0 || count > INT_MAX)) return -1;
+    t->type = (TxnType)p[1];
+    t->accountNumber = (int)UNZIGZAG(acc);
+    t->time = base + UNZIGZAG(dt);
+    t->amount = UNZIGZAG(amt);
+    t->remainingBalance = UNZIGZAG(bal);
+    t->count = (int)count;
+    t->firstTime = t->time - UNZIGZAG(span);
+    /* machine and notes follow in withdrawals logged since they were added */
+    t->machine = -1;
+    if (p[1] == TXN_WITHDRAWAL && q < end) {
+        unsigned long long machine, notes;
+        int k = 0;
+        if ((q = getVarint(q, end, &machine)) && machine <= INT_MAX) {
+            for (; k < ATM_NUM_DENOMS && (q = getVarint(q, end, &notes)) && notes <= INT_MAX; ++k) {
+                t->notes[k] = (int)notes;
+            }
+        }
+        if (k == ATM_NUM_DENOMS) t->machine = (int)machine;
+    }
+    return (int)len + 1;
+}
+
+/* Byte-oriented LZ77 for sealed log blocks: sequences of
+   [literal count][literals][match length - LZ_MIN_MATCH][match distance]
+   (counts as varints), the last without a match. Greedy, with a hash of
+   4-byte prefixes; records of one segment share most of their type, time
+   and balance bytes, so even this simple coder halves them. */
+static unsigned int lzHash(const unsigned char *p) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Compress n bytes into out (room for LZ_BOUND(n)); returns its length */
+static size_t lzCompress(const unsigned char *in, size_t n, unsigned char *out) {
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    unsigned char *o = out;
+    size_t i = 0, lit = 0;
+    while (i + LZ_MIN_MATCH <= n) {
+        unsigned int h = lzHash(in + i);
+        int cand = table[h];
+        table[h] = (int)i;
+        if (cand < 0 || memcmp(in + cand, in + i, LZ_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        size_t len = LZ_MIN_MATCH;
+        while (i + len < n && in[cand + len] == in[i + len]) len++;
+        o = putVarint(o, i - lit);
+        memcpy(o, in + lit, i - lit);
+        o += i - lit;
+        o = putVarint(o, len - LZ_MIN_MATCH);
+        o = putVarint(o, i - (size_t)cand);
+        i += len;
+        lit = i;
+    }
+    o = putVarint(o, n - lit);
+    memcpy(o, in + lit, n - lit);
+    o += n - lit;
+    return (size_t)(o - out);
+}
+
+/* Expand into out (cap bytes); returns the length or -1 if malformed */
+static long lzDecompress(const unsigned char *in, size_t n, unsigned char *out, size_t cap) {
+    const unsigned char *end = in + n;
+    size_t o = 0;
+    while (in < end) {
+        unsigned long long lit, len, dist;
+        if (!(in = getVarint(in, end, &lit)) || lit > (size_t)(end - in) || lit > cap - o) return -1;
+        memcpy(out + o, in, (size_t)lit);
+        in += lit;
+        o += (size_t)lit;
+        if (in == end) break;
+        if (!(in = getVarint(in, end, &len)) || !(in = getVarint(in, end, &dist))) return -1;
+        len += LZ_MIN_MATCH;
+        if (dist == 0 || dist > o || len > cap - o) return -1;
+        if (dist >= len) memcpy(out + o, out + o - (size_t)dist, (size_t)len);
+        else for (size_t k = 0; k < len; ++k) out[o + k] = out[o - (size_t)dist + k];
+        o += (size_t)len;
+    }
+    return (long)o;
+}
+
+/* Block check: FNV-style multiply-xor over 8-byte words, folded to 32
+   bits, so verifying a block costs little next to decompressing it */
+static unsigned int blockChecksum(const unsigned char *p, size_t n) {
+    unsigned long long h = 14695981039346656037ull, w;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 1099511628211ull;
+    }
+    for (; i < n; ++i) h = (h ^ p[i]) * 1099511628211ull;
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+static void txnSegmentPath(char *buf, size_t size, int segment, int compressed) {
+    snprintf(buf, size, "%s.%06d.%s", txnLogPrefix, segment, compressed ? "lgz" : "log");
+}
+
+static int txnSegmentExists(int segment) {
+    char path[MAX_LINE];
+    for (int c = 0; c < 2; ++c) {
+        txnSegmentPath(path, sizeof(path), segment, c);
+        FILE *fp = fopen(path, "rb");
+        if (fp) {
+            fclose(fp);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int txnReadHeader(FILE *fp, int segment, int compressed, TxnSegmentHeader *h) {
+    return fread(h, sizeof(*h), 1, fp) == 1 && memcmp(h->magic, TXN_LOG_MAGIC, sizeof(TXN_LOG_MAGIC)) == 0 &&
+           h->version == TXN_LOG_VERSION && (int)h->segment == segment &&
+           ((h->flags & TXN_SEGMENT_COMPRESSED) != 0) == compressed ? 0 : -1;
+}
+
+/* Open a segment for reading, preferring its compressed form */
+static int txnReaderOpen(TxnReader *r, int segment) {
+    char path[MAX_LINE];
+    TxnSegmentHeader h;
+    memset(r, 0, sizeof(*r));
+    for (int c = 1; c >= 0 && !r->fp; --c) {
+        txnSegmentPath(path, sizeof(path), segment, c);
+        r->fp = fopen(path, "rb");
+        r->compressed = c;
+    }
+    if (!r->fp) return -1;
+    r->buf = malloc(TXN_READ_BUF);
+    r->packed = r->compressed ? malloc(TXN_BLOCK_SIZE) : NULL;
+    if (txnReadHeader(r->fp, segment, r->compressed, &h) != 0 || !r->buf || (r->compressed && !r->packed)) {
+        fclose(r->fp);
+        free(r->buf);
+        free(r->packed);
+        r->fp = NULL;
+        return -1;
+    }
+    r->baseTime = h.baseTime;
+    r->bufOffset = TXN_SEGMENT_HEADER;
+    r->chunk = TXN_BLOCK_SIZE;
+    return 0;
+}
+
+static void txnReaderClose(TxnReader *r) {
+    if (r->fp) fclose(r->fp);
+    free(r->buf);
+    free(r->packed);
+    free(r->table);
+    memset(r, 0, sizeof(*r));
+}
+
+/* Segment offset just past the last record returned */
+static long txnReaderOffset(const TxnReader *r) {
+    return r->bufOffset + (long)r->pos;
+}
+
+/* Append the next block (or raw chunk) to the window, keeping the unread
+   tail; returns 0 at the end of the readable part of the segment */
+static int txnReaderFill(TxnReader *r) {
+    if (r->eof) return 0;
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->bufOffset += (long)r->pos;
+    r->len -= r->pos;
+    r->pos = 0;
+    if (!r->compressed) {
+        /* small reads right after a seek, full blocks once streaming */
+        size_t want = r->chunk < TXN_READ_BUF - r->len ? r->chunk : TXN_READ_BUF - r->len;
+        size_t n = fread(r->buf + r->len, 1, want, r->fp);
+        if (r->chunk < TXN_BLOCK_SIZE) r->chunk *= 2;
+        r->len += n;
+        if (n == 0) r->eof = 1;
+        return n > 0;
+    }
+    TxnBlockHeader b;
+    unsigned char *dst = r->buf + r->len;
+    int ok = fread(&b, sizeof(b), 1, r->fp) == 1 && b.rawLen > 0 && b.rawLen <= TXN_BLOCK_SIZE &&
+             b.storedLen <= b.rawLen && (long)b.rawOffset == r->bufOffset + (long)r->len;
+    if (ok && b.storedLen == b.rawLen) ok = fread(dst, 1, b.rawLen, r->fp) == b.rawLen;
+    else if (ok) ok = fread(r->packed, 1, b.storedLen, r->fp) == b.storedLen &&
+                      lzDecompress(r->packed, b.storedLen, dst, b.rawLen) == (long)b.rawLen;
+    if (!ok || blockChecksum(dst, b.rawLen) != b.check) {
+        r->eof = 1;
+        return 0;
+    }
+    r->len += b.rawLen;
+    return 1;
+}
+
+/* Next record and its segment offset; returns 0 at the end of the
+   readable part of the segment (including a torn or damaged tail) */
+static int txnReaderNext(TxnReader *r, Transaction *t, long *offset) {
+    while (1) {
+        int n = txnDecode(r->buf + r->pos, r->len - r->pos, r->baseTime, t);
+        if (n > 0) {
+            if (offset) *offset = txnReaderOffset(r);
+            r->pos += (size_t)n;
+            return 1;
+        }
+        if (n < 0 || !txnReaderFill(r)) return 0;
+    }
+}
+
+/* Position the reader at a record offset */
+static int txnReaderSeek(TxnReader *r, long offset) {
+    if (offset >= r->bufOffset && offset < r->bufOffset + (long)r->len) {
+        r->pos = (size_t)(offset - r->bufOffset);
+        return 0;
+    }
+    r->len = r->pos = 0;
+    r->eof = 0;
+    if (!r->compressed) {
+        r->bufOffset = offset;
+        r->chunk = 4096;
+        return fseek(r->fp, offset, SEEK_SET);
+    }
+    if (!r->table) {
+        /* block table: {raw offset, file offset} pairs, then count and its offset */
+        unsigned int tail[2];
+        if (fseek(r->fp, -8, SEEK_END) != 0 || fread(tail, 4, 2, r->fp) != 2 || tail[0] == 0) return -1;
+        r->table = malloc(sizeof(unsigned int) * 2 * tail[0]);
+        if (!r->table || fseek(r->fp, (long)tail[1], SEEK_SET) != 0 ||
+            fread(r->table, sizeof(unsigned int) * 2, tail[0], r->fp) != tail[0]) {
+            free(r->table);
+            r->table = NULL;
+            return -1;
+        }
+        r->tableCount = tail[0];
+    }
+    unsigned int lo = 0, hi = r->tableCount;
+    while (hi - lo > 1) {
+        unsigned int mid = (lo + hi) / 2;
+        if ((long)r->table[2 * mid] <= offset) lo = mid;
+        else hi = mid;
+    }
+    r->bufOffset = (long)r->table[2 * lo];
+    if (fseek(r->fp, (long)r->table[2 * lo + 1], SEEK_SET) != 0 || !txnReaderFill(r)) return -1;
+    if (offset - r->bufOffset >= (long)r->len) return -1;
+    r->pos = (size_t)(offset - r->bufOffset);
+    return 0;
+}
+
+/* Stream the log from `from` to its end (flushed records only), oldest
+   first; fn returns nonzero to stop. Positions in segment 0 (checkpoints
+   of the old text log) mean the start of the log. Returns the position
+   just past the last complete record seen. */
+TxnPos txnLogScan(TxnPos from, int (*fn)(const Transaction *t, TxnPos pos, void *ctx), void *ctx) {
+    int seg = TXN_POS_SEGMENT(from);
+    long off = TXN_POS_OFFSET(from);
+    if (seg < txnFirstSegment) {
+        seg = txnFirstSegment;
+        off = TXN_SEGMENT_HEADER;
+    }
+    TxnPos end = TXN_POS(seg, off);
+    for (int stop = 0; !stop && seg <= txnSegment; ++seg, off = TXN_SEGMENT_HEADER) {
+        TxnReader r;
+        if (txnReaderOpen(&r, seg) != 0) continue;
+        if (off == TXN_SEGMENT_HEADER || txnReaderSeek(&r, off) == 0) {
+            Transaction t;
+            long at;
+            while (txnReaderNext(&r, &t, &at)) {
+                if (fn && fn(&t, TXN_POS(seg, at), ctx)) {
+                    stop = 1;
+                    break;
+                }
+            }
+            end = TXN_POS(seg, txnReaderOffset(&r));
+        }
+        txnReaderClose(&r);
+    }
+    return end;
+}
+
+/* Start of the segment holding records from `when` on: the last one based
+   at or before it (segments are based at the time they were started) */
+TxnPos txnLogSince(long long when) {
+    char path[MAX_LINE];
+    for (int seg = txnSegment; seg > txnFirstSegment; --seg) {
+        TxnSegmentHeader h;
+        int found = 0;
+        for (int c = 1; c >= 0 && !found; --c) {
+            txnSegmentPath(path, sizeof(path), seg, c);
+            FILE *fp = fopen(path, "rb");
+            if (!fp) continue;
+            found = txnReadHeader(fp, seg, c, &h) == 0;
+            fclose(fp);
+        }
+        if (found && h.baseTime <= when) return TXN_POS(seg, TXN_SEGMENT_HEADER);
+    }
+    return 0;
+}
+
+/* Rewrite a sealed segment as its compressed form and drop the raw file */
+static int txnCompressSegment(int segment) {
+    char raw[MAX_LINE], packedPath[MAX_LINE], tmp[MAX_LINE + 8];
+    txnSegmentPath(raw, sizeof(raw), segment, 0);
+    txnSegmentPath(packedPath, sizeof(packedPath), segment, 1);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", packedPath);
+    FILE *in = fopen(raw, "rb");
+    if (!in) return 0;
+    TxnSegmentHeader h;
+    FILE *out = NULL;
+    unsigned char *buf = malloc(TXN_BLOCK_SIZE), *packed = malloc(LZ_BOUND(TXN_BLOCK_SIZE));
+    unsigned int *table = NULL, count = 0, cap = 0;
+    int ok = buf && packed && txnReadHeader(in, segment, 0, &h) == 0 && (out = fopen(tmp, "wb")) != NULL;
+    if (ok) {
+        h.flags |= TXN_SEGMENT_COMPRESSED;
+        ok = fwrite(&h, sizeof(h), 1, out) == 1;
+    }
+    size_t len = 0;
+    unsigned int rawOffset = TXN_SEGMENT_HEADER;
+    while (ok) {
+        len += fread(buf + len, 1, TXN_BLOCK_SIZE - len, in);
+        /* cut after the last whole record */
+        size_t cut = 0;
+        while (cut < len && buf[cut] >= TXN_PAYLOAD_MIN && buf[cut] < 0x80 && cut + buf[cut] + 1 <= len) {
+            cut += buf[cut] + 1u;
+        }
+        if (cut == 0) break;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            unsigned int *grown = realloc(table, sizeof(unsigned int) * 2 * cap);
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            table = grown;
+        }
+        table[2 * count] = rawOffset;
+        table[2 * count + 1] = (unsigned int)ftell(out);
+        count++;
+        TxnBlockHeader b;
+        size_t stored = lzCompress(buf, cut, packed);
+        b.rawOffset = rawOffset;
+        b.rawLen = (unsigned int)cut;
+        b.storedLen = stored < cut ? (unsigned int)stored : (unsigned int)cut;
+        b.check = blockChecksum(buf, cut);
+        ok = fwrite(&b, sizeof(b), 1, out) == 1 &&
+             fwrite(stored < cut ? packed : buf, 1, b.storedLen, out) == b.storedLen;
+        memmove(buf, buf + cut, len - cut);
+        len -= cut;
+        rawOffset += (unsigned int)cut;
+    }
+    if (ok) {
+        TxnBlockHeader end;
+        memset(&end, 0, sizeof(end));
+        unsigned int tail[2] = {count, 0};
+        ok = fwrite(&end, sizeof(end), 1, out) == 1;
+        tail[1] = (unsigned int)ftell(out);
+        ok = ok && (count == 0 || fwrite(table, sizeof(unsigned int) * 2, count, out) == count) &&
+             fwrite(tail, 4, 2, out) == 2 && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    }
+    fclose(in);
+    if (out && fclose(out) != 0) ok = 0;
+    free(buf);
+    free(packed);
+    free(table);
+    if (!ok || rename(tmp, packedPath) != 0) {
+        if (out) remove(tmp);
+        return -1;
+    }
+    remove(raw);
+    return 0;
+}
+
+/* Write everything in the ring buffer to the active segment (txnLock held) */
+static void txnDrainLocked(void) {
+    while (txnLen > 0) {
+        size_t start = (txnHead + TXN_RING_SIZE - txnLen) % TXN_RING_SIZE;
+        size_t chunk = txnLen;
+        if (start + chunk > TXN_RING_SIZE) chunk = TXN_RING_SIZE - start;
+        if (fwrite(txnRing + start, 1, chunk, txnFp) != chunk) {
+            printf("Warning: unable to write transaction file. %lu bytes not logged.\n",
+                   (unsigned long)txnLen);
+            txnLen = 0;
+            break;
+        }
+        txnLen -= chunk;
+    }
+    fflush(txnFp);
+}
+
+/* Make a new, empty segment the active one */
+static int txnSegmentCreate(int segment, long long now) {
+    char path[MAX_LINE];
+    txnSegmentPath(path, sizeof(path), segment, 0);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return -1;
+    TxnSegmentHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TXN_LOG_MAGIC, sizeof(TXN_LOG_MAGIC));
+    h.version = TXN_LOG_VERSION;
+    h.segment = (unsigned int)segment;
+    h.baseTime = now;
+    if (fwrite(&h, sizeof(h), 1, fp) != 1 || fflush(fp) != 0) {
+        fclose(fp);
+        remove(path);
+        return -1;
+    }
+    txnFp = fp;
+    txnSegment = segment;
+    txnSegmentBase = now;
+    txnLogEnd = TXN_SEGMENT_HEADER;
+    return 0;
+}
+
+/* Seal the active segment and start the next one (txnLock held). If the
+   new segment cannot be created, appending to the old one continues. */
+static void txnRotateLocked(long long now) {
+    txnDrainLocked();
+    fsync(fileno(txnFp));
+    FILE *old = txnFp;
+    if (txnSegmentCreate(txnSegment + 1, now) != 0) {
+        printf("Warning: unable to start a new transaction log segment.\n");
+        txnSegmentBase = now; /* retry after another interval */
+        return;
+    }
+    fclose(old);
+    if (txnCompressSealed) pthread_cond_signal(&txnCond);
+}
+
+/* Background flusher: drains the ring on the size or time threshold,
+   compresses sealed segments and builds their history columns */
+static void *txnFlusherMain(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&txnLock);
+    while (!txnStop) {
+        struct timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        ts.tv_nsec += (long)TXN_FLUSH_INTERVAL_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&txnCond, &txnLock, &ts);
+        if (__atomic_load_n(&inquiryTallyCount, __ATOMIC_RELAXED) > 0 && (long long)time(NULL) >= inquiryFlushDue) {
+            pthread_mutex_unlock(&txnLock);
+            inquiryFlushAll();
+            pthread_mutex_lock(&txnLock);
+        }
+        if (txnLen > 0) txnDrainLocked();
+        while (txnCompressSealed && txnCompressNext < txnSegment && !txnStop) {
+            int seg = txnCompressNext;
+            pthread_mutex_unlock(&txnLock);
+            if (txnCompressSegment(seg) != 0) printf("Warning: unable to compress transaction log segment %d.\n", seg);
+            pthread_mutex_lock(&txnLock);
+            txnCompressNext = seg + 1;
+        }
+        while (histStoreSealed && histStoreNext < txnSegment && !txnStop) {
+            int seg = histStoreNext;
+            pthread_mutex_unlock(&txnLock);
+            if (historyStoreBuild(seg) != 0) printf("Warning: unable to build the history columns of segment %d.\n", seg);
+            pthread_mutex_lock(&txnLock);
+            histStoreNext = seg + 1;
+        }
+    }
+    pthread_mutex_unlock(&txnLock);
+    return NULL;
+}
+
+/* Open the log: find its segments, index what the saved index does not
+   cover, cut a torn tail off the active segment, then start the flusher.
+   A log from before the binary format (transactions.txt) is imported into
+   the first segment. */
+int txnLogOpen(void) {
+    char path[MAX_LINE];
+    txnFirstSegment = historyIndexFirstSegment();
+    if (!txnSegmentExists(txnFirstSegment)) txnFirstSegment = 1;
+    int last = txnFirstSegment - 1;
+    while (txnSegmentExists(last + 1)) last++;
+    int importText = 0;
+    long long now = (long long)time(NULL);
+    txnSegment = last;
+    txnFp = NULL;
+    if (last >= txnFirstSegment) {
+        TxnSegmentHeader h;
+        txnSegmentPath(path, sizeof(path), last, 0);
+        FILE *fp = fopen(path, "rb+");
+        if (fp && txnReadHeader(fp, last, 0, &h) == 0) {
+            txnFp = fp;
+            txnSegmentBase = h.baseTime;
+        } else if (fp) {
+            fclose(fp);
+        }
+    } else {
+        FILE *tf = fopen(TXN_TEXT_FILE, "rb");
+        if (tf) {
+            fclose(tf);
+            importText = strcmp(txnLogPrefix, TXN_LOG_PREFIX) == 0;
+        }
+    }
+
+    TxnPos end = historyIndexLoad();
+    if (txnFp) {
+        /* appends continue after the last complete record */
+        txnLogEnd = TXN_POS_SEGMENT(end) == txnSegment ? TXN_POS_OFFSET(end) : TXN_SEGMENT_HEADER;
+        if (fseek(txnFp, 0, SEEK_END) != 0 || ftell(txnFp) != txnLogEnd) {
+            fflush(txnFp);
+            if (ftruncate(fileno(txnFp), txnLogEnd) != 0) printf("Warning: unable to trim the transaction log.\n");
+        }
+        fseek(txnFp, txnLogEnd, SEEK_SET);
+    } else if (txnSegmentCreate(last + 1, now) != 0) {
+        printf("Warning: unable to open transaction file. Transactions will not be logged.\n");
+        return -1;
+    }
+    if (importText) {
+        FILE *tf = fopen(TXN_TEXT_FILE, "rb");
+        long imported = 0;
+        char line[MAX_LINE];
+        Transaction t;
+        while (tf && fgets(line, sizeof(line), tf)) {
+            if (parseTransactionLine(line, &t) != 0) continue;
+            recordTransaction(&t, TXN_FLUSH_LAZY);
+            imported++;
+        }
+        if (tf) fclose(tf);
+        txnLogFlush();
+        printf("Imported %ld transactions from %s.\n", imported, TXN_TEXT_FILE);
+    }
+    txnStop = 0;
+    txnCompressNext = txnFirstSegment;
+    histStoreNext = txnFirstSegment;
+    txnFlusherRunning = pthread_create(&txnFlusher, NULL, txnFlusherMain, NULL) == 0;
+    return 0;
+}
+
+/* Push all buffered records to the file (before the log is read back) */
+void txnLogFlush(void) {
+    pthread_mutex_lock(&txnLock);
+    if (txnFp) txnDrainLocked();
+    pthread_mutex_unlock(&txnLock);
+}
+
+/* Push all buffered records to the file and fsync it, so records the
+   journal is about to forget survive a power loss. Returns 0 once they
+   are on disk. */
+int txnLogSync(void) {
+    pthread_mutex_lock(&txnLock);
+    int rc = 0;
+    if (txnFp) {
+        txnDrainLocked();
+        if (ferror(txnFp) || fsync(fileno(txnFp)) != 0) rc = -1;
+    }
+    pthread_mutex_unlock(&txnLock);
+    return rc;
+}
+
+/* Position where the next record will be written (after a flush) */
+TxnPos txnLogPosition(void) {
+    pthread_mutex_lock(&txnLock);
+    if (txnFp) txnDrainLocked();
+    TxnPos pos = TXN_POS(txnSegment, txnLogEnd);
+    pthread_mutex_unlock(&txnLock);
+    return pos;
+}
+
+/* Stop the flusher, write what is left and close the log */
+void txnLogClose(void) {
+    pthread_mutex_lock(&txnLock);
+    txnStop = 1;
+    pthread_cond_signal(&txnCond);
+    pthread_mutex_unlock(&txnLock);
+    if (txnFlusherRunning) pthread_join(txnFlusher, NULL);
+    txnFlusherRunning = 0;
+    if (txnFp) {
+        txnDrainLocked();
+        fclose(txnFp);
+        txnFp = NULL;
+        historyIndexSave();
+    }
+    historyIndexFree();
+    historyStoreFree();
+}
+
+/* Append a transaction to the log.
+   The record is staged in the ring buffer; `durability` decides whether it
+   is also written out (and fsynced) before returning. */
+void recordTransaction(const Transaction *t, TxnDurability durability) {
+    unsigned char rec[TXN_RECORD_MAX];
+    pthread_mutex_lock(&txnLock);
+    if (!txnFp) {
+        pthread_mutex_unlock(&txnLock);
+        printf("Warning: unable to open transaction file. Transaction not logged.\n");
+        return;
+    }
+    if (txnLogEnd > TXN_SEGMENT_HEADER &&
+        (txnLogEnd + TXN_RECORD_MAX > txnRotateBytes || t->time - txnSegmentBase >= txnRotateSeconds)) {
+        txnRotateLocked(t->time);
+    }
+    int n = txnEncode(t, txnSegmentBase, rec);
+    if (txnLen + (size_t)n > TXN_RING_SIZE) txnDrainLocked();
+    historyIndexAdd(t->accountNumber, TXN_POS(txnSegment, txnLogEnd));
+    txnLogEnd += n;
+    for (int i = 0; i < n; ++i) {
+        txnRing[txnHead] = (char)rec[i];
+        txnHead = (txnHead + 1) % TXN_RING_SIZE;
+    }
+    txnLen += (size_t)n;
+    if (durability != TXN_FLUSH_LAZY) {
+        txnDrainLocked();
+        if (durability == TXN_FLUSH_SYNC) fsync(fileno(txnFp));
+    } else if (txnLen >= TXN_FLUSH_THRESHOLD) {
+        pthread_cond_signal(&txnCond);
+    }
+    pthread_mutex_unlock(&txnLock);
+}
+
+/* Call fn for each of an account's transactions, oldest first.
+   Only that account's records are read, by seeking to the positions held
+   in the history index; a compressed segment costs one block decode per
+   distinct block. lastN > 0 limits this to the most recent lastN records;
+   0 visits everything. Returns the account's total record count, or -1 if
+   the log is not open. */
+int forEachTransaction(int accNum, int lastN, void (*fn)(const Transaction *t, void *ctx), void *ctx) {
+    txnLogFlush();
+    /* copy the positions we need so the log can keep growing meanwhile */
+    pthread_mutex_lock(&txnLock);
+    if (txnSegment == 0) {
+        pthread_mutex_unlock(&txnLock);
+        return -1;
+    }
+    HistoryList *list = historyIndexFind(accNum);
+    int total = list ? list->count : 0;
+    int start = (lastN > 0 && total > lastN) ? total - lastN : 0;
+    TxnPos *positions = NULL;
+    if (total > start) {
+        positions = malloc(sizeof(TxnPos) * (total - start));
+        if (positions) memcpy(positions, list->positions + start, sizeof(TxnPos) * (total - start));
+    }
+    pthread_mutex_unlock(&txnLock);
+
+    TxnReader r;
+    int seg = 0, open = 0;
+    for (int i = 0; positions && i < total - start; ++i) {
+        if (!open || TXN_POS_SEGMENT(positions[i]) != seg) {
+            if (open) txnReaderClose(&r);
+            seg = TXN_POS_SEGMENT(positions[i]);
+            open = txnReaderOpen(&r, seg) == 0;
+        }
+        Transaction t;
+        if (open && txnReaderSeek(&r, TXN_POS_OFFSET(positions[i])) == 0 &&
+            txnReaderNext(&r, &t, NULL) && t.accountNumber == accNum) {
+            fn(&t, ctx);
+        }
+    }
+    if (open) txnReaderClose(&r);
+    free(positions);
+    return total;
+}
+
+/* Console listing of one history record */
+static void printTransaction(const Transaction *t, void *ctx) {
+    int *shown = ctx;
+    char amount[MONEY_BUF], balance[MONEY_BUF], when[TIME_BUF], since[TIME_BUF];
+    if (t->type == TXN_INQUIRY_SUMMARY) {
+        printf("[%s] Balance Inquiry x%d since %s | Balance: ₹%s\n", formatTime(t->time, when), t->count,
+               formatTime(t->firstTime, since), formatMoney(t->remainingBalance, balance));
+    } else {
+        printf("[%s] %s : ₹%s | Balance: ₹%s\n", formatTime(t->time, when), txnTypeName(t->type),
+               formatMoney(t->amount, amount), formatMoney(t->remainingBalance, balance));
+    }
+    (*shown)++;
+}
+
+/* Show transaction history for a particular account.
+   lastN > 0 shows only the most recent lastN records; 0 shows everything. */
+void showTransactionHistory(int accNum, int lastN) {
+    int shown = 0;
+    printLine();
+    printf("Transaction History for Account %d\n", accNum);
+    printLine();
+    int total = forEachTransaction(accNum, lastN, printTransaction, &shown);
+    if (total < 0) {
+        printf("No transaction history found.\n");
+    } else if (shown == 0) {
+        printf("No transactions found for this account.\n");
+    } else if (shown < total) {
+        printf("(most recent %d of %d)\n", shown, total);
+    }
+    printLine();
+}
+
+static int dumpTransaction(const Transaction *t, TxnPos pos, void *ctx) {
+    char line[TXN_LINE_MAX];
+    (void)pos;
+    if (formatTransactionLine(t, line, sizeof(line)) > 0) fputs(line, (FILE *)ctx);
+    return 0;
+}
+
+/* Stream the whole log as text lines in the old transactions.txt format */
+int dumpTransactionLog(FILE *out) {
+    if (txnLogOpen() != 0) return -1;
+    txnLogScan(0, dumpTransaction, out);
+    txnLogClose();
+    return fflush(out) == 0 ? 0 : -1;
+}
+
+/* --------------------- PIN hashing ---------------------
+   SHA-256 (FIPS 180-4), HMAC-SHA256 and single-block PBKDF2 for the stored
+   PIN hashes, plus the per-process login tags and token buckets that keep
+   repeated and brute-force logins from costing a hash each. */
+
+static const unsigned int sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Compress(unsigned int st[8], const unsigned char *block) {
+    unsigned int w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (unsigned int)block[4 * i] << 24 | (unsigned int)block[4 * i + 1] << 16 |
+               (unsigned int)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        unsigned int s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned int s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    unsigned int a = st[0], b = st[1], c = st[2], d = st[3], e = st[4], f = st[5], g = st[6], h = st[7];
+    for (int i = 0; i < 64; ++i) {
+        unsigned int t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        unsigned int t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+    st[4] += e;
+    st[5] += f;
+    st[6] += g;
+    st[7] += h;
+}
+
+static void sha256Init(Sha256 *c) {
+    static const unsigned int iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                       0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(c->state, iv, sizeof(iv));
+    c->used = 0;
+    c->total = 0;
+}
+
+static void sha256Update(Sha256 *c, const void *data, size_t n) {
+    const unsigned char *p = data;
+    c->total += n;
+    while (n > 0) {
+        size_t take = 64 - c->used < n ? 64 - c->used : n;
+        memcpy(c->block + c->used, p, take);
+        c->used += take;
+        p += take;
+        n -= take;
+        if (c->used == 64) {
+            sha256Compress(c->state, c->block);
+            c->used = 0;
+        }
+    }
+}
+
+/* Write the digest of the state words big-endian */
+static void sha256Digest(const unsigned int st[8], unsigned char *out) {
+    for (int i = 0; i < 8; ++i) {
+        out[4 * i] = (unsigned char)(st[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(st[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(st[i] >> 8);
+        out[4 * i + 3] = (unsigned char)st[i];
+    }
+}
+
+static void sha256Final(Sha256 *c, unsigned char out[PIN_HASH_LEN]) {
+    unsigned long long bits = c->total * 8;
+    c->block[c->used++] = 0x80;
+    if (c->used > 56) {
+        memset(c->block + c->used, 0, 64 - c->used);
+        sha256Compress(c->state, c->block);
+        c->used = 0;
+    }
+    memset(c->block + c->used, 0, 56 - c->used);
+    for (int i = 0; i < 8; ++i) c->block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256Compress(c->state, c->block);
+    sha256Digest(c->state, out);
+}
+
+static void hmacInit(HmacSha256 *m, const void *key, size_t n) {
+    unsigned char pad[64];
+    memset(pad, 0, sizeof(pad));
+    if (n > 64) {
+        Sha256 c;
+        sha256Init(&c);
+        sha256Update(&c, key, n);
+        sha256Final(&c, pad);
+    } else {
+        memcpy(pad, key, n);
+    }
+    for (int i = 0; i < 64; ++i) pad[i] ^= 0x36;
+    sha256Init(&m->inner);
+    sha256Update(&m->inner, pad, 64);
+    for (int i = 0; i < 64; ++i) pad[i] ^= 0x36 ^ 0x5c;
+    sha256Init(&m->outer);
+    sha256Update(&m->outer, pad, 64);
+}
+
+static void hmacCompute(const HmacSha256 *m, const void *msg, size_t n, unsigned char out[PIN_HASH_LEN]) {
+    Sha256 c = m->inner;
+    unsigned char inner[PIN_HASH_LEN];
+    sha256Update(&c, msg, n);
+    sha256Final(&c, inner);
+    c = m->outer;
+    sha256Update(&c, inner, sizeof(inner));
+    sha256Final(&c, out);
+}
+
+/* PBKDF2-HMAC-SHA256 of the PIN's decimal text, one output block. Every
+   round after the first hashes a 32-byte message, so its inner and outer
+   blocks are laid out once and compressed straight from the key's states. */
+static void pinHash(int pin, const unsigned char salt[PIN_SALT_LEN], unsigned int iterations,
+                    unsigned char out[PIN_HASH_LEN]) {
+    char text[12];
+    HmacSha256 m;
+    hmacInit(&m, text, (size_t)(putInt(text, pin) - text));
+    unsigned char msg[PIN_SALT_LEN + 4];
+    memcpy(msg, salt, PIN_SALT_LEN);
+    msg[PIN_SALT_LEN] = msg[PIN_SALT_LEN + 1] = msg[PIN_SALT_LEN + 2] = 0;
+    msg[PIN_SALT_LEN + 3] = 1; // block index
+    unsigned char block[64];
+    hmacCompute(&m, msg, sizeof(msg), block);
+    memcpy(out, block, PIN_HASH_LEN);
+    /* padding of a 32-byte message after one 64-byte key block: 768 bits */
+    memset(block + PIN_HASH_LEN, 0, 64 - PIN_HASH_LEN);
+    block[PIN_HASH_LEN] = 0x80;
+    block[62] = 0x03;
+    for (unsigned int r = 1; r < iterations; ++r) {
+        unsigned int st[8];
+        memcpy(st, m.inner.state, sizeof(st));
+        sha256Compress(st, block);
+        sha256Digest(st, block);
+        memcpy(st, m.outer.state, sizeof(st));
+        sha256Compress(st, block);
+        sha256Digest(st, block);
+        for (int i = 0; i < PIN_HASH_LEN; ++i) out[i] ^= block[i];
+    }
+}
+
+/* Fill out with n random bytes from /dev/urandom, or where that cannot be
+   read, with a hash of the clocks and a counter (unique, not secret) */
+static void randomBytes(void *out, size_t n) {
+    static unsigned long fallbackCount = 0;
+    FILE *fp = fopen("/dev/urandom", "rb");
+    size_t got = fp ? fread(out, 1, n, fp) : 0;
+    if (fp) fclose(fp);
+    unsigned char *p = (unsigned char *)out + got;
+    n -= got;
+    while (n > 0) {
+        struct {
+            unsigned long count;
+            double mono;
+            time_t now;
+            clock_t cpu;
+            const void *where;
+        } seed = {__atomic_add_fetch(&fallbackCount, 1, __ATOMIC_RELAXED), monotonicSeconds(), time(NULL),
+                  clock(), p};
+        unsigned char digest[PIN_HASH_LEN];
+        Sha256 c;
+        sha256Init(&c);
+        sha256Update(&c, &seed, sizeof(seed));
+        sha256Final(&c, digest);
+        size_t take = n < sizeof(digest) ? n : sizeof(digest);
+        memcpy(p, digest, take);
+        p += take;
+        n -= take;
+    }
+}
+
+/* Compare two digests in time independent of where they differ */
+static int digestEqual(const unsigned char *a, const unsigned char *b) {
+    unsigned char diff = 0;
+    for (int i = 0; i < PIN_HASH_LEN; ++i) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+static void loginTagInit(void) {
+    unsigned char key[PIN_HASH_LEN];
+    randomBytes(key, sizeof(key));
+    hmacInit(&loginTagKey, key, sizeof(key));
+}
+
+/* Keyed tag of an (account, PIN, salt) triple, never 0. Matching the tag
+   of the PIN last verified lets a repeat login skip the PBKDF2 rounds; the
+   key lives only in this process, so tags are never written anywhere. */
+static unsigned long long loginTag(int accNum, int pin, const PinHash *cred) {
+    pthread_once(&loginTagOnce, loginTagInit);
+    unsigned char msg[8 + PIN_SALT_LEN], digest[PIN_HASH_LEN];
+    memcpy(msg, &accNum, 4);
+    memcpy(msg + 4, &pin, 4);
+    memcpy(msg + 8, cred->salt, PIN_SALT_LEN);
+    hmacCompute(&loginTagKey, msg, sizeof(msg), digest);
+    unsigned long long tag;
+    memcpy(&tag, digest, sizeof(tag));
+    return tag | 1;
+}
+
+/* Login state of account idx, allocated a chunk at a time on first use.
+   NULL if that allocation fails: the account then has no bucket, so PIN
+   checks it would pay for are refused as throttled rather than let through
+   (see loginAccountTakeToken). */
+static LoginState *loginStateOf(int idx) {
+    int c = idx >> ACCOUNT_CHUNK_SHIFT;
+    LoginState *chunk = __atomic_load_n(&loginChunks[c], __ATOMIC_ACQUIRE);
+    if (!chunk) {
+        pthread_mutex_lock(&loginChunkLock);
+        chunk = loginChunks[c];
+        if (!chunk && (chunk = calloc(ACCOUNT_CHUNK, sizeof(LoginState)))) {
+            __atomic_store_n(&loginChunks[c], chunk, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&loginChunkLock);
+    }
+    return chunk ? &chunk[idx & (ACCOUNT_CHUNK - 1)] : NULL;
+}
+
+/* The same, without allocating: NULL if the account never logged in */
+static LoginState *loginStatePeek(int idx) {
+    LoginState *chunk = __atomic_load_n(&loginChunks[idx >> ACCOUNT_CHUNK_SHIFT], __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[idx & (ACCOUNT_CHUNK - 1)] : NULL;
+}
+
+/* Add the tokens earned since *refilled, up to burst. A zeroed bucket
+   (never used) comes out full. */
+static void bucketTopUp(float *tokens, double *refilled, double now, double perSecond, int burst) {
+    double t = *tokens + (now - *refilled) * perSecond;
+    *tokens = t > burst ? (float)burst : (float)t;
+    *refilled = now;
+}
+
+/* Bucket of terminal (loginTerminalLock held). Terminals that hash to a
+   slot share it until its owner's bucket is full again, so spreading
+   failures over many addresses cannot reset one. */
+static LoginTerminal *loginTerminalOf(unsigned int terminal, double now) {
+    LoginTerminal *t = &loginTerminals[(terminal * 2654435761u) >> 20 & (LOGIN_TERMINAL_SLOTS - 1)];
+    bucketTopUp(&t->tokens, &t->refilled, now, 1.0 / LOGIN_TERMINAL_REFILL, LOGIN_TERMINAL_BURST);
+    if (t->terminal != terminal && t->tokens >= LOGIN_TERMINAL_BURST) t->terminal = terminal;
+    return t;
+}
+
+/* Whether terminal may try a PIN now, and optionally charge it one failure */
+static int loginTerminalAllows(unsigned int terminal, int charge) {
+    double now = monotonicSeconds();
+    pthread_mutex_lock(&loginTerminalLock);
+    LoginTerminal *t = loginTerminalOf(terminal, now);
+    int ok = t->tokens >= 1;
+    if (charge && t->tokens > 0) t->tokens = t->tokens >= 1 ? t->tokens - 1 : 0;
+    pthread_mutex_unlock(&loginTerminalLock);
+    return ok;
+}
+
+/* Take one PBKDF2 attempt from account idx's bucket (its lock held). An
+   account without login state has no bucket and gets no attempt: a
+   brute-force guard must not fail open when memory runs short. */
+static int loginAccountTakeToken(LoginState *ls) {
+    if (!ls) return 0;
+    bucketTopUp(&ls->tokens, &ls->refilled, monotonicSeconds(), 1.0 / LOGIN_ACCOUNT_REFILL, LOGIN_ACCOUNT_BURST);
+    if (ls->tokens < 1) return 0;
+    ls->tokens -= 1;
+    return 1;
+}
+
+/* Hash pin as the new PIN of account idx with a fresh salt. The hash is
+   computed before the account lock is taken; the credential reaches the
+   snapshot at the next checkpoint (the record is marked dirty by the
+   caller). Returns -1, leaving the account as it was, if its login state
+   cannot be allocated. */
+int accountSetPin(int idx, int pin) {
+    LoginState *ls = loginStateOf(idx);
+    if (!ls) return -1;
+    PinHash cred;
+    cred.iterations = PIN_HASH_ITERATIONS;
+    randomBytes(cred.salt, PIN_SALT_LEN);
+    pinHash(pin, cred.salt, cred.iterations, cred.hash);
+    cred.check = credChecksum(&cred, (unsigned int)idx);
+    __atomic_add_fetch(&loginHashes, 1, __ATOMIC_RELAXED);
+    unsigned long long tag = loginTag(accountAt(idx)->accountNumber, pin, &cred);
+    lockAccount(idx);
+    *credAt(idx) = cred;
+    accountAt(idx)->pin = 0;
+    ls->credDirty = 1;
+    ls->pinTag = tag;
+    unlockAccount(idx);
+    return 0;
+}
+
+/* --------------------- Write-ahead journal ---------------------
+   Journal format (journal.txt, and journal.<k>.txt for shard k > 0):
+   C;<transaction log position (TxnPos) at checkpoint>;<generation>
+   W;seq;acc;amount;balanceAfter;<notes taken per cassette>;time;machine
+   L;seq;acc;loginAttempts;locked
+   One W record carries the account debit (as the resulting balance), the
+   notes taken, the machine they came from and enough to rebuild the
+   transaction log entry. Replay sets balances from the post-image and
+   subtracts the notes from the inventory saved at the checkpoint; sessions
+   run in parallel, so an ATM post-image would not be meaningful. An L
+   record is written when an account is locked or unlocked, so a lockout
+   outlives a crash without a snapshot write per failed login. An
+   account's records all go to one shard, so they replay in order.
+   The generation is that of the inventory files saved by the checkpoint
+   (see jnlCheckpointGen); older C records have none (generation 0).
+   Records from older builds have no machine (machine 0). Before that they
+   also carried the notes left per cassette after the taken counts, which
+   are ignored; their time was a local datetime rather than epoch seconds,
+   and their C offset points into the old text log (read as the start of
+   the log).
+*/
+
+static unsigned int hashAccountNumber(int accNum);
+
+static JournalShard *jnlShardOf(int accNum) {
+    return &jnlShards[hashAccountNumber(accNum) % (unsigned int)jnlShardCount];
+}
+
+static void journalPath(char *buf, size_t size, int shard) {
+    if (shard == 0) snprintf(buf, size, "%s.txt", jnlPrefix);
+    else snprintf(buf, size, "%s.%d.txt", jnlPrefix, shard);
+}
+
+/* Set up the shard locks (once, before the journal is first used) */
+static void journalInitShards(void) {
+    static int done = 0;
+    if (done) return;
+    for (int i = 0; i < JNL_MAX_SHARDS; ++i) {
+        pthread_mutex_init(&jnlShards[i].lock, NULL);
+        pthread_cond_init(&jnlShards[i].cond, NULL);
+    }
+    done = 1;
+}
+
+/* Start a fresh shard file containing only the checkpoint header
+   (shard lock held) */
+static int journalReset(JournalShard *j) {
+    char path[MAX_LINE];
+    journalPath(path, sizeof(path), (int)(j - jnlShards));
+    if (j->fp) fclose(j->fp);
+    j->fp = fopen(path, "wb");
+    if (!j->fp) {
+        printf("Error: Unable to open journal file for writing.\n");
+        return -1;
+    }
+    fprintf(j->fp, "C;%lld;%lu\n", (long long)txnLogPosition(), jnlCheckpointGen);
+    if (fflush(j->fp) != 0 || fsync(fileno(j->fp)) != 0) return -1;
+    /* anything still pending is already part of the snapshot just saved */
+    j->pendingLen = 0;
+    j->durableSeq = j->nextSeq;
+    for (int i = 0; i < j->dirtyCount; ++i) j->dirtyMark[j->dirty[i]] = 0;
+    j->dirtyCount = 0;
+    return 0;
+}
+
+/* Open the journal shards for appending (call after recoverJournal) and
+   remove the files of shards beyond the current count */
+int journalOpen(void) {
+    journalInitShards();
+    /* recovery may have re-appended records the log lost */
+    if (txnLogSync() != 0) return -1;
+    int rc = 0;
+    for (int i = 0; i < jnlShardCount; ++i) {
+        pthread_mutex_lock(&jnlShards[i].lock);
+        if (journalReset(&jnlShards[i]) != 0) rc = -1;
+        pthread_mutex_unlock(&jnlShards[i].lock);
+    }
+    char path[MAX_LINE];
+    for (int i = jnlShardCount; i < JNL_MAX_SHARDS; ++i) {
+        journalPath(path, sizeof(path), i);
+        remove(path);
+    }
+    return rc;
+}
+
+/* Write and fsync pending records until `seq` is durable (shard lock held).
+   Whoever finds no sync in progress becomes the leader and flushes
+   everything pending; the others wait for it. */
+static void journalSyncLocked(JournalShard *j, unsigned long seq) {
+    while (j->durableSeq < seq && !j->failed) {
+        if (j->syncing) {
+            pthread_cond_wait(&j->cond, &j->lock);
+            continue;
+        }
+        /* become the leader for everything pending so far */
+        j->syncing = 1;
+        unsigned long upto = j->nextSeq;
+        char *buf = j->pending;
+        size_t n = j->pendingLen;
+        j->pending = NULL;
+        j->pendingLen = j->pendingCap = 0;
+        pthread_mutex_unlock(&j->lock);
+
+        int ok = fwrite(buf, 1, n, j->fp) == n && fflush(j->fp) == 0 && fsync(fileno(j->fp)) == 0;
+        free(buf);
+
+        pthread_mutex_lock(&j->lock);
+        j->syncing = 0;
+        if (ok) j->durableSeq = upto;
+        else j->failed = 1;
+        pthread_cond_broadcast(&j->cond);
+    }
+}
+
+/* Make one record durable in the shard of account accNum. Blocks until it
+   is on disk; commits arriving while another caller is inside fsync are
+   written together by the next leader. With jnlDeferSync set the record is
+   only queued and becomes durable at the next journalSync or checkpoint.
+   Returns 0 on success, -1 if the journal could not be written. */
+int journalCommit(int accNum, const char *record) {
+    JournalShard *j = jnlShardOf(accNum);
+    size_t len = strlen(record);
+    pthread_mutex_lock(&j->lock);
+    if (!j->fp || j->failed) {
+        pthread_mutex_unlock(&j->lock);
+        return -1;
+    }
+    if (j->pendingLen + len > j->pendingCap) {
+        size_t cap = j->pendingCap ? j->pendingCap : 4096;
+        while (cap < j->pendingLen + len) cap *= 2;
+        char *grown = realloc(j->pending, cap);
+        if (!grown) {
+            pthread_mutex_unlock(&j->lock);
+            return -1;
+        }
+        j->pending = grown;
+        j->pendingCap = cap;
+    }
+    memcpy(j->pending + j->pendingLen, record, len);
+    j->pendingLen += len;
+    unsigned long seq = ++j->nextSeq;
+
+    if (!jnlDeferSync) journalSyncLocked(j, seq);
+    int rc = (jnlDeferSync || j->durableSeq >= seq) ? 0 : -1;
+    pthread_mutex_unlock(&j->lock);
+    if (rc == 0) __atomic_add_fetch(&jnlSinceCheckpoint, 1, __ATOMIC_RELAXED);
+    return rc;
+}
+
+/* Make every queued record durable (used with jnlDeferSync) */
+int journalSync(void) {
+    int rc = 0;
+    for (int i = 0; i < jnlShardCount; ++i) {
+        JournalShard *j = &jnlShards[i];
+        pthread_mutex_lock(&j->lock);
+        if (j->fp) journalSyncLocked(j, j->nextSeq);
+        if (j->failed) rc = -1;
+        pthread_mutex_unlock(&j->lock);
+    }
+    return rc;
+}
+
+/* Remember an account that must be saved at the next checkpoint */
+static void journalMarkDirty(int idx) {
+    JournalShard *j = jnlShardOf(accountAt(idx)->accountNumber);
+    pthread_mutex_lock(&j->lock);
+    if (idx < j->dirtyMarkCap && j->dirtyMark[idx]) {
+        pthread_mutex_unlock(&j->lock);
+        return;
+    }
+    if (idx >= j->dirtyMarkCap) {
+        int cap = j->dirtyMarkCap ? j->dirtyMarkCap : 64;
+        while (cap <= idx) cap *= 2;
+        unsigned char *grown = realloc(j->dirtyMark, (size_t)cap);
+        if (grown) {
+            memset(grown + j->dirtyMarkCap, 0, (size_t)(cap - j->dirtyMarkCap));
+            j->dirtyMark = grown;
+            j->dirtyMarkCap = cap;
+        }
+    }
+    if (j->dirtyCount == j->dirtyCap && idx < j->dirtyMarkCap) {
+        int cap = j->dirtyCap ? j->dirtyCap * 2 : 16;
+        int *grown = realloc(j->dirty, sizeof(int) * cap);
+        if (grown) {
+            j->dirty = grown;
+            j->dirtyCap = cap;
+        }
+    }
+    if (idx >= j->dirtyMarkCap || j->dirtyCount == j->dirtyCap) {
+        /* cannot track it - save it right away instead */
+        pthread_mutex_unlock(&j->lock);
+        snapshotSaveRecord(jnlSnapshotFile, idx);
+        return;
+    }
+    j->dirtyMark[idx] = 1;
+    j->dirty[j->dirtyCount++] = idx;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/* Journal a confirmed withdrawal from `machine` (the in-memory state
+   already reflects it) */
+int journalWithdrawal(int idx, const Transaction *t, const int taken[], int machine) {
+    char rec[MAX_LINE];
+    unsigned long seq = __atomic_add_fetch(&jnlRecordSeq, 1, __ATOMIC_RELAXED);
+    char *p = putText(rec, "W;");
+    p = putInt(p, (long long)seq);
+    *p++ = ';';
+    p = putInt(p, t->accountNumber);
+    *p++ = ';';
+    p = putMoney(p, t->amount);
+    *p++ = ';';
+    p = putMoney(p, t->remainingBalance);
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        *p++ = ';';
+        p = putInt(p, taken[k]);
+    }
+    *p++ = ';';
+    p = putInt(p, t->time);
+    *p++ = ';';
+    p = putInt(p, machine);
+    *p++ = '\n';
+    *p = '\0';
+    if (journalCommit(t->accountNumber, rec) != 0) return -1;
+    journalMarkDirty(idx);
+    return 0;
+}
+
+/* Journal the login counters of account idx after a lockout or unlock.
+   Like a withdrawal it holds checkpointLock shared and the account lock
+   until the record is written, so a checkpoint cannot drop it and records
+   of one account stay in order. If the journal cannot be written the
+   record is saved in place instead. */
+int journalLoginState(int idx) {
+    char rec[MAX_LINE];
+    unsigned long seq = __atomic_add_fetch(&jnlRecordSeq, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_rdlock(&checkpointLock);
+    lockAccount(idx);
+    const Account a = *accountAt(idx);
+    char *p = putText(rec, "L;");
+    p = putInt(p, (long long)seq);
+    *p++ = ';';
+    p = putInt(p, a.accountNumber);
+    *p++ = ';';
+    p = putInt(p, a.loginAttempts);
+    *p++ = ';';
+    p = putInt(p, a.locked);
+    *p++ = '\n';
+    *p = '\0';
+    int rc = 0;
+    if (journalCommit(a.accountNumber, rec) != 0) rc = snapshotSaveRecord(jnlSnapshotFile, idx);
+    else journalMarkDirty(idx);
+    unlockAccount(idx);
+    pthread_rwlock_unlock(&checkpointLock);
+    return rc;
+}
+
+/* Parse an L record; returns 0 if the line is complete */
+static int parseJournalLogin(const char *line, int *accNum, int *attempts, int *locked) {
+    char *end;
+    if (strncmp(line, "L;", 2) != 0 || !strchr(line, '\n')) return -1;
+    strtoul(line + 2, &end, 10);                /* seq */
+    if (*end != ';') return -1;
+    *accNum = (int)strtol(end + 1, &end, 10);
+    if (*end != ';') return -1;
+    *attempts = (int)strtol(end + 1, &end, 10);
+    if (*end != ';') return -1;
+    *locked = (int)strtol(end + 1, &end, 10);
+    return *end == '\n' ? 0 : -1;
+}
+
+/* Parse a W record; returns 0 if the line is complete */
+static int parseJournalWithdrawal(const char *line, Transaction *t, int taken[], int *machine) {
+    char *end;
+    if (strncmp(line, "W;", 2) != 0 || !strchr(line, '\n')) return -1;
+    /* older records carry a second block of per-cassette counts */
+    int fields = 1;
+    for (const char *c = line; *c; ++c) fields += *c == ';';
+    int counts = (fields == 6 + 2 * ATM_NUM_DENOMS) ? 2 * ATM_NUM_DENOMS : ATM_NUM_DENOMS;
+    const char *p = line + 2;
+    strtoul(p, &end, 10);                       /* seq */
+    if (*end != ';') return -1;
+    t->accountNumber = (int)strtol(end + 1, &end, 10);
+    if (*end != ';') return -1;
+    p = parseMoney(end + 1, &t->amount);
+    if (!p || *p != ';') return -1;
+    p = parseMoney(p + 1, &t->remainingBalance);
+    if (!p) return -1;
+    end = (char *)p;
+    for (int k = 0; k < counts; ++k) {
+        if (*end != ';') return -1;
+        long v = strtol(end + 1, &end, 10);
+        if (k < ATM_NUM_DENOMS) taken[k] = (int)v;
+    }
+    if (*end != ';') return -1;
+    t->type = TXN_WITHDRAWAL;
+    *machine = 0;
+    if (strchr(end + 1, '-')) return parseTime(end + 1, &t->time);
+    char *stop;
+    t->time = strtoll(end + 1, &stop, 10);
+    if (stop == end + 1) return -1;
+    if (*stop == ';') {
+        end = stop + 1;
+        *machine = (int)strtol(end, &stop, 10);
+        if (stop == end) return -1;
+    }
+    return *stop == '\n' ? 0 : -1;
+}
+
+/* Write every change recorded since the last checkpoint to accounts.bin,
+   atm.txt and (in fleet mode) fleet.txt, then truncate the journal */
+int journalCheckpoint(void) {
+    pthread_rwlock_wrlock(&checkpointLock);
+    journalInitShards();
+    int dirty = 0;
+    for (int i = 0; i < jnlShardCount; ++i) {
+        JournalShard *j = &jnlShards[i];
+        pthread_mutex_lock(&j->lock);
+        while (j->syncing) pthread_cond_wait(&j->cond, &j->lock);
+        dirty += j->dirtyCount;
+    }
+    int rc = 0;
+    jnlCheckpointGen++;
+    if (dirty) {
+        /* copy each record (and any credential rehashed since the last
+           checkpoint) under its lock, then write them all with one sync */
+        int *slots = calloc((size_t)dirty, sizeof(int));
+        Account *copies = malloc(sizeof(Account) * (size_t)dirty);
+        PinHash *creds = calloc((size_t)dirty, sizeof(PinHash));
+        if (!slots || !copies || !creds) {
+            rc = -1;
+        } else {
+            int n = 0;
+            for (int i = 0; i < jnlShardCount; ++i) {
+                for (int d = 0; d < jnlShards[i].dirtyCount; ++d, ++n) {
+                    slots[n] = jnlShards[i].dirty[d];
+                    LoginState *ls = loginStatePeek(slots[n]);
+                    lockAccount(slots[n]);
+                    copies[n] = *accountAt(slots[n]);
+                    if (ls && ls->credDirty) {
+                        creds[n] = *credAt(slots[n]);
+                        ls->credDirty = 0;
+                    }
+                    unlockAccount(slots[n]);
+                }
+            }
+            if (snapshotWriteRecords(jnlSnapshotFile, slots, copies, creds, n) != 0) {
+                rc = -1;
+                /* write them again next time */
+                for (int k = 0; k < n; ++k) {
+                    if (!creds[k].iterations) continue;
+                    lockAccount(slots[k]);
+                    loginStatePeek(slots[k])->credDirty = 1;
+                    unlockAccount(slots[k]);
+                }
+            }
+        }
+        free(slots);
+        free(copies);
+        free(creds);
+    }
+    if (saveATM(jnlAtmFile) != 0) rc = -1;
+    if (fleetCount > 0 && saveFleet(FLEET_FILE) != 0) rc = -1;
+    /* lazily logged withdrawals are only safe while their journal record
+       exists: the log goes to disk before the journal is truncated */
+    if (rc == 0 && txnLogSync() != 0) rc = -1;
+    /* keep the journal if the snapshot or log files could not be written */
+    for (int i = 0; i < jnlShardCount; ++i) {
+        if (rc == 0) rc = journalReset(&jnlShards[i]);
+        pthread_mutex_unlock(&jnlShards[i].lock);
+    }
+    if (rc == 0) __atomic_store_n(&jnlSinceCheckpoint, 0, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&checkpointLock);
+    return rc;
+}
+
+static void *checkpointerMain(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&checkpointerLock);
+    while (!checkpointerStopping) {
+        if (!checkpointRequested) {
+            pthread_cond_wait(&checkpointerWake, &checkpointerLock);
+            continue;
+        }
+        checkpointRequested = 0;
+        pthread_mutex_unlock(&checkpointerLock);
+        PROBE_START(probe);
+        journalCheckpoint();
+        PROBE_END(PROBE_CHECKPOINT, probe);
+        pthread_mutex_lock(&checkpointerLock);
+        checkpointsDone++;
+        pthread_cond_broadcast(&checkpointerDone);
+    }
+    pthread_mutex_unlock(&checkpointerLock);
+    return NULL;
+}
+
+/* Start the background checkpointer (after recovery). Without it every
+   requested checkpoint runs in the caller, as before. */
+int startCheckpointer(void) {
+    checkpointerStopping = 0;
+    checkpointRequested = 0;
+    checkpointerRunning = pthread_create(&checkpointer, NULL, checkpointerMain, NULL) == 0;
+    return checkpointerRunning ? 0 : -1;
+}
+
+/* Let a running checkpoint finish and stop the thread; waiting sessions
+   are released. The final checkpoint is journalClose's. */
+void stopCheckpointer(void) {
+    if (!checkpointerRunning) return;
+    pthread_mutex_lock(&checkpointerLock);
+    checkpointerStopping = 1;
+    pthread_cond_signal(&checkpointerWake);
+    pthread_mutex_unlock(&checkpointerLock);
+    pthread_join(checkpointer, NULL);
+    pthread_mutex_lock(&checkpointerLock);
+    checkpointerRunning = 0;
+    pthread_cond_broadcast(&checkpointerDone);
+    pthread_mutex_unlock(&checkpointerLock);
+}
+
+/* Ask for a checkpoint without waiting for it (runs it here if there is
+   no checkpointer) */
+void requestCheckpoint(void) {
+    pthread_mutex_lock(&checkpointerLock);
+    int running = checkpointerRunning && !checkpointerStopping;
+    if (running) {
+        checkpointRequested = 1;
+        pthread_cond_signal(&checkpointerWake);
+    }
+    pthread_mutex_unlock(&checkpointerLock);
+    if (!running) {
+        PROBE_START(probe);
+        journalCheckpoint();
+        PROBE_END(PROBE_CHECKPOINT, probe);
+    }
+}
+
+/* Back-pressure: while the checkpointer is more than JNL_BACKLOG_FACTOR
+   intervals behind, wait for the next checkpoint to finish (a failed one
+   releases the waiters too). Called with no locks held. */
+void awaitCheckpointBacklog(void) {
+    long limit = (long)jnlCheckpointInterval * JNL_BACKLOG_FACTOR;
+    if (__atomic_load_n(&jnlSinceCheckpoint, __ATOMIC_RELAXED) < limit) return;
+    pthread_mutex_lock(&checkpointerLock);
+    if (checkpointerRunning && __atomic_load_n(&jnlSinceCheckpoint, __ATOMIC_RELAXED) >= limit) {
+        unsigned long seen = checkpointsDone;
+        checkpointStalls++;
+        checkpointRequested = 1;
+        pthread_cond_signal(&checkpointerWake);
+        while (checkpointerRunning && checkpointsDone == seen) {
+            pthread_cond_wait(&checkpointerDone, &checkpointerLock);
+        }
+    }
+    pthread_mutex_unlock(&checkpointerLock);
+}
+
+static int collectWithdrawal(const Transaction *t, TxnPos pos, void *ctx) {
+    TxnList *list = ctx;
+    if (t->type != TXN_WITHDRAWAL) return 0;
+    if (list->count == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 64;
+        Transaction *grown = realloc(list->items, sizeof(Transaction) * cap);
+        if (grown) list->items = grown;
+        TxnPos *moved = grown ? realloc(list->positions, sizeof(TxnPos) * cap) : NULL;
+        if (!moved) return 1;
+        list->positions = moved;
+        list->cap = cap;
+    }
+    list->positions[list->count] = pos;
+    list->items[list->count++] = *t;
+    return 0;
+}
+
+/* One journal line queued for replay, from shard file `file` */
+typedef struct {
+    const char *text;
+    int file;
+} JournalReplayLine;
+
+/* A replay worker: the lines of its share of the accounts, in file order */
+typedef struct {
+    const JournalReplayLine *lines;
+    int count;
+    const unsigned long *gens;    // checkpoint generation by shard file
+    const TxnList *logged;        // withdrawals logged since the checkpoint
+    const int *loggedSlots;       // hash table over logged (index + 1)
+    unsigned int loggedMask;
+    unsigned char *journaled;     // by logged index: a journal record matched it
+    int replayed, unknown, logins;
+    pthread_t thread;
+} JournalReplayWorker;
+
+static unsigned int withdrawalKeyHash(const Transaction *t) {
+    unsigned long long h = 1469598103934665603ULL;
+    const long long parts[4] = {t->accountNumber, t->amount, t->remainingBalance, t->time};
+    for (int i = 0; i < 4; ++i) h = (h ^ (unsigned long long)parts[i]) * 1099511628211ULL;
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+/* Whether the log already holds the withdrawal of journal record t (and
+   note that it does; only t's account's worker touches those entries) */
+static int journalReplayLogged(const JournalReplayWorker *w, const Transaction *t) {
+    if (!w->loggedSlots) return 0;
+    for (unsigned int pos = withdrawalKeyHash(t) & w->loggedMask; w->loggedSlots[pos]; pos = (pos + 1) & w->loggedMask) {
+        int l = w->loggedSlots[pos] - 1;
+        const Transaction *x = &w->logged->items[l];
+        if (x->accountNumber == t->accountNumber && x->amount == t->amount &&
+            x->remainingBalance == t->remainingBalance && x->time == t->time) {
+            w->journaled[l] = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Account number of a W or L journal line, 0 for anything else */
+static int journalLineAccount(const char *line) {
+    if ((line[0] != 'W' && line[0] != 'L') || line[1] != ';') return 0;
+    const char *p = line + 2;
+    while (*p && *p != ';' && *p != '\n') p++;
+    return *p == ';' ? atoi(p + 1) : 0;
+}
+
+static const char *journalNextLine(const char *p) {
+    const char *nl = strchr(p, '\n');
+    return nl ? nl + 1 : p + strlen(p);
+}
+
+/* Whole shard file, NUL-terminated, or NULL */
+static char *journalReadShard(FILE *fp) {
+    long len = fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1;
+    char *text = len >= 0 ? malloc((size_t)len + 1) : NULL;
+    if (text && (fseek(fp, 0, SEEK_SET) != 0 || fread(text, 1, (size_t)len, fp) != (size_t)len)) {
+        free(text);
+        text = NULL;
+    }
+    if (text) text[len] = '\0';
+    return text;
+}
+
+/* Apply a worker's records. Each account's records come from one shard
+   file in the order written, and all of them reach the same worker, so
+   post-images are applied in order; machine inventories are shared and
+   take their deltas atomically. */
+static void *journalReplayMain(void *arg) {
+    JournalReplayWorker *w = arg;
+    char line[MAX_LINE];
+    for (int n = 0; n < w->count; ++n) {
+        const char *text = w->lines[n].text;
+        size_t len = strcspn(text, "\n");
+        if (text[len] == '\n') len++;
+        if (len >= sizeof(line)) continue;
+        memcpy(line, text, len);
+        line[len] = '\0';
+
+        int taken[ATM_MAX_DENOMS], machine;
+        Transaction t;
+        int accNum, attempts, locked;
+        if (parseJournalLogin(line, &accNum, &attempts, &locked) == 0) {
+            int idx = findAccountIndex(accNum);
+            if (idx != -1) {
+                lockAccount(idx);
+                accountAt(idx)->loginAttempts = attempts;
+                accountAt(idx)->locked = locked;
+                unlockAccount(idx);
+                journalMarkDirty(idx);
+            }
+            w->logins++;
+            continue;
+        }
+        if (parseJournalWithdrawal(line, &t, taken, &machine) != 0) {
+            continue; /* torn tail write - never acknowledged */
+        }
+        t.machine = machine;
+        memcpy(t.notes, taken, sizeof(int) * ATM_NUM_DENOMS);
+        int idx = findAccountIndex(t.accountNumber);
+        if (idx != -1) {
+            lockAccount(idx);
+            accountAt(idx)->balance = t.remainingBalance;
+            unlockAccount(idx);
+            journalMarkDirty(idx);
+        }
+        ATM *inv = machineInventory(machine);
+        if (!inv) {
+            w->unknown++;
+        } else if (w->gens[w->lines[n].file] >= (machine == 0 ? atmSavedGen : fleetSavedGen)) {
+            for (int k = 0; k < ATM_NUM_DENOMS; ++k) __atomic_sub_fetch(&inv->notes[k], taken[k], __ATOMIC_RELAXED);
+        }
+        if (!journalReplayLogged(w, &t)) recordTransaction(&t, TXN_FLUSH_RECORD);
+        w->replayed++;
+    }
+    return NULL;
+}
+
+/* Replay workers for `lines` journal lines */
+static int journalReplayThreads(int lines) {
+#ifdef _WIN32
+    int threads = 1;
+#else
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads > JNL_REPLAY_MAX_THREADS) threads = JNL_REPLAY_MAX_THREADS;
+    if (threads > lines / JNL_REPLAY_MIN_PER_THREAD) threads = lines / JNL_REPLAY_MIN_PER_THREAD;
+    return threads < 1 ? 1 : threads;
+}
+
+/* Replay journal records that never reached a checkpoint, from every shard
+   file present. Account balances and machine inventories are restored from
+   the post-images; transaction log entries are re-appended only if they
+   are missing from the part of the log written after the last checkpoint.
+   Withdrawals in the log after the newest checkpoint that no journal record
+   matches (the log got ahead of a journal whose syncs were deferred) are
+   applied the same way, so the books agree with the log again.
+   The work is only the journal tail and the log written since the
+   checkpoint: the shard files are read whole, their lines split by
+   account among the replay workers, and the logged withdrawals looked up
+   in a hash table. */
+int recoverJournal(void) {
+    journalInitShards();
+    char *texts[JNL_MAX_SHARDS] = {NULL};
+    unsigned long gens[JNL_MAX_SHARDS] = {0};
+    char path[MAX_LINE];
+    int open = 0, failed = 0;
+    long long txnFrom = -1, txnNewest = 0;
+    jnlCheckpointGen = atmSavedGen > fleetSavedGen ? atmSavedGen : fleetSavedGen;
+    for (int i = 0; i < JNL_MAX_SHARDS; ++i) {
+        journalPath(path, sizeof(path), i);
+        FILE *fp = fopen(path, "rb");
+        if (!fp) continue;
+        texts[i] = journalReadShard(fp);
+        fclose(fp);
+        if (!texts[i]) {
+            printf("Error: unable to read %s.\n", path);
+            failed = 1;
+            continue;
+        }
+        open++;
+        long long from = 0;
+        sscanf(texts[i], "C;%lld;%lu", &from, &gens[i]);
+        if (txnFrom < 0 || from < txnFrom) txnFrom = from;
+        if (from > txnNewest) txnNewest = from;
+        if (gens[i] > jnlCheckpointGen) jnlCheckpointGen = gens[i];
+    }
+    if (open == 0 || failed) {
+        for (int i = 0; i < JNL_MAX_SHARDS; ++i) free(texts[i]);
+        return failed ? -1 : 0;
+    }
+
+    /* withdrawals logged since the checkpoint, by key */
+    TxnList logged = {NULL, NULL, 0, 0};
+    txnLogFlush();
+    txnLogScan(txnFrom, collectWithdrawal, &logged);
+    unsigned int cap = 16;
+    while (cap < (unsigned int)logged.count * 2) cap <<= 1;
+    int *slots = logged.count ? calloc(cap, sizeof(int)) : NULL;
+    unsigned char *journaled = logged.count ? calloc((size_t)logged.count, 1) : NULL;
+    for (int l = 0; slots && l < logged.count; ++l) {
+        unsigned int pos = withdrawalKeyHash(&logged.items[l]) & (cap - 1);
+        while (slots[pos]) pos = (pos + 1) & (cap - 1);
+        slots[pos] = l + 1;
+    }
+
+    /* split the lines by account: count, then place each worker's run */
+    int total = 0;
+    for (int i = 0; i < JNL_MAX_SHARDS; ++i) {
+        for (const char *p = texts[i]; p && *p; p = journalNextLine(p)) {
+            if (journalLineAccount(p)) total++;
+        }
+    }
+    int threads = journalReplayThreads(total);
+    JournalReplayWorker workers[JNL_REPLAY_MAX_THREADS];
+    int started[JNL_REPLAY_MAX_THREADS] = {0}, fill[JNL_REPLAY_MAX_THREADS] = {0};
+    JournalReplayLine *lines = malloc(sizeof(JournalReplayLine) * (size_t)(total ? total : 1));
+    if (!lines || (logged.count && (!slots || !journaled))) {
+        printf("Memory allocation failed while replaying the journal.\n");
+        for (int i = 0; i < JNL_MAX_SHARDS; ++i) free(texts[i]);
+        free(lines);
+        free(slots);
+        free(journaled);
+        free(logged.items);
+        free(logged.positions);
+        return -1;
+    }
+    memset(workers, 0, sizeof(workers));
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < JNL_MAX_SHARDS; ++i) {
+            for (const char *p = texts[i]; p && *p; p = journalNextLine(p)) {
+                int accNum = journalLineAccount(p);
+                if (!accNum) continue;
+                int t = (int)(hashAccountNumber(accNum) % (unsigned int)threads);
+                if (pass == 0) {
+                    workers[t].count++;
+                } else {
+                    JournalReplayLine *l = &lines[fill[t]++];
+                    l->text = p;
+                    l->file = i;
+                }
+            }
+        }
+        if (pass == 0) {
+            for (int t = 0, at = 0; t < threads; at += workers[t++].count) fill[t] = at;
+        }
+    }
+    for (int t = 0; t < threads; ++t) {
+        workers[t].lines = lines + (fill[t] - workers[t].count);
+        workers[t].gens = gens;
+        workers[t].logged = &logged;
+        workers[t].loggedSlots = slots;
+        workers[t].loggedMask = cap - 1;
+        workers[t].journaled = journaled;
+    }
+    for (int t = 1; t < threads; ++t) {
+        started[t] = pthread_create(&workers[t].thread, NULL, journalReplayMain, &workers[t]) == 0;
+    }
+    journalReplayMain(&workers[0]);
+    int replayed = 0, unknown = 0, logins = 0;
+    for (int t = 0; t < threads; ++t) {
+        if (t > 0 && started[t]) pthread_join(workers[t].thread, NULL);
+        else if (t > 0) journalReplayMain(&workers[t]);
+        replayed += workers[t].replayed;
+        unknown += workers[t].unknown;
+        logins += workers[t].logins;
+    }
+    for (int i = 0; i < JNL_MAX_SHARDS; ++i) free(texts[i]);
+    free(lines);
+    free(slots);
+
+    /* log entries the journal never got, oldest first; the checkpoint at
+       txnNewest already holds anything logged before it */
+    int fromLog = 0;
+    for (int l = 0; l < logged.count; ++l) {
+        const Transaction *t = &logged.items[l];
+        if (journaled[l] || logged.positions[l] < txnNewest) continue;
+        int idx = findAccountIndex(t->accountNumber);
+        if (idx != -1) {
+            accountAt(idx)->balance = t->remainingBalance;
+            journalMarkDirty(idx);
+        }
+        ATM *inv = t->machine >= 0 ? machineInventory(t->machine) : NULL;
+        if (!inv) unknown++;
+        for (int k = 0; inv && k < ATM_NUM_DENOMS; ++k) inv->notes[k] -= t->notes[k];
+        fromLog++;
+    }
+    free(journaled);
+    free(logged.items);
+    free(logged.positions);
+    if (unknown > 0) printf("Warning: %d withdrawal(s) from machines not loaded here.\n", unknown);
+
+    if (replayed > 0) printf("Recovered %d journaled withdrawal(s).\n", replayed);
+    if (fromLog > 0) printf("Recovered %d withdrawal(s) from the transaction log.\n", fromLog);
+    if (replayed > 0 || logins > 0 || fromLog > 0) return journalCheckpoint();
+    return 0;
+}
+
+static int compareInts(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Whether every account in accNums has a W or L record in some shard file
+   present, so that replay rewrites it (sorts accNums) */
+int journalCoversAccounts(int *accNums, int n) {
+    unsigned char *seen = calloc((size_t)n, 1);
+    if (!seen) return 0;
+    qsort(accNums, (size_t)n, sizeof(int), compareInts);
+    char path[MAX_LINE], line[MAX_LINE];
+    for (int i = 0; i < JNL_MAX_SHARDS; ++i) {
+        journalPath(path, sizeof(path), i);
+        FILE *fp = fopen(path, "rb");
+        if (!fp) continue;
+        while (fgets(line, sizeof(line), fp)) {
+            int accNum = journalLineAccount(line);
+            int *hit = accNum ? bsearch(&accNum, accNums, (size_t)n, sizeof(int), compareInts) : NULL;
+            if (hit) seen[hit - accNums] = 1;
+        }
+        fclose(fp);
+    }
+    int covered = 1;
+    for (int i = 0; i < n && covered; ++i) covered = seen[i];
+    free(seen);
+    return covered;
+}
+
+/* Final checkpoint and release of journal resources */
+void journalClose(void) {
+    journalCheckpoint();
+    for (int i = 0; i < JNL_MAX_SHARDS; ++i) {
+        JournalShard *j = &jnlShards[i];
+        if (j->fp) fclose(j->fp);
+        j->fp = NULL;
+        free(j->pending);
+        j->pending = NULL;
+        j->pendingLen = j->pendingCap = 0;
+        free(j->dirty);
+        j->dirty = NULL;
+        j->dirtyCount = j->dirtyCap = 0;
+        free(j->dirtyMark);
+        j->dirtyMark = NULL;
+        j->dirtyMarkCap = 0;
+    }
+}
+
+/* Mix the bits of an account number so sequential numbers spread out */
+static unsigned int hashAccountNumber(int accNum) {
+    unsigned int x = (unsigned int)accNum;
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+/* Place an index into the slot table without any growth checks */
+static void indexPlace(int *slots, int cap, int idx) {
+    unsigned int mask = (unsigned int)cap - 1;
+    unsigned int pos = hashAccountNumber(accountAt(idx)->accountNumber) & mask;
+    while (slots[pos] != 0) pos = (pos + 1) & mask;
+    slots[pos] = idx + 1;
+}
+
+/* (Re)build the lookup table from the current accounts array */
+int buildAccountIndex(void) {
+    int cap = 16;
+    while (cap < accountCount * 2) cap <<= 1;
+    int *slots = calloc((size_t)cap, sizeof(int));
+    if (!slots) {
+        printf("Memory allocation failed while indexing accounts.\n");
+        return -1;
+    }
+    for (int i = 0; i < accountCount; ++i) indexPlace(slots, cap, i);
+    free(accIndexSlots);
+    accIndexSlots = slots;
+    accIndexCap = cap;
+    accIndexUsed = accountCount;
+    return 0;
+}
+
+/* Add accounts[idx] to the lookup table, growing it when over half full */
+int indexInsertAccount(int idx) {
+    if ((accIndexUsed + 1) * 2 > accIndexCap) {
+        int cap = accIndexCap ? accIndexCap * 2 : 16;
+        int *slots = calloc((size_t)cap, sizeof(int));
+        if (!slots) {
+            printf("Memory allocation failed while indexing accounts.\n");
+            return -1;
+        }
+        for (int i = 0; i < accIndexCap; ++i) {
+            if (accIndexSlots[i]) indexPlace(slots, cap, accIndexSlots[i] - 1);
+        }
+        free(accIndexSlots);
+        accIndexSlots = slots;
+        accIndexCap = cap;
+    }
+    indexPlace(accIndexSlots, accIndexCap, idx);
+    accIndexUsed++;
+    return 0;
+}
+
+/* Drop an account number from the lookup table.
+   Uses backward-shift deletion so no tombstones are left behind. */
+void indexRemoveAccount(int accNum) {
+    if (accIndexCap == 0) return;
+    unsigned int mask = (unsigned int)accIndexCap - 1;
+    unsigned int pos = hashAccountNumber(accNum) & mask;
+    while (accIndexSlots[pos] != 0) {
+        if (accountAt(accIndexSlots[pos] - 1)->accountNumber == accNum) break;
+        pos = (pos + 1) & mask;
+    }
+    if (accIndexSlots[pos] == 0) return;
+    accIndexSlots[pos] = 0;
+    accIndexUsed--;
+    /* pull following entries of the same cluster back into the hole */
+    unsigned int hole = pos;
+    unsigned int next = (pos + 1) & mask;
+    while (accIndexSlots[next] != 0) {
+        unsigned int home = hashAccountNumber(accountAt(accIndexSlots[next] - 1)->accountNumber) & mask;
+        /* move the entry if its home slot is not inside (hole, next] */
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            accIndexSlots[hole] = accIndexSlots[next];
+            accIndexSlots[next] = 0;
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+/* Find account index by account number */
+int findAccountIndex(int accNum) {
+    if (accIndexCap == 0) return -1;
+    unsigned int mask = (unsigned int)accIndexCap - 1;
+    unsigned int pos = hashAccountNumber(accNum) & mask;
+    while (accIndexSlots[pos] != 0) {
+        int idx = accIndexSlots[pos] - 1;
+        if (accountAt(idx)->accountNumber == accNum) return idx;
+        pos = (pos + 1) & mask;
+    }
+    return -1;
+}
+
+/* Set up the account lock stripes (once, before any session starts) */
+void initAccountLocks(void) {
+    static int done = 0;
+    if (done) return;
+    for (int i = 0; i < ACCOUNT_LOCK_STRIPES; ++i) pthread_mutex_init(&accountLocks[i], NULL);
+    done = 1;
+}
+
+void lockAccount(int idx) {
+    pthread_mutex_lock(&accountLocks[idx % ACCOUNT_LOCK_STRIPES]);
+}
+
+void unlockAccount(int idx) {
+    pthread_mutex_unlock(&accountLocks[idx % ACCOUNT_LOCK_STRIPES]);
+}
+
+/* Copy note counts that other sessions may be changing */
+void snapshotATM(const ATM *atm, ATM *out) {
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) out->notes[k] = __atomic_load_n(&atm->notes[k], __ATOMIC_ACQUIRE);
+}
+
+/* Take notes out of the cassettes with compare-and-swap. Either every
+   cassette is decremented (returns 0) or none is (returns -1, another
+   session got there first). */
+int reserveNotes(ATM *atm, const int notes[]) {
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        if (notes[k] == 0) continue;
+        int have = __atomic_load_n(&atm->notes[k], __ATOMIC_ACQUIRE);
+        for (;;) {
+            if (have < notes[k]) {
+                /* undo the cassettes already taken from */
+                for (int j = 0; j < k; ++j) __atomic_add_fetch(&atm->notes[j], notes[j], __ATOMIC_ACQ_REL);
+                return -1;
+            }
+            if (__atomic_compare_exchange_n(&atm->notes[k], &have, have - notes[k], 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) break;
+        }
+    }
+    return 0;
+}
+
+/* Put reserved notes back (the withdrawal could not be committed) */
+void releaseNotes(ATM *atm, const int notes[]) {
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) __atomic_add_fetch(&atm->notes[k], notes[k], __ATOMIC_ACQ_REL);
+}
+
+/* --------------------- Transaction history index ---------------------
+   transactions.idx format:
+   <first log segment> <log position covered by this index>
+   accountNumber position        (one line per logged record)
+   Positions are TxnPos values. Records appended after the covered
+   position (e.g. after a crash) are picked up by scanning only that tail
+   of the log on startup.
+*/
+
+static void historyIndexPath(char *buf, size_t size) {
+    snprintf(buf, size, "%s.idx", txnLogPrefix);
+}
+
+/* First segment named by the saved index (1 if there is none) */
+int historyIndexFirstSegment(void) {
+    char path[MAX_LINE], line[MAX_LINE];
+    int first = 1;
+    long long covered;
+    historyIndexPath(path, sizeof(path));
+    FILE *xf = fopen(path, "rb");
+    if (xf) {
+        if (!fgets(line, sizeof(line), xf) || sscanf(line, "%d %lld", &first, &covered) != 2 || first < 1) first = 1;
+        fclose(xf);
+    }
+    return first;
+}
+
+/* Find the position list of an account, or NULL (txnLock held) */
+HistoryList *historyIndexFind(int accNum) {
+    if (histSlotCap == 0) return NULL;
+    unsigned int mask = (unsigned int)histSlotCap - 1;
+    unsigned int pos = hashAccountNumber(accNum) & mask;
+    while (histSlots[pos] != 0) {
+        HistoryList *l = &histLists[histSlots[pos] - 1];
+        if (l->accountNumber == accNum) return l;
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Double the slot table and rehash every list */
+static int historyIndexGrow(void) {
+    int cap = histSlotCap ? histSlotCap * 2 : 64;
+    int *slots = calloc((size_t)cap, sizeof(int));
+    if (!slots) return -1;
+    unsigned int mask = (unsigned int)cap - 1;
+    for (int i = 0; i < histListCount; ++i) {
+        unsigned int pos = hashAccountNumber(histLists[i].accountNumber) & mask;
+        while (slots[pos] != 0) pos = (pos + 1) & mask;
+        slots[pos] = i + 1;
+    }
+    free(histSlots);
+    histSlots = slots;
+    histSlotCap = cap;
+    return 0;
+}
+
+/* Make room for `extra` more positions in accNum's list, creating the
+   list if needed; lists double as they fill (txnLock held) */
+static HistoryList *historyIndexReserveLocked(int accNum, int extra) {
+    HistoryList *l = historyIndexFind(accNum);
+    if (!l) {
+        if ((histListCount + 1) * 2 > histSlotCap && historyIndexGrow() != 0) return NULL;
+        if (histListCount == histListCap) {
+            int cap = histListCap ? histListCap * 2 : 64;
+            HistoryList *grown = realloc(histLists, sizeof(HistoryList) * cap);
+            if (!grown) return NULL;
+            histLists = grown;
+            histListCap = cap;
+        }
+        l = &histLists[histListCount];
+        l->accountNumber = accNum;
+        l->positions = NULL;
+        l->count = l->cap = 0;
+        unsigned int mask = (unsigned int)histSlotCap - 1;
+        unsigned int pos = hashAccountNumber(accNum) & mask;
+        while (histSlots[pos] != 0) pos = (pos + 1) & mask;
+        histSlots[pos] = ++histListCount;
+    }
+    if (l->count + extra > l->cap) {
+        int cap = l->cap ? l->cap * 2 : 8;
+        while (cap < l->count + extra) cap *= 2;
+        TxnPos *grown = realloc(l->positions, sizeof(TxnPos) * cap);
+        if (!grown) return NULL;
+        l->positions = grown;
+        l->cap = cap;
+    }
+    return l;
+}
+
+/* Record that the log record at `position` belongs to accNum (txnLock held) */
+int historyIndexAdd(int accNum, TxnPos position) {
+    HistoryList *l = historyIndexReserveLocked(accNum, 1);
+    if (!l) return -1;
+    l->positions[l->count++] = position;
+    return 0;
+}
+
+/* Size accNum's list for `extra` more records ahead of time, so appending
+   them makes no allocation */
+int historyIndexReserve(int accNum, int extra) {
+    pthread_mutex_lock(&txnLock);
+    int rc = historyIndexReserveLocked(accNum, extra) ? 0 : -1;
+    pthread_mutex_unlock(&txnLock);
+    return rc;
+}
+
+static int historyIndexRecord(const Transaction *t, TxnPos pos, void *ctx) {
+    (void)ctx;
+    historyIndexAdd(t->accountNumber, pos);
+    return 0;
+}
+
+/* Load the saved index and index any log records written after it (call
+   once the segments are known). A missing or inconsistent index file is
+   rebuilt from the whole log. Returns the position just past the last
+   complete record in the log. */
+TxnPos historyIndexLoad(void) {
+    historyIndexFree();
+    char path[MAX_LINE], line[MAX_LINE];
+    int first = 0;
+    long long covered = 0;
+    historyIndexPath(path, sizeof(path));
+    FILE *xf = fopen(path, "rb");
+    if (xf) {
+        /* the covered position must lie inside the log that exists now */
+        long activeSize = -1;
+        if (txnFp && fseek(txnFp, 0, SEEK_END) == 0) activeSize = ftell(txnFp);
+        if (fgets(line, sizeof(line), xf) && sscanf(line, "%d %lld", &first, &covered) == 2 &&
+            first == txnFirstSegment && TXN_POS_SEGMENT(covered) >= first &&
+            TXN_POS_SEGMENT(covered) <= txnSegment &&
+            (TXN_POS_SEGMENT(covered) < txnSegment || activeSize < 0 || TXN_POS_OFFSET(covered) <= activeSize)) {
+            int a;
+            long long pos;
+            while (fgets(line, sizeof(line), xf)) {
+                if (sscanf(line, "%d %lld", &a, &pos) == 2 && pos < covered) historyIndexAdd(a, pos);
+            }
+        } else {
+            covered = 0;
+        }
+        fclose(xf);
+    }
+    if (covered == 0) historyIndexFree();
+
+    /* index the tail the saved index does not cover */
+    return txnLogScan(covered, historyIndexRecord, NULL);
+}
+
+/* Write the index beside the log (call once the log is fully flushed) */
+int historyIndexSave(void) {
+    char path[MAX_LINE];
+    historyIndexPath(path, sizeof(path));
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("Warning: unable to write transaction index.\n");
+        return -1;
+    }
+    fprintf(fp, "%d %lld\n", txnFirstSegment, (long long)TXN_POS(txnSegment, txnLogEnd));
+    for (int i = 0; i < histListCount; ++i) {
+        for (int j = 0; j < histLists[i].count; ++j) {
+            fprintf(fp, "%d %lld\n", histLists[i].accountNumber, (long long)histLists[i].positions[j]);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+void historyIndexFree(void) {
+    for (int i = 0; i < histListCount; ++i) free(histLists[i].positions);
+    free(histLists);
+    free(histSlots);
+    histLists = NULL;
+    histSlots = NULL;
+    histListCount = histListCap = histSlotCap = 0;
+}
+
+/* --------------------- History store ---------------------
+   Column copies of the log for support and fraud queries ("withdrawals
+   over X between T1 and T2", "last 10 for account N"). Each sealed segment
+   gets transactions.NNNNNN.col, built by the flusher from the segment:
+     HistStoreHeader, HistZone[blocks], then each column of HIST_COLUMN_FIELDS
+     in turn (rows values each, widest first so every column is aligned)
+   A zone holds the time, account and amount bounds and kinds of a block of
+   HIST_BLOCK_ROWS rows, so a query skips whole blocks (and segments) that
+   cannot match and compares fixed-width columns only in the rest; a query
+   on one account goes straight to its rows through the history index
+   instead. The file is a cache of its segment: one that is missing or
+   does not match is rebuilt, and meanwhile the segment is read directly.
+*/
+
+static void historyStorePath(char *buf, size_t size, int segment) {
+    snprintf(buf, size, "%s.%06d.col", txnLogPrefix, segment);
+}
+
+static unsigned int historyStoreCheck(const HistStoreHeader *h, const HistZone *zones) {
+    return blockChecksum((const unsigned char *)h, offsetof(HistStoreHeader, check)) ^
+           blockChecksum((const unsigned char *)zones, sizeof(HistZone) * h->blocks) * 31u;
+}
+
+static int zoneMatches(const HistZone *z, const HistoryQuery *q) {
+    return z->maxTime >= q->fromTime && z->minTime <= q->toTime && z->maxAmount >= q->minAmount &&
+           z->maxAccount >= q->accountFrom && z->minAccount <= q->accountTo && (z->types & q->types);
+}
+
+static int historyRowMatches(const HistSegment *s, unsigned int r, const HistoryQuery *q) {
+    return s->time[r] >= q->fromTime && s->time[r] <= q->toTime && s->amount[r] >= q->minAmount &&
+           s->account[r] >= q->accountFrom && s->account[r] <= q->accountTo && (q->types >> s->type[r] & 1);
+}
+
+static void historyRow(const HistSegment *s, unsigned int r, Transaction *t) {
+    memset(t, 0, sizeof(*t));
+    t->accountNumber = s->account[r];
+    t->type = (TxnType)s->type[r];
+    t->amount = s->amount[r];
+    t->remainingBalance = s->balance[r];
+    t->time = s->time[r];
+    t->count = s->count[r];
+    t->firstTime = t->time - s->span[r];
+    t->machine = s->machine[r];
+}
+
+static void historySegmentFree(HistSegment *s) {
+    if (s->map) {
+#ifdef _WIN32
+        free(s->map);
+#else
+        munmap(s->map, s->mapLen);
+#endif
+    } else {
+#define HIST_FREE(f) free(s->f);
+        HIST_COLUMN_FIELDS(HIST_FREE)
+#undef HIST_FREE
+        free(s->zones);
+    }
+    memset(s, 0, sizeof(*s));
+}
+
+/* Room for one more block of rows in columns built in memory */
+static int historySegmentGrow(HistSegment *s) {
+    unsigned int cap = s->cap ? s->cap * 2 : HIST_BLOCK_ROWS;
+    void *p;
+#define HIST_GROW(f) \
+    if (!(p = realloc(s->f, sizeof(*s->f) * cap))) return -1; \
+    s->f = p;
+    HIST_COLUMN_FIELDS(HIST_GROW)
+    HIST_GROW(zones)
+#undef HIST_GROW
+    s->cap = cap;
+    return 0;
+}
+
+static void zoneAdd(HistZone *z, const Transaction *t, int first) {
+    if (first) {
+        z->minTime = z->maxTime = t->time;
+        z->maxAmount = t->amount;
+        z->minAccount = z->maxAccount = t->accountNumber;
+        z->types = 0;
+    }
+    if (t->time < z->minTime) z->minTime = t->time;
+    if (t->time > z->maxTime) z->maxTime = t->time;
+    if (t->amount > z->maxAmount) z->maxAmount = t->amount;
+    if (t->accountNumber < z->minAccount) z->minAccount = t->accountNumber;
+    if (t->accountNumber > z->maxAccount) z->maxAccount = t->accountNumber;
+    z->types |= 1u << t->type;
+}
+
+static int historySegmentAppend(HistSegment *s, const Transaction *t, long offset) {
+    if (s->rows == s->cap && historySegmentGrow(s) != 0) return -1;
+    unsigned int r = s->rows++;
+    s->time[r] = t->time;
+    s->amount[r] = t->amount;
+    s->balance[r] = t->remainingBalance;
+    s->account[r] = t->accountNumber;
+    s->offset[r] = (unsigned int)offset;
+    s->machine[r] = t->type == TXN_WITHDRAWAL ? t->machine : -1;
+    s->count[r] = t->type == TXN_INQUIRY_SUMMARY ? t->count : 1;
+    s->span[r] = t->type == TXN_INQUIRY_SUMMARY ? (unsigned int)(t->time - t->firstTime) : 0;
+    s->type[r] = (unsigned char)t->type;
+    if (r % HIST_BLOCK_ROWS == 0) s->blocks++;
+    zoneAdd(&s->zones[s->blocks - 1], t, r % HIST_BLOCK_ROWS == 0);
+    zoneAdd(&s->all, t, r == 0);
+    return 0;
+}
+
+/* Add the records of `segment` from offset s->end on to columns in memory */
+static int historySegmentRead(HistSegment *s, int segment) {
+    TxnReader r;
+    if (txnReaderOpen(&r, segment) != 0) return -1;
+    int ok = s->end <= TXN_SEGMENT_HEADER || txnReaderSeek(&r, s->end) == 0;
+    Transaction t;
+    long at;
+    while (ok && txnReaderNext(&r, &t, &at)) {
+        if (historySegmentAppend(s, &t, at) != 0) ok = 0;
+        else s->end = txnReaderOffset(&r);
+    }
+    if (s->end < TXN_SEGMENT_HEADER) s->end = TXN_SEGMENT_HEADER;
+    txnReaderClose(&r);
+    return ok ? 0 : -1;
+}
+
+/* Map the column file of a sealed segment, if it exists and matches it */
+static int historyStoreOpen(HistSegment *s, int segment) {
+    char path[MAX_LINE];
+    TxnReader r;
+    if (txnReaderOpen(&r, segment) != 0) return -1;
+    long long baseTime = r.baseTime;
+    txnReaderClose(&r);
+    historyStorePath(path, sizeof(path), segment);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+    HistStoreHeader h;
+    long size = -1;
+    if (fread(&h, sizeof(h), 1, fp) == 1 && fseek(fp, 0, SEEK_END) == 0) size = ftell(fp);
+    size_t rowBytes = 0;
+#define HIST_ROW_BYTES(f) rowBytes += sizeof(*s->f);
+    HIST_COLUMN_FIELDS(HIST_ROW_BYTES)
+#undef HIST_ROW_BYTES
+    if (size < 0 || memcmp(h.magic, HIST_STORE_MAGIC, sizeof(HIST_STORE_MAGIC)) != 0 ||
+        h.version != HIST_STORE_VERSION || (int)h.segment != segment || h.baseTime != baseTime ||
+        h.blocks != (h.rows + HIST_BLOCK_ROWS - 1) / HIST_BLOCK_ROWS ||
+        (unsigned long long)size != HIST_STORE_HEADER + sizeof(HistZone) * h.blocks + (unsigned long long)rowBytes * h.rows) {
+        fclose(fp);
+        return -1;
+    }
+#ifdef _WIN32
+    /* no mmap: read the file in one go */
+    char *base = malloc((size_t)size);
+    int ok = base && fseek(fp, 0, SEEK_SET) == 0 && fread(base, 1, (size_t)size, fp) == (size_t)size;
+    fclose(fp);
+    if (!ok) {
+        free(base);
+        return -1;
+    }
+#else
+    void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    fclose(fp);
+    if (map == MAP_FAILED) return -1;
+    char *base = map;
+#endif
+    memset(s, 0, sizeof(*s));
+    s->map = base;
+    s->mapLen = (size_t)size;
+    s->segment = segment;
+    s->rows = h.rows;
+    s->blocks = h.blocks;
+    s->zones = (HistZone *)(base + HIST_STORE_HEADER);
+    if (historyStoreCheck((const HistStoreHeader *)base, s->zones) != h.check) {
+        historySegmentFree(s);
+        return -1;
+    }
+    char *p = base + HIST_STORE_HEADER + sizeof(HistZone) * h.blocks;
+#define HIST_MAP(f) \
+    s->f = (void *)p; \
+    p += sizeof(*s->f) * h.rows;
+    HIST_COLUMN_FIELDS(HIST_MAP)
+#undef HIST_MAP
+    for (unsigned int b = 0; b < s->blocks; ++b) {
+        const HistZone *z = &s->zones[b];
+        if (b == 0) s->all = *z;
+        if (z->minTime < s->all.minTime) s->all.minTime = z->minTime;
+        if (z->maxTime > s->all.maxTime) s->all.maxTime = z->maxTime;
+        if (z->maxAmount > s->all.maxAmount) s->all.maxAmount = z->maxAmount;
+        if (z->minAccount < s->all.minAccount) s->all.minAccount = z->minAccount;
+        if (z->maxAccount > s->all.maxAccount) s->all.maxAccount = z->maxAccount;
+        s->all.types |= z->types;
+    }
+    s->state = 1;
+    return 0;
+}
+
+/* Write the column file of a sealed segment unless a matching one exists */
+int historyStoreBuild(int segment) {
+    char path[MAX_LINE], tmp[MAX_LINE + 8];
+    HistSegment s;
+    if (historyStoreOpen(&s, segment) == 0) {
+        historySegmentFree(&s);
+        return 0;
+    }
+    memset(&s, 0, sizeof(s));
+    TxnReader r;
+    if (txnReaderOpen(&r, segment) != 0) return -1;
+    long long baseTime = r.baseTime;
+    txnReaderClose(&r);
+    if (historySegmentRead(&s, segment) != 0) {
+        historySegmentFree(&s);
+        return -1;
+    }
+    HistStoreHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, HIST_STORE_MAGIC, sizeof(HIST_STORE_MAGIC));
+    h.version = HIST_STORE_VERSION;
+    h.segment = (unsigned int)segment;
+    h.baseTime = baseTime;
+    h.rows = s.rows;
+    h.blocks = s.blocks;
+    h.check = historyStoreCheck(&h, s.zones);
+    historyStorePath(path, sizeof(path), segment);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "wb");
+    int ok = out && fwrite(&h, sizeof(h), 1, out) == 1 &&
+             fwrite(s.zones, sizeof(HistZone), s.blocks, out) == s.blocks;
+#define HIST_WRITE(f) ok = ok && fwrite(s.f, sizeof(*s.f), s.rows, out) == s.rows;
+    HIST_COLUMN_FIELDS(HIST_WRITE)
+#undef HIST_WRITE
+    ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    if (out && fclose(out) != 0) ok = 0;
+    historySegmentFree(&s);
+    if (!ok || rename(tmp, path) != 0) {
+        if (out) remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Columns of a segment for a query (histStoreLock held): the mapped file
+   if there is one, else the segment read into *scratch */
+static HistSegment *historyStoreSegment(int segment, HistSegment *scratch, HistoryQueryStats *stats) {
+    if (segment == histTail.segment) return &histTail;
+    int i = segment - txnFirstSegment;
+    if (i >= histStoreCap) {
+        int cap = histStoreCap ? histStoreCap : 16;
+        while (cap <= i) cap *= 2;
+        HistSegment *grown = realloc(histStore, sizeof(HistSegment) * cap);
+        if (!grown) return NULL;
+        memset(grown + histStoreCap, 0, sizeof(HistSegment) * (cap - histStoreCap));
+        histStore = grown;
+        histStoreCap = cap;
+    }
+    HistSegment *s = &histStore[i];
+    if (s->state == 0 && historyStoreOpen(s, segment) != 0) s->state = -1;
+    if (s->state == 1) return s;
+    s->state = 0; /* the flusher may build it later */
+    memset(scratch, 0, sizeof(*scratch));
+    if (historySegmentRead(scratch, segment) != 0) {
+        historySegmentFree(scratch);
+        return NULL;
+    }
+    stats->segmentsFromLog++;
+    return scratch;
+}
+
+/* Bring histTail up to the end of the active segment (histStoreLock held) */
+static void historyStoreRefreshTail(int active) {
+    if (histTail.segment != active) {
+        historySegmentFree(&histTail);
+        histTail.segment = active;
+    }
+    if (historySegmentRead(&histTail, active) != 0) {
+        printf("Warning: unable to read the active transaction log segment.\n");
+    }
+}
+
+/* Rows of one account, newest first, through its history index positions */
+static int historyQueryAccount(const HistoryQuery *q, int (*fn)(const Transaction *t, TxnPos pos, void *ctx),
+                               void *ctx, HistoryQueryStats *stats) {
+    pthread_mutex_lock(&txnLock);
+    HistoryList *list = historyIndexFind(q->accountFrom);
+    int total = list ? list->count : 0;
+    TxnPos *positions = total ? malloc(sizeof(TxnPos) * total) : NULL;
+    if (positions) memcpy(positions, list->positions, sizeof(TxnPos) * total);
+    pthread_mutex_unlock(&txnLock);
+    if (total && !positions) return -1;
+
+    HistSegment scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    int stop = 0;
+    for (int i = total - 1; i >= 0 && !stop;) {
+        int seg = TXN_POS_SEGMENT(positions[i]);
+        int j = i;
+        while (j >= 0 && TXN_POS_SEGMENT(positions[j]) == seg) j--;
+        stats->segments++;
+        HistSegment *s = historyStoreSegment(seg, &scratch, stats);
+        if (!s || !zoneMatches(&s->all, q)) {
+            stats->segmentsSkipped++;
+        } else {
+            unsigned int hi = s->rows;
+            for (; i > j && !stop; --i) {
+                /* rows are in offset order, and so are the positions */
+                unsigned int off = (unsigned int)TXN_POS_OFFSET(positions[i]), lo = 0;
+                while (lo < hi) {
+                    unsigned int mid = lo + (hi - lo) / 2;
+                    if (s->offset[mid] < off) lo = mid + 1;
+                    else hi = mid;
+                }
+                if (lo == s->rows || s->offset[lo] != off) continue;
+                stats->lookups++;
+                if (s->account[lo] != q->accountFrom || !historyRowMatches(s, lo, q)) continue;
+                Transaction t;
+                historyRow(s, lo, &t);
+                stop = fn(&t, TXN_POS(seg, off), ctx);
+            }
+        }
+        if (s == &scratch) historySegmentFree(&scratch);
+        i = j;
+    }
+    free(positions);
+    return 0;
+}
+
+/* Call fn for each record matching q, newest first, until it returns
+   nonzero. The Transaction passed has no notes (pos locates the full
+   record). Returns -1 if the log is not open. */
+int historyQuery(const HistoryQuery *q, int (*fn)(const Transaction *t, TxnPos pos, void *ctx), void *ctx,
+                 HistoryQueryStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    txnLogFlush();
+    pthread_mutex_lock(&txnLock);
+    int active = txnSegment, first = txnFirstSegment;
+    pthread_mutex_unlock(&txnLock);
+    if (active == 0) return -1;
+    pthread_mutex_lock(&histStoreLock);
+    historyStoreRefreshTail(active);
+    int rc = 0;
+    if (q->accountFrom == q->accountTo) {
+        rc = historyQueryAccount(q, fn, ctx, stats);
+        pthread_mutex_unlock(&histStoreLock);
+        return rc;
+    }
+    HistSegment scratch;
+    int stop = 0;
+    for (int seg = active; seg >= first && !stop; --seg) {
+        stats->segments++;
+        HistSegment *s = historyStoreSegment(seg, &scratch, stats);
+        if (s) stats->blocks += s->blocks;
+        if (!s || !zoneMatches(&s->all, q)) {
+            stats->segmentsSkipped++;
+        } else {
+            for (int b = (int)s->blocks - 1; b >= 0 && !stop; --b) {
+                if (!zoneMatches(&s->zones[b], q)) continue;
+                stats->blocksRead++;
+                unsigned int start = (unsigned int)b * HIST_BLOCK_ROWS;
+                unsigned int end = start + HIST_BLOCK_ROWS < s->rows ? start + HIST_BLOCK_ROWS : s->rows;
+                for (unsigned int r = end; r-- > start && !stop;) {
+                    if (!historyRowMatches(s, r, q)) continue;
+                    Transaction t;
+                    historyRow(s, r, &t);
+                    stop = fn(&t, TXN_POS(seg, s->offset[r]), ctx);
+                }
+            }
+        }
+        if (s == &scratch) historySegmentFree(&scratch);
+    }
+    pthread_mutex_unlock(&histStoreLock);
+    return rc;
+}
+
+/* Unmap the column files and drop the active segment's columns */
+void historyStoreFree(void) {
+    pthread_mutex_lock(&histStoreLock);
+    for (int i = 0; i < histStoreCap; ++i) historySegmentFree(&histStore[i]);
+    free(histStore);
+    histStore = NULL;
+    histStoreCap = 0;
+    historySegmentFree(&histTail);
+    pthread_mutex_unlock(&histStoreLock);
+}
+
+/* Message for a core operation outcome */
+const char *atmStatusText(AtmStatus st) {
+    switch (st) {
+    case ATM_OK:               return "OK";
+    case ATM_ERR_NO_ACCOUNT:   return "Account not found.";
+    case ATM_ERR_LOCKED:       return "Account is locked due to multiple failed login attempts. Contact admin.";
+    case ATM_ERR_BAD_PIN:      return "Incorrect PIN.";
+    case ATM_ERR_NOW_LOCKED:   return "Incorrect PIN. Account locked after 3 failed attempts.";
+    case ATM_ERR_THROTTLED:    return "Too many login attempts. Please try again later.";
+    case ATM_ERR_BAD_AMOUNT:   return "Invalid amount. Must be > 0.";
+    case ATM_ERR_NOT_MULTIPLE: return "Amount is not a multiple of the smallest note.";
+    case ATM_ERR_FUNDS:        return "Insufficient balance.";
+    case ATM_ERR_ATM_CASH:     return "ATM does not have enough cash.";
+    case ATM_ERR_DENOMS:       return "ATM cannot dispense the requested amount with available denominations.";
+    case ATM_ERR_IO:           return "Transaction failed: unable to record withdrawal. No cash dispensed.";
+    }
+    return "Unknown error.";
+}
+
+/* Check one PIN attempt from terminal. On success sets *accIndex and resets
+   the failure count; on a wrong PIN sets *attemptsLeft and locks the
+   account after the third consecutive failure (journaled, see
+   journalLoginState). A PIN matching the one last verified is accepted
+   without rehashing; any other attempt costs a token from the account's
+   bucket, and failed ones (unknown accounts too) one from the terminal's,
+   ATM_ERR_THROTTLED when either is empty or the account's bucket cannot
+   be allocated. A PIN not hashed yet is hashed
+   on its first successful login. */
+AtmStatus verifyLogin(int accNum, int pin, unsigned int terminal, int *accIndex, int *attemptsLeft) {
+    PROBE_START(probe);
+    AtmStatus st;
+    int idx = findAccountIndex(accNum);
+    if (idx == -1) {
+        st = loginTerminalAllows(terminal, 1) ? ATM_ERR_NO_ACCOUNT : ATM_ERR_THROTTLED;
+        if (st == ATM_ERR_THROTTLED) __atomic_add_fetch(&loginThrottled, 1, __ATOMIC_RELAXED);
+        PROBE_END(PROBE_PIN_CHECK, probe);
+        return st;
+    }
+    Account *acc = accountAt(idx);
+    LoginState *ls = loginStateOf(idx);
+    lockAccount(idx);
+    int locked = acc->locked, plain = acc->pin;
+    PinHash cred = *credAt(idx);
+    unsigned long long cached = ls ? ls->pinTag : 0;
+    unlockAccount(idx);
+    if (locked) {
+        PROBE_END(PROBE_PIN_CHECK, probe);
+        return ATM_ERR_LOCKED;
+    }
+
+    int ok;
+    unsigned long long tag = cred.iterations ? loginTag(accNum, pin, &cred) : 0;
+    if (tag && tag == cached) {
+        ok = 1;
+        __atomic_add_fetch(&loginCacheHits, 1, __ATOMIC_RELAXED);
+    } else {
+        int allowed = loginTerminalAllows(terminal, 0);
+        if (allowed) {
+            lockAccount(idx);
+            allowed = loginAccountTakeToken(ls);
+            unlockAccount(idx);
+        }
+        if (!allowed) {
+            __atomic_add_fetch(&loginThrottled, 1, __ATOMIC_RELAXED);
+            PROBE_END(PROBE_PIN_CHECK, probe);
+            return ATM_ERR_THROTTLED;
+        }
+        if (cred.iterations) {
+            unsigned char hash[PIN_HASH_LEN];
+            pinHash(pin, cred.salt, cred.iterations, hash);
+            __atomic_add_fetch(&loginHashes, 1, __ATOMIC_RELAXED);
+            ok = digestEqual(hash, cred.hash);
+        } else {
+            ok = pin == plain;
+        }
+    }
+
+    lockAccount(idx);
+    if (acc->locked) {
+        /* locked by a concurrent attempt meanwhile */
+        st = ATM_ERR_LOCKED;
+    } else if (ok) {
+        acc->loginAttempts = 0; // reset on success
+        if (ls && tag) ls->pinTag = tag;
+        *accIndex = idx;
+        st = ATM_OK;
+    } else {
+        acc->loginAttempts++;
+        *attemptsLeft = 3 - acc->loginAttempts;
+        st = ATM_ERR_BAD_PIN;
+        if (*attemptsLeft <= 0) {
+            acc->locked = 1;
+            if (ls) ls->pinTag = 0;
+            st = ATM_ERR_NOW_LOCKED;
+        }
+    }
+    unlockAccount(idx);
+
+    if (st == ATM_ERR_NOW_LOCKED) {
+        journalLoginState(idx); // persist locked state
+    } else if (st == ATM_ERR_BAD_PIN) {
+        journalMarkDirty(idx);  // the count reaches the snapshot at the next checkpoint
+    } else if (st == ATM_OK && cred.iterations < PIN_HASH_ITERATIONS && accountSetPin(idx, pin) == 0) {
+        journalMarkDirty(idx);
+    }
+    if (st == ATM_ERR_BAD_PIN || st == ATM_ERR_NOW_LOCKED) loginTerminalAllows(terminal, 1);
+    PROBE_END(PROBE_PIN_CHECK, probe);
+    return st;
+}
+
+/* Persist what a session changed outside the journal (login counters):
+   the record is marked for the next checkpoint, which is requested but not
+   waited for */
+void endSession(int accIndex) {
+    inquiryFlushAccount(accIndex);
+    journalMarkDirty(accIndex);
+    requestCheckpoint();
+}
+
+/* Login routine: returns 1 if success and sets accIndex, else 0 */
+int login(int *accIndex) {
+    printLine();
+    printf("Enter Account Number: ");
+    int accNum = safeScanInt("");
+    int idx = findAccountIndex(accNum);
+    if (idx == -1 || accountAt(idx)->locked) {
+        printf("%s\n", atmStatusText(idx == -1 ? ATM_ERR_NO_ACCOUNT : ATM_ERR_LOCKED));
+        return 0;
+    }
+    for (;;) {
+        printf("Enter PIN: ");
+        int pin = safeScanInt("");
+        int attemptsLeft = 0;
+        AtmStatus st = verifyLogin(accNum, pin, LOGIN_TERMINAL_LOCAL, accIndex, &attemptsLeft);
+        if (st == ATM_OK) {
+            printf("Login successful. Welcome, %s!\n", accountName(*accIndex));
+            return 1;
+        } else if (st == ATM_ERR_BAD_PIN) {
+            printf("Incorrect PIN. Attempts remaining: %d\n", attemptsLeft);
+        } else {
+            printf("%s\n", atmStatusText(st));
+            return 0;
+        }
+    }
+}
+
+/* Log tally k (caller holds inquiryLock) and drop it, moving the last tally
+   into its place. A single inquiry is logged as a plain record. */
+static void inquiryLogLocked(int k) {
+    InquiryTally *q = &inquiryTallies[k];
+    Transaction t;
+    t.accountNumber = accountAt(q->slot)->accountNumber;
+    t.type = q->count == 1 ? TXN_BALANCE_INQUIRY : TXN_INQUIRY_SUMMARY;
+    t.amount = 0;
+    t.remainingBalance = q->balance;
+    t.time = q->lastTime;
+    t.count = q->count;
+    t.firstTime = q->firstTime;
+    recordTransaction(&t, txnInquiryDurability);
+    inquiryOf[q->slot] = 0;
+    if (k != --inquiryTallyCount) {
+        *q = inquiryTallies[inquiryTallyCount];
+        inquiryOf[q->slot] = k + 1;
+    }
+}
+
+/* Add an inquiry to the account's tally (caller holds its account lock,
+   so no withdrawal can change the balance or log in between). A tally
+   whose balance no longer matches is logged first. Returns 0 if tallied. */
+static int inquiryTally(const Account *acc, long long now) {
+    int idx = acc->slot;
+    pthread_mutex_lock(&inquiryLock);
+    if (idx >= inquiryOfCap) {
+        int cap = inquiryOfCap ? inquiryOfCap : 1024;
+        while (cap <= idx) cap *= 2;
+        int *grown = realloc(inquiryOf, sizeof(int) * (size_t)cap);
+        if (!grown) {
+            pthread_mutex_unlock(&inquiryLock);
+            return -1;
+        }
+        memset(grown + inquiryOfCap, 0, sizeof(int) * (size_t)(cap - inquiryOfCap));
+        inquiryOf = grown;
+        inquiryOfCap = cap;
+    }
+    int k = inquiryOf[idx] - 1;
+    if (k >= 0 && (inquiryTallies[k].balance != acc->balance || inquiryTallies[k].count == INT_MAX)) {
+        inquiryLogLocked(k);
+        k = -1;
+    }
+    if (k < 0) {
+        if (inquiryTallyCount == inquiryTallyCap) {
+            int cap = inquiryTallyCap ? inquiryTallyCap * 2 : 64;
+            InquiryTally *grown = realloc(inquiryTallies, sizeof(InquiryTally) * (size_t)cap);
+            if (!grown) {
+                pthread_mutex_unlock(&inquiryLock);
+                return -1;
+            }
+            inquiryTallies = grown;
+            inquiryTallyCap = cap;
+        }
+        if (inquiryTallyCount == 0) inquiryFlushDue = now + INQUIRY_SUMMARY_SECONDS;
+        k = inquiryTallyCount++;
+        inquiryTallies[k].slot = idx;
+        inquiryTallies[k].count = 0;
+        inquiryTallies[k].balance = acc->balance;
+        inquiryTallies[k].firstTime = now;
+        inquiryOf[idx] = k + 1;
+    }
+    inquiryTallies[k].count++;
+    inquiryTallies[k].lastTime = now;
+    pthread_mutex_unlock(&inquiryLock);
+    return 0;
+}
+
+/* Log the account's pending inquiries, if any */
+void inquiryFlushAccount(int idx) {
+    pthread_mutex_lock(&inquiryLock);
+    if (idx < inquiryOfCap && inquiryOf[idx]) inquiryLogLocked(inquiryOf[idx] - 1);
+    pthread_mutex_unlock(&inquiryLock);
+}
+
+/* Log every pending inquiry tally */
+void inquiryFlushAll(void) {
+    pthread_mutex_lock(&inquiryLock);
+    while (inquiryTallyCount > 0) inquiryLogLocked(inquiryTallyCount - 1);
+    pthread_mutex_unlock(&inquiryLock);
+}
+
+/* Log a balance inquiry as a transaction, or add it to the account's
+   tally when inquiry summaries are on */
+void recordBalanceInquiry(const Account *acc) {
+    Transaction t;
+    t.accountNumber = acc->accountNumber;
+    t.type = TXN_BALANCE_INQUIRY;
+    t.amount = 0;
+    t.time = (long long)time(NULL);
+    int idx = acc->slot;
+    lockAccount(idx);
+    t.remainingBalance = acc->balance;
+    int tallied = inquirySummaries && inquiryTally(acc, t.time) == 0;
+    unlockAccount(idx);
+    if (!tallied) recordTransaction(&t, txnInquiryDurability);
+}
+
+/* Show account balance */
+void showBalance(const Account *acc) {
+    printLine();
+    printf("Account: %d | Name: %s\n", acc->accountNumber, accountName(acc->slot));
+    char balance[MONEY_BUF];
+    printf("Available Balance: ₹ %s\n", formatMoney(acc->balance, balance));
+    printLine();
+    /* record inquiry as transaction */
+    recordBalanceInquiry(acc);
+}
+
+/* Validate the build-time cassette table (its size is checked where
+   ATM_NUM_DENOMS is defined) and derive the dispense unit.
+   Returns 0 if the table is usable. */
+int checkDenominations(void) {
+    int g = 0;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        if (denomValue[k] <= 0 || (k > 0 && denomValue[k] >= denomValue[k - 1])) {
+            printf("Error: denominations must be positive and in descending order.\n");
+            return -1;
+        }
+        /* gcd of all values: every dispensable amount is a multiple of it */
+        int a = denomValue[k], b = g;
+        while (b) { int r = a % b; a = b; b = r; }
+        g = a;
+    }
+    denomUnit = g;
+    return 0;
+}
+
+/* Total cash held by an inventory */
+long atmTotalCash(const ATM *atm) {
+    long total = 0;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) total += (long)atm->notes[k] * denomValue[k];
+    return total;
+}
+
+static void initDispenseTables(void) {
+    for (int i = 0; i < DISPENSE_TABLES; ++i) pthread_mutex_init(&dispenseTables[i].lock, NULL);
+}
+
+static DispenseTable *dispenseTableFor(const ATM *inv) {
+    unsigned int h = 2166136261u;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) h = (h ^ (unsigned int)inv->notes[k]) * 16777619u;
+    pthread_once(&dispenseTablesOnce, initDispenseTables);
+    return &dispenseTables[h % DISPENSE_TABLES];
+}
+
+/* Build exact-change table `t` for `inv` (its lock held) */
+static int buildDispenseTable(DispenseTable *t, const ATM *inv) {
+    long total = atmTotalCash(inv) / denomUnit;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        int *grown = realloc(t->use[k], sizeof(int) * (size_t)(total + 1));
+        if (!grown) {
+            t->valid = 0;
+            return -1;
+        }
+        t->use[k] = grown;
+    }
+    int units = (int)total;
+    /* stage 0: only the highest denomination */
+    int *u0 = t->use[0];
+    int d0 = denomValue[0] / denomUnit;
+    for (int a = 0; a <= units; ++a) {
+        u0[a] = (a % d0 == 0 && a / d0 <= inv->notes[0]) ? a / d0 : -1;
+    }
+    /* stage k: reachable already, or one more note k on top of a-d */
+    for (int k = 1; k < ATM_NUM_DENOMS; ++k) {
+        const int *prev = t->use[k - 1];
+        int *cur = t->use[k];
+        int d = denomValue[k] / denomUnit;
+        int limit = inv->notes[k];
+        for (int a = 0; a <= units; ++a) {
+            if (prev[a] >= 0) cur[a] = 0;
+            else if (a >= d && cur[a - d] >= 0 && cur[a - d] < limit) cur[a] = cur[a - d] + 1;
+            else cur[a] = -1;
+        }
+    }
+    t->inventory = *inv;
+    t->units = units;
+    t->valid = 1;
+    return 0;
+}
+
+/* Exact breakdown of `amount` (a multiple of denomUnit) for inventory `atm`,
+   preferring fewer small notes. The table is only rebuilt when the
+   inventory changed since the last call (withdrawal or refill).
+   Returns 0 and fills notes[] (one count per cassette) on success, -1 if
+   the amount cannot be made. */
+int solveExactChange(int amount, const ATM *atm, int notes[]) {
+    if (amount < 0 || amount % denomUnit != 0) return -1;
+    int a = amount / denomUnit;
+    DispenseTable *t = dispenseTableFor(atm);
+    pthread_mutex_lock(&t->lock);
+    if (!t->valid || memcmp(t->inventory.notes, atm->notes, sizeof(int) * ATM_NUM_DENOMS) != 0) {
+        if (buildDispenseTable(t, atm) != 0) {
+            pthread_mutex_unlock(&t->lock);
+            return -1;
+        }
+    }
+    int rc = -1;
+    if (a <= t->units && t->use[ATM_NUM_DENOMS - 1][a] >= 0) {
+        for (int k = ATM_NUM_DENOMS - 1; k >= 0; --k) {
+            notes[k] = t->use[k][a];
+            a -= notes[k] * (denomValue[k] / denomUnit);
+        }
+        rc = 0;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return rc;
+}
+
+/* ways *= (1 - x^m), truncated to `units` */
+static void waysMulBinomial(unsigned long long *w, int units, long m) {
+    for (long a = units; a >= m; --a) w[a] -= w[a - m];
+}
+
+/* ways /= (1 - x^m), i.e. ways *= 1 + x^m + x^2m + ... */
+static void waysDivBinomial(unsigned long long *w, int units, long m) {
+    for (long a = m; a <= units; ++a) w[a] += w[a - m];
+}
+
+/* Recompute bits[] from ways[] for amounts `from` and up */
+static void dispenseCacheBits(DispenseCache *c, long from) {
+    for (int w = (int)(from >> 6); w <= c->units >> 6; ++w) {
+        unsigned long long word = 0;
+        int base = w << 6;
+        for (int b = 0; b < 64 && base + b <= c->units; ++b) {
+            if (c->ways[base + b]) word |= 1ULL << b;
+        }
+        c->bits[w] = word;
+    }
+}
+
+/* No amount up to `units` has more combinations than the product of
+   (notes of k usable in it + 1); while that fits in 64 bits a zero count
+   really means the amount cannot be made */
+static int waysExact(const ATM *inv, int units) {
+    unsigned long long p = 1;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        int fit = units / (denomValue[k] / denomUnit);
+        unsigned long long f = (unsigned long long)(inv->notes[k] < fit ? inv->notes[k] : fit) + 1;
+        if (p > ULLONG_MAX / f) return 0;
+        p *= f;
+    }
+    return 1;
+}
+
+/* Bring cache `c` in step with inventory `inv` (c->lock held). Dispenses
+   and refills since the last call are applied as deltas per cassette; a
+   cassette with more notes than any covered amount can use needs no work
+   at all. The counts are only rebuilt on first use or when the machine
+   holds more cash than the cache covers and has room for. */
+static int dispenseCacheSync(DispenseCache *c, const ATM *inv) {
+    long total = atmTotalCash(inv) / denomUnit;
+    if (total > DISPENSE_CACHE_UNITS) total = DISPENSE_CACHE_UNITS;
+    if (c->valid && total <= c->units) {
+        long from = (long)c->units + 1;
+        for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+            if (c->notes[k] == inv->notes[k]) continue;
+            long d = denomValue[k] / denomUnit;
+            long was = d * ((long)c->notes[k] + 1), now = d * ((long)inv->notes[k] + 1);
+            c->notes[k] = inv->notes[k];
+            if (was > c->units && now > c->units) continue;
+            waysDivBinomial(c->ways, c->units, was);
+            waysMulBinomial(c->ways, c->units, now);
+            if (was < from) from = was;
+            if (now < from) from = now;
+        }
+        if (from <= c->units) {
+            dispenseCacheBits(c, from);
+            c->exact = waysExact(inv, c->units);
+        }
+        return 0;
+    }
+    unsigned long long *ways = realloc(c->ways, sizeof(*ways) * (size_t)(total + 1));
+    if (ways) c->ways = ways;
+    unsigned long long *bits = ways ? realloc(c->bits, sizeof(*bits) * (size_t)(total / 64 + 1)) : NULL;
+    if (!bits) {
+        c->valid = 0;
+        return -1;
+    }
+    c->bits = bits;
+    c->units = (int)total;
+    memset(ways, 0, sizeof(*ways) * (size_t)(total + 1));
+    ways[0] = 1;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        long d = denomValue[k] / denomUnit;
+        waysMulBinomial(ways, c->units, d * ((long)inv->notes[k] + 1));
+        waysDivBinomial(ways, c->units, d);
+    }
+    memcpy(c->notes, inv->notes, sizeof(c->notes));
+    dispenseCacheBits(c, 0);
+    c->exact = waysExact(inv, c->units);
+    c->valid = 1;
+    return 0;
+}
+
+/* Cache of machine inventory `machine`, or NULL for a bare inventory */
+static DispenseCache *dispenseCacheOf(const ATM *machine) {
+    if (machine == &atm) return &atmAvail;
+    const Machine *m = (const Machine *)machine;
+    if (fleetCount > 0 && m >= fleet && m < fleet + fleetCount) return &fleet[m - fleet].avail;
+    return NULL;
+}
+
+void dispenseCacheFree(DispenseCache *c) {
+    free(c->ways);
+    free(c->bits);
+    c->ways = c->bits = NULL;
+    c->units = 0;
+    c->valid = 0;
+}
+
+/* Whether machine `atm` can make `amount` exactly from `inv` (its note
+   counts, usually a snapshot), without running a dispense policy.
+   Returns 1 or 0, or -1 if `atm` is not a machine (no cache), the amount
+   is beyond DISPENSE_CACHE_UNITS or the cache could not be allocated; the
+   policy then has to decide. */
+int canDispense(const ATM *atm, const ATM *inv, int amount) {
+    if (amount <= 0 || amount % denomUnit != 0) return 0;
+    DispenseCache *c = dispenseCacheOf(atm);
+    if (!c) return -1;
+    int rc = -1, a = amount / denomUnit;
+    pthread_mutex_lock(&c->lock);
+    if (dispenseCacheSync(c, inv) == 0) {
+        if (a > c->units) {
+            /* below the cap the cache covers all of the machine's cash */
+            rc = c->units < DISPENSE_CACHE_UNITS ? 0 : -1;
+        } else {
+            rc = (c->bits[a >> 6] >> (a & 63)) & 1;
+            /* counts that may have wrapped only prove the positive answers */
+            if (!rc && !c->exact) rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+/* Highest set bit in 1..from, or 0 */
+static int bitsPrev(const unsigned long long *bits, int from) {
+    for (int w = from >> 6; w >= 0; --w) {
+        unsigned long long word = bits[w];
+        if (w == from >> 6) word &= (2ULL << (from & 63)) - 1;
+        if (w == 0) word &= ~1ULL;
+        if (word) return (w << 6) + 63 - __builtin_clzll(word);
+    }
+    return 0;
+}
+
+/* Lowest set bit in from..last, or 0 */
+static int bitsNext(const unsigned long long *bits, int from, int last) {
+    for (int w = from >> 6; from <= last && w <= last >> 6; ++w) {
+        unsigned long long word = bits[w];
+        if (w == from >> 6) word &= ~0ULL << (from & 63);
+        if (word) {
+            int a = (w << 6) + __builtin_ctzll(word);
+            return a <= last ? a : 0;
+        }
+    }
+    return 0;
+}
+
+/* Dispensable amounts closest to `amount` for machine `atm` with counts
+   `inv`: *below is the highest under it, *above the lowest over it and at
+   most `limit` (e.g. the balance); 0 where there is none. Only amounts up
+   to DISPENSE_CACHE_UNITS are candidates, and a machine with more
+   combinations than the counts can hold may miss some, but every amount
+   suggested can be made. Returns -1 without a cache. */
+int nearestDispensable(const ATM *atm, const ATM *inv, int amount, int limit, int *below, int *above) {
+    *below = *above = 0;
+    DispenseCache *c = dispenseCacheOf(atm);
+    if (!c || amount < 0) return -1;
+    pthread_mutex_lock(&c->lock);
+    if (dispenseCacheSync(c, inv) != 0) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    int a = amount / denomUnit;   // highest multiple not above amount
+    int last = limit / denomUnit;
+    if (last > c->units) last = c->units;
+    int under = amount % denomUnit ? a : a - 1;
+    if (under > last) under = last;
+    if (under > 0) *below = bitsPrev(c->bits, under) * denomUnit;
+    if (a + 1 <= last) *above = bitsNext(c->bits, a + 1, last) * denomUnit;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+/* Fewest-notes breakdown of `amount` using at most limits[k] notes of each
+   cassette. Bounded knapsack: each cassette is split into 1,2,4,... note
+   bundles and solved as 0/1 items. Cost is O(items * amount / denomUnit),
+   so it is meant for withdrawal-sized amounts on arbitrary inventories.
+   Returns 0 and fills notes[] on success, -1 if impossible. */
+int solveMinNotes(int amount, const int limits[], int notes[]) {
+    if (amount < 0 || amount % denomUnit != 0) return -1;
+    int units = amount / denomUnit;
+    int itemDenom[ATM_MAX_DENOMS * 32], itemNotes[ATM_MAX_DENOMS * 32];
+    int items = 0;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        int d = denomValue[k] / denomUnit;
+        int c = limits[k] < units / d ? limits[k] : units / d;
+        for (int p = 1; c > 0; p <<= 1) {
+            int take = p < c ? p : c;
+            itemDenom[items] = k;
+            itemNotes[items++] = take;
+            c -= take;
+        }
+    }
+    int *best = malloc(sizeof(int) * (size_t)(units + 1));
+    unsigned char *took = calloc((size_t)items * (units + 1) + 1, 1);
+    if (!best || !took) {
+        free(best);
+        free(took);
+        return -1;
+    }
+    best[0] = 0;
+    for (int a = 1; a <= units; ++a) best[a] = -1;
+    for (int i = 0; i < items; ++i) {
+        int w = itemNotes[i] * (denomValue[itemDenom[i]] / denomUnit);
+        for (int a = units; a >= w; --a) {
+            if (best[a - w] < 0) continue;
+            int cost = best[a - w] + itemNotes[i];
+            if (best[a] < 0 || cost < best[a]) {
+                best[a] = cost;
+                took[(size_t)i * (units + 1) + a] = 1;
+            }
+        }
+    }
+    int rc = -1;
+    if (best[units] >= 0) {
+        for (int k = 0; k < ATM_NUM_DENOMS; ++k) notes[k] = 0;
+        int a = units;
+        for (int i = items - 1; i >= 0; --i) {
+            if (took[(size_t)i * (units + 1) + a]) {
+                notes[itemDenom[i]] += itemNotes[i];
+                a -= itemNotes[i] * (denomValue[itemDenom[i]] / denomUnit);
+            }
+        }
+        rc = 0;
+    }
+    free(best);
+    free(took);
+    return rc;
+}
+
+/* Highest-denomination-first pass; returns 0 if it made the exact amount */
+static int greedyPass(int amount, const int limits[], int notes[]) {
+    int remaining = amount;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        int use = remaining / denomValue[k];
+        if (use > limits[k]) use = limits[k];
+        notes[k] = use;
+        remaining -= use * denomValue[k];
+    }
+    return remaining == 0 ? 0 : -1;
+}
+
+/* Greedy, falling back to the exact-change table when greedy gets stuck
+   (e.g. not enough medium notes) */
+static int dispenseGreedy(int amount, const ATM *atm, int notes[]) {
+    if (greedyPass(amount, atm->notes, notes) == 0) return 0;
+    return solveExactChange(amount, atm, notes);
+}
+
+static int dispenseMinNotes(int amount, const ATM *atm, int notes[]) {
+    return solveMinNotes(amount, atm->notes, notes);
+}
+
+/* Take the same fraction (amount / ATM total) of every cassette, then make
+   the rounding remainder from what is left with the fewest notes */
+static int dispenseBalanced(int amount, const ATM *atm, int notes[]) {
+    long total = atmTotalCash(atm);
+    if (total <= 0 || amount > total) return -1;
+    int left[ATM_MAX_DENOMS], extra[ATM_MAX_DENOMS];
+    long used = 0;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        notes[k] = (int)((long long)atm->notes[k] * amount / total);
+        left[k] = atm->notes[k] - notes[k];
+        used += (long)notes[k] * denomValue[k];
+    }
+    if (solveMinNotes((int)(amount - used), left, extra) == 0) {
+        for (int k = 0; k < ATM_NUM_DENOMS; ++k) notes[k] += extra[k];
+        return 0;
+    }
+    return dispenseGreedy(amount, atm, notes);
+}
+
+/* Greedy over an inventory with part of the smaller half of the cassettes
+   held back; the reserve is only touched if the amount needs it */
+static int dispenseReserveSmall(int amount, const ATM *atm, int notes[]) {
+    int usable[ATM_MAX_DENOMS];
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        usable[k] = atm->notes[k];
+        if (k >= ATM_NUM_DENOMS / 2) usable[k] -= atm->notes[k] * SMALL_NOTE_RESERVE_PCT / 100;
+    }
+    if (greedyPass(amount, usable, notes) == 0) return 0;
+    if (solveMinNotes(amount, usable, notes) == 0) return 0;
+    return dispenseGreedy(amount, atm, notes);
+}
+
+typedef struct {
+    const char *name;
+    int (*dispense)(int amount, const ATM *atm, int notes[]);
+} DispensePolicy;
+
+static const DispensePolicy dispensePolicies[DISPENSE_STRATEGY_COUNT] = {
+    {"Greedy (largest notes first)", dispenseGreedy},
+    {"Minimum note count", dispenseMinNotes},
+    {"Balanced cassette depletion", dispenseBalanced},
+    {"Keep small notes in reserve", dispenseReserveSmall},
+};
+
+DispenseStrategy dispenseStrategy = ATM_DISPENSE_STRATEGY;
+
+/* Calculate denominations with the active dispense policy, respecting ATM
+   availability */
+void calculateDenominations(int amount, const ATM *atm, int notes[], int *possible) {
+    *possible = dispensePolicies[dispenseStrategy].dispense(amount, atm, notes) == 0;
+}
+
+/* Replay the most recent withdrawals from the transaction log against every
+   dispense policy. Each run starts from a full load (the configured default
+   counts, or the current inventory if none are configured); whenever the
+   machine cannot dispense an amount it could afford or runs dry, that is a
+   dead-machine event and the run refills to the full load (one truck roll).
+   Amounts the policy cannot make even from a full load are skipped: no
+   refill would have served them. */
+static int replayCollect(const Transaction *t, TxnPos pos, void *ctx) {
+    ReplayWindow *w = ctx;
+    (void)pos;
+    if (t->type == TXN_WITHDRAWAL) {
+        w->amounts[w->next] = (int)(t->amount / PAISE);
+        w->next = (w->next + 1) % DISPENSE_REPLAY_WINDOW;
+        if (w->count < DISPENSE_REPLAY_WINDOW) w->count++;
+    }
+    return 0;
+}
+
+void evaluateDispenseStrategies(void) {
+    static int amounts[DISPENSE_REPLAY_WINDOW];
+    ReplayWindow window = {amounts, 0, 0};
+    txnLogFlush();
+    txnLogScan(0, replayCollect, &window);
+    int count = window.count, next = window.next;
+    if (count == 0) {
+        printf("No withdrawals in the transaction log to replay.\n");
+        return;
+    }
+    ATM load = {{0}};
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) load.notes[k] = denomDefault[k];
+    if (atmTotalCash(&load) == 0) load = atm;
+
+    printLine();
+    printf("Replaying last %d withdrawals:\n", count);
+    printf("%-30s %8s %14s %10s\n", "Policy", "Served", "Dead/refills", "Notes/txn");
+    int first = (count < DISPENSE_REPLAY_WINDOW) ? 0 : next;
+    for (int s = 0; s < DISPENSE_STRATEGY_COUNT; ++s) {
+        ATM inv = load;
+        int served = 0, dead = 0;
+        long notesOut = 0;
+        for (int i = 0; i < count; ++i) {
+            int amount = amounts[(first + i) % DISPENSE_REPLAY_WINDOW];
+            int notes[ATM_MAX_DENOMS], fromFull[ATM_MAX_DENOMS];
+            if (amount > atmTotalCash(&load) || dispensePolicies[s].dispense(amount, &load, fromFull) != 0) continue;
+            if (amount > atmTotalCash(&inv) || dispensePolicies[s].dispense(amount, &inv, notes) != 0) {
+                dead++;
+                inv = load;
+                memcpy(notes, fromFull, sizeof(notes));
+            }
+            served++;
+            for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+                inv.notes[k] -= notes[k];
+                notesOut += notes[k];
+            }
+        }
+        printf("%c%-29s %8d %14d %10.2f\n", s == (int)dispenseStrategy ? '*' : ' ',
+               dispensePolicies[s].name, served, dead, served ? (double)notesOut / served : 0.0);
+    }
+    printf("(* = active policy)\n");
+    printLine();
+}
+
+/* Validate a withdrawal and pick the notes for it (nothing is changed) */
+AtmStatus planWithdrawal(const Account *acc, const ATM *atm, int amount, int notes[]) {
+    if (amount <= 0) return ATM_ERR_BAD_AMOUNT;
+    if (amount % denomUnit != 0) return ATM_ERR_NOT_MULTIPLE;
+    int idx = acc->slot;
+    lockAccount(idx);
+    Money balance = acc->balance;
+    unlockAccount(idx);
+    if (RUPEES(amount) > balance) return ATM_ERR_FUNDS;
+    /* plan against a snapshot; the notes are only taken in commitWithdrawal */
+    ATM inv;
+    snapshotATM(atm, &inv);
+    if (amount > atmTotalCash(&inv)) return ATM_ERR_ATM_CASH;
+    int possible;
+    PROBE_START(probe);
+    /* amounts no combination of notes can make never reach the policy */
+    possible = canDispense(atm, &inv, amount) != 0;
+    if (possible) calculateDenominations(amount, &inv, notes, &possible);
+    PROBE_END(PROBE_DISPENSE, probe);
+    return possible ? ATM_OK : ATM_ERR_DENOMS;
+}
+
+/* Carry out a planned withdrawal: reserve the notes, journal it, then apply
+   it to the account and log the transaction. Returns ATM_ERR_DENOMS if
+   another session took the planned notes in the meantime. */
+AtmStatus commitWithdrawal(Account *acc, ATM *atm, int amount, const int notes[]) {
+    int idx = acc->slot;
+    AtmStatus st = ATM_OK;
+    PROBE_START(probe);
+    awaitCheckpointBacklog();
+    pthread_rwlock_rdlock(&checkpointLock);
+    lockAccount(idx);
+    if (RUPEES(amount) > acc->balance) {
+        st = ATM_ERR_FUNDS;
+    } else if (reserveNotes(atm, notes) != 0) {
+        st = ATM_ERR_DENOMS;
+    } else {
+        Transaction t;
+        t.accountNumber = acc->accountNumber;
+        t.type = TXN_WITHDRAWAL;
+        t.amount = RUPEES(amount);
+        t.remainingBalance = acc->balance - t.amount;
+        t.time = (long long)time(NULL);
+        t.machine = atmMachineId(atm);
+        memcpy(t.notes, notes, sizeof(int) * ATM_NUM_DENOMS);
+        /* the journal record is the commit point */
+        PROBE_START(journalProbe);
+        int rc = journalWithdrawal(idx, &t, notes, t.machine);
+        PROBE_END(PROBE_JOURNAL, journalProbe);
+        if (rc != 0) {
+            releaseNotes(atm, notes);
+            st = ATM_ERR_IO;
+        } else {
+            acc->balance = t.remainingBalance;
+            PROBE_START(logProbe);
+            /* inquiries at the old balance go into the log ahead of this */
+            if (__atomic_load_n(&inquiryTallyCount, __ATOMIC_RELAXED) > 0) inquiryFlushAccount(idx);
+            recordTransaction(&t, txnWithdrawalDurability);
+            PROBE_END(PROBE_TXN_LOG, logProbe);
+        }
+    }
+    unlockAccount(idx);
+    pthread_rwlock_unlock(&checkpointLock);
+
+    /* accounts.bin / atm.txt catch up at the next checkpoint, off this path */
+    if (st == ATM_OK && __atomic_load_n(&jnlSinceCheckpoint, __ATOMIC_RELAXED) >= jnlCheckpointInterval) {
+        requestCheckpoint();
+    }
+    PROBE_END(PROBE_WITHDRAWAL, probe);
+    return st;
+}
+
+/* Plan and commit in one step, re-planning if a concurrent session took the
+   notes first (used where no customer confirmation sits in between) */
+AtmStatus performWithdrawal(Account *acc, ATM *atm, int amount, int notes[]) {
+    AtmStatus st = ATM_ERR_DENOMS;
+    for (int attempt = 0; attempt < WITHDRAW_RETRIES && st == ATM_ERR_DENOMS; ++attempt) {
+        st = planWithdrawal(acc, atm, amount, notes);
+        if (st == ATM_OK) st = commitWithdrawal(acc, atm, amount, notes);
+    }
+    return st;
+}
+
+/* Offer the dispensable amounts next to one the ATM cannot pay out. With
+   paise in `requested` its whole rupees are themselves a candidate. */
+static void suggestAmounts(const Account *acc, const ATM *atm, Money requested) {
+    ATM inv;
+    snapshotATM(atm, &inv);
+    lockAccount(acc->slot);
+    Money balance = acc->balance;
+    unlockAccount(acc->slot);
+    int below, above, amount = (int)(requested / PAISE);
+    int limit = balance / PAISE > INT_MAX ? INT_MAX : (int)(balance / PAISE);
+    if (nearestDispensable(atm, &inv, amount, limit, &below, &above) != 0) return;
+    if (requested % PAISE != 0 && amount <= limit && canDispense(atm, &inv, amount) == 1) below = amount;
+    if (!below && !above) return;
+    printf("Nearest amounts available:");
+    if (below) printf(" ₹%d", below);
+    if (above) printf("%s ₹%d", below ? " or" : "", above);
+    printf("\n");
+}
+
+/* Withdraw cash */
+void withdrawCash(Account *acc, ATM *atm) {
+    printf("Enter amount to withdraw (multiples of %d): ", denomUnit);
+    Money requested = safeScanMoney("");
+    if (requested <= 0 || requested / PAISE > INT_MAX) {
+        printf("%s\n", atmStatusText(ATM_ERR_BAD_AMOUNT));
+        return;
+    }
+    int amount = (int)(requested / PAISE);
+    /* paise can never be dispensed, whatever the smallest note */
+    if (requested % PAISE != 0) {
+        printf("Amount must be a multiple of %d.\n", denomUnit);
+        suggestAmounts(acc, atm, requested);
+        return;
+    }
+    int notes[ATM_MAX_DENOMS];
+    AtmStatus st = planWithdrawal(acc, atm, amount, notes);
+    if (st == ATM_ERR_NOT_MULTIPLE) {
+        printf("Amount must be a multiple of %d.\n", denomUnit);
+        suggestAmounts(acc, atm, requested);
+        return;
+    } else if (st != ATM_OK) {
+        printf("%s\n", atmStatusText(st));
+        if (st == ATM_ERR_DENOMS || st == ATM_ERR_ATM_CASH) suggestAmounts(acc, atm, requested);
+        return;
+    }
+    /* Show breakdown and ask for confirmation */
+    printLine();
+    printf("Dispensing:\n");
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        if (notes[k]) printf("₹%-4d x %d\n", denomValue[k], notes[k]);
+    }
+    printLine();
+    printf("Confirm withdrawal? (1=Yes, 0=No): ");
+    int confirm = safeScanInt("");
+    if (!confirm) {
+        printf("Withdrawal cancelled.\n");
+        return;
+    }
+    st = commitWithdrawal(acc, atm, amount, notes);
+    if (st != ATM_OK) {
+        printf("%s\n", atmStatusText(st));
+        return;
+    }
+    char balance[MONEY_BUF];
+    printf("Transaction successful. New balance: ₹ %s\n", formatMoney(acc->balance, balance));
+}
+
+/* --------------------- Admin reports ---------------------
+   Reports run on a columnar copy of the book (account numbers, balances,
+   flags). The copy is taken with checkpointLock held exclusively, like a
+   checkpoint, so no withdrawal is half applied in it; that is the only
+   time sessions wait. Aggregates and listings then work on the copy. Both
+   the copy and the aggregation are split over worker threads; aggregation
+   streams the contiguous balance and flag columns without branches. */
+
+static const Money reportBounds[REPORT_BUCKETS - 1] = {
+    RUPEES(1), RUPEES(10), RUPEES(100), RUPEES(1000), RUPEES(10000), RUPEES(100000), RUPEES(1000000)};
+
+typedef struct {
+    const ReportSnapshot *snap;
+    ReportSnapshot *copyTo;    // copy the store into this, or NULL to aggregate
+    int from, to;
+    ReportTotals part;
+    pthread_t thread;
+} ReportWorker;
+
+static void reportCopyRange(ReportSnapshot *snap, int from, int to) {
+    for (int i = from; i < to; ++i) {
+        const Account *a = accountAt(i);
+        snap->accountNumber[i] = a->accountNumber;
+        snap->balance[i] = a->balance;
+        snap->flags[i] = (unsigned char)((a->locked ? REPORT_LOCKED : 0) | (a->loginAttempts > 0 ? REPORT_FAILING : 0));
+    }
+}
+
+/* Aggregate records from..to-1 in one branch-free pass. The bucket is the
+   number of bounds a balance reaches; alternate records go to two sets of
+   tallies so consecutive balances in one bucket do not wait on each other. */
+static void reportReduceRange(const ReportSnapshot *snap, int from, int to, ReportTotals *out) {
+    const Money *bal = snap->balance;
+    const unsigned char *flags = snap->flags;
+    long long count[2][REPORT_BUCKETS] = {{0}};
+    Money sum[2][REPORT_BUCKETS] = {{0}};
+    Money total = 0, lo = LLONG_MAX, hi = LLONG_MIN;
+    long long locked = 0, failing = 0;
+    for (int i = from; i < to; ++i) {
+        Money b = bal[i];
+        total += b;
+        lo = b < lo ? b : lo;
+        hi = b > hi ? b : hi;
+        locked += flags[i] & REPORT_LOCKED;
+        failing += (flags[i] & REPORT_FAILING) >> 1;
+        int k = 0;
+        for (int j = 0; j < REPORT_BUCKETS - 1; ++j) k += b >= reportBounds[j];
+        count[i & 1][k]++;
+        sum[i & 1][k] += b;
+    }
+    out->accounts = to - from;
+    out->locked = locked;
+    out->failing = failing;
+    out->total = total;
+    out->min = lo;
+    out->max = hi;
+    for (int k = 0; k < REPORT_BUCKETS; ++k) {
+        out->bucketCount[k] = count[0][k] + count[1][k];
+        out->bucketTotal[k] = sum[0][k] + sum[1][k];
+    }
+}
+
+static void *reportWorkerMain(void *arg) {
+    ReportWorker *w = arg;
+    if (w->copyTo) reportCopyRange(w->copyTo, w->from, w->to);
+    else reportReduceRange(w->snap, w->from, w->to, &w->part);
+    return NULL;
+}
+
+/* Workers for a book of `count` records */
+static int reportThreadCount(int count) {
+    int threads = reportThreadLimit;
+#ifdef _WIN32
+    if (threads <= 0) threads = 1;
+#else
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads > REPORT_MAX_THREADS) threads = REPORT_MAX_THREADS;
+    if (threads > count / REPORT_MIN_PER_THREAD) threads = count / REPORT_MIN_PER_THREAD;
+    return threads < 1 ? 1 : threads;
+}
+
+/* Copy into `copyTo`, or aggregate `snap` into *out, over equal ranges.
+   The calling thread takes the first range, and any range whose thread
+   cannot be started. */
+static void reportParallel(const ReportSnapshot *snap, ReportSnapshot *copyTo, ReportTotals *out) {
+    ReportWorker workers[REPORT_MAX_THREADS];
+    int started[REPORT_MAX_THREADS] = {0};
+    int threads = reportThreadCount(snap->count);
+    for (int t = 0; t < threads; ++t) {
+        workers[t].snap = snap;
+        workers[t].copyTo = copyTo;
+        workers[t].from = (int)((long long)snap->count * t / threads);
+        workers[t].to = (int)((long long)snap->count * (t + 1) / threads);
+    }
+    for (int t = 1; t < threads; ++t) {
+        started[t] = pthread_create(&workers[t].thread, NULL, reportWorkerMain, &workers[t]) == 0;
+    }
+    reportWorkerMain(&workers[0]);
+    for (int t = 1; t < threads; ++t) {
+        if (started[t]) pthread_join(workers[t].thread, NULL);
+        else reportWorkerMain(&workers[t]);
+    }
+    if (!out) return;
+    memset(out, 0, sizeof(*out));
+    out->min = LLONG_MAX;
+    out->max = LLONG_MIN;
+    for (int t = 0; t < threads; ++t) {
+        const ReportTotals *p = &workers[t].part;
+        if (p->accounts == 0) continue;
+        out->accounts += p->accounts;
+        out->locked += p->locked;
+        out->failing += p->failing;
+        out->total += p->total;
+        if (p->min < out->min) out->min = p->min;
+        if (p->max > out->max) out->max = p->max;
+        for (int b = 0; b < REPORT_BUCKETS; ++b) {
+            out->bucketCount[b] += p->bucketCount[b];
+            out->bucketTotal[b] += p->bucketTotal[b];
+        }
+    }
+}
+
+/* Copy the book for reporting. Lockout flags are read without the account
+   locks, so they may be one login behind. Returns 0, or -1 (with a
+   message) if the copy cannot be allocated. */
+int reportSnapshotTake(ReportSnapshot *snap, double *pausedMs) {
+    memset(snap, 0, sizeof(*snap));
+    pthread_mutex_lock(&accountStoreLock);
+    int count = accountCount;
+    pthread_mutex_unlock(&accountStoreLock);
+    size_t n = count > 0 ? (size_t)count : 1;
+    snap->accountNumber = malloc(sizeof(int) * n);
+    snap->balance = malloc(sizeof(Money) * n);
+    snap->flags = malloc(n);
+    if (!snap->accountNumber || !snap->balance || !snap->flags) {
+        printf("Error: not enough memory for a report on %d accounts.\n", count);
+        reportSnapshotFree(snap);
+        return -1;
+    }
+    snap->count = count;
+    double start = monotonicSeconds();
+    pthread_rwlock_wrlock(&checkpointLock);
+    reportParallel(snap, snap, NULL);
+    pthread_rwlock_unlock(&checkpointLock);
+    if (pausedMs) *pausedMs = (monotonicSeconds() - start) * 1e3;
+    return 0;
+}
+
+void reportSnapshotFree(ReportSnapshot *snap) {
+    free(snap->accountNumber);
+    free(snap->balance);
+    free(snap->flags);
+    memset(snap, 0, sizeof(*snap));
+}
+
+/* Aggregates over the whole snapshot (min and max are 0 for an empty book) */
+void reportTotals(const ReportSnapshot *snap, ReportTotals *out) {
+    reportParallel(snap, NULL, out);
+    if (out->accounts == 0) out->min = out->max = 0;
+}
+
+/* Print the accounts with any of `flagMask` set (0 = all), a page at a
+   time: each page goes out in one write, and the next one only when asked
+   for */
+void reportListAccounts(const ReportSnapshot *snap, unsigned char flagMask) {
+    int total = 0;
+    for (int i = 0; i < snap->count; ++i) total += !flagMask || (snap->flags[i] & flagMask);
+    if (total == 0) {
+        printf("No accounts to list.\n");
+        return;
+    }
+    size_t cap = REPORT_PAGE_SIZE * (MAX_NAME_LEN + 96);
+    char *page = malloc(cap);
+    if (!page) {
+        printf("Error: not enough memory for the listing.\n");
+        return;
+    }
+    int shown = 0;
+    for (int i = 0; i < snap->count;) {
+        size_t len = 0;
+        for (int rows = 0; i < snap->count && rows < REPORT_PAGE_SIZE; ++i) {
+            if (flagMask && !(snap->flags[i] & flagMask)) continue;
+            char balance[MONEY_BUF];
+            len += (size_t)snprintf(page + len, cap - len, "Acc: %d | Name: %s | Bal: ₹%s | Locked: %s\n",
+                                    snap->accountNumber[i], accountName(i), formatMoney(snap->balance[i], balance),
+                                    snap->flags[i] & REPORT_LOCKED ? "Yes" : "No");
+            rows++;
+        }
+        fwrite(page, 1, len, stdout);
+        shown += REPORT_PAGE_SIZE;
+        if (shown >= total) break;
+        printf("-- %d of %d shown. 1 = next page, 0 = stop: ", shown, total);
+        if (safeScanInt("") != 1) break;
+    }
+    free(page);
+}
+
+/* Admin report: liabilities, lockouts and the spread of balances */
+void printAccountReport(void) {
+    ReportSnapshot snap;
+    double pausedMs;
+    if (reportSnapshotTake(&snap, &pausedMs) != 0) return;
+    double start = monotonicSeconds();
+    ReportTotals t;
+    reportTotals(&snap, &t);
+    double totalsMs = (monotonicSeconds() - start) * 1e3;
+
+    char a[MONEY_BUF], b[MONEY_BUF], c[MONEY_BUF];
+    printLine();
+    printf("Account report: %lld accounts (copied in %.2f ms, totalled in %.2f ms on %d thread(s))\n",
+           t.accounts, pausedMs, totalsMs, reportThreadCount(snap.count));
+    printf("Total liabilities: ₹%s\n", formatMoney(t.total, a));
+    printf("Average balance: ₹%s | Lowest: ₹%s | Highest: ₹%s\n",
+           formatMoney(t.accounts ? t.total / t.accounts : 0, a), formatMoney(t.min, b), formatMoney(t.max, c));
+    printf("Locked accounts: %lld | With failed PIN attempts: %lld\n", t.locked, t.failing);
+    printf("%-26s %10s %7s %20s\n", "Balance (rupees)", "Accounts", "Share", "Total");
+    for (int k = 0; k < REPORT_BUCKETS; ++k) {
+        char range[64];
+        if (k == 0) snprintf(range, sizeof(range), "under %lld", reportBounds[0] / PAISE);
+        else if (k == REPORT_BUCKETS - 1) snprintf(range, sizeof(range), "%lld and over", reportBounds[k - 1] / PAISE);
+        else snprintf(range, sizeof(range), "%lld to under %lld", reportBounds[k - 1] / PAISE, reportBounds[k] / PAISE);
+        printf("%-26s %10lld %6.1f%% %20s\n", range, t.bucketCount[k],
+               t.accounts ? 100.0 * t.bucketCount[k] / t.accounts : 0.0, formatMoney(t.bucketTotal[k], a));
+    }
+    printLine();
+    if (t.locked > 0) {
+        printf("List locked accounts? (1=Yes, 0=No): ");
+        if (safeScanInt("") == 1) reportListAccounts(&snap, REPORT_LOCKED);
+    }
+    reportSnapshotFree(&snap);
+}
+
+/* Optional field of the history query form: the trimmed line, "" if blank */
+static char *scanOptional(const char *prompt, char *line, size_t size) {
+    printf("%s", prompt);
+    if (!fgets(line, (int)size, stdin)) line[0] = '\0';
+    char *p = line;
+    while (*p == ' ' || *p == '\t') p++;
+    size_t n = strlen(p);
+    while (n > 0 && isspace((unsigned char)p[n - 1])) p[--n] = '\0';
+    return p;
+}
+
+/* "YYYY-mm-dd" (the start of the day, or its end) or a full local time */
+static int parseQueryTime(const char *s, int endOfDay, long long *out) {
+    char full[TIME_BUF + 16];
+    if (strlen(s) == 10) {
+        snprintf(full, sizeof(full), "%s %s", s, endOfDay ? "23:59:59" : "00:00:00");
+        s = full;
+    }
+    return parseTime(s, out);
+}
+
+typedef struct {
+    int limit, shown, stopped;
+    Money withdrawn;
+    double paused;           // seconds spent waiting at page prompts
+} HistoryQueryView;
+
+static int printQueryRow(const Transaction *t, TxnPos pos, void *ctx) {
+    HistoryQueryView *v = ctx;
+    char amount[MONEY_BUF], balance[MONEY_BUF], when[TIME_BUF], since[TIME_BUF];
+    (void)pos;
+    if (v->shown > 0 && v->shown % REPORT_PAGE_SIZE == 0) {
+        double start = monotonicSeconds();
+        printf("-- %d shown. 1 = next page, 0 = stop: ", v->shown);
+        int more = safeScanInt("") == 1;
+        v->paused += monotonicSeconds() - start;
+        if (!more) {
+            v->stopped = 1;
+            return 1;
+        }
+    }
+    if (t->type == TXN_INQUIRY_SUMMARY) {
+        printf("[%s] Acc: %d | Balance Inquiry x%d since %s | Balance: ₹%s\n", formatTime(t->time, when),
+               t->accountNumber, t->count, formatTime(t->firstTime, since), formatMoney(t->remainingBalance, balance));
+    } else if (t->type == TXN_WITHDRAWAL && t->machine >= 0) {
+        printf("[%s] Acc: %d | %s : ₹%s | Balance: ₹%s | Machine: %d\n", formatTime(t->time, when), t->accountNumber,
+               txnTypeName(t->type), formatMoney(t->amount, amount), formatMoney(t->remainingBalance, balance),
+               t->machine);
+    } else {
+        printf("[%s] Acc: %d | %s : ₹%s | Balance: ₹%s\n", formatTime(t->time, when), t->accountNumber,
+               txnTypeName(t->type), formatMoney(t->amount, amount), formatMoney(t->remainingBalance, balance));
+    }
+    if (t->type == TXN_WITHDRAWAL) v->withdrawn += t->amount;
+    v->shown++;
+    return v->limit > 0 && v->shown >= v->limit;
+}
+
+/* Admin history query: records by account (or range), kind, minimum
+   amount and time range, newest first, through the history store */
+void printHistoryQuery(void) {
+    char line[MAX_LINE], *s;
+    HistoryQuery q = {INT_MIN, INT_MAX, ~0u, LLONG_MIN, LLONG_MIN, LLONG_MAX};
+    s = scanOptional("Account number or range N-M (blank = all): ", line, sizeof(line));
+    int fields = *s ? sscanf(s, "%d-%d", &q.accountFrom, &q.accountTo) : 2;
+    if (fields == 1) q.accountTo = q.accountFrom;
+    if (fields < 1 || q.accountFrom > q.accountTo) {
+        printf("Invalid account. Query cancelled.\n");
+        return;
+    }
+    int kind = safeScanInt("Kind (0 = all, 1 = withdrawals, 2 = balance inquiries): ");
+    if (kind == 1) q.types = 1u << TXN_WITHDRAWAL;
+    else if (kind == 2) q.types = 1u << TXN_BALANCE_INQUIRY | 1u << TXN_INQUIRY_SUMMARY;
+    s = scanOptional("Minimum amount (blank = any): ", line, sizeof(line));
+    const char *end = *s ? parseMoney(s, &q.minAmount) : s;
+    if (!end || *end) {
+        printf("Invalid amount. Query cancelled.\n");
+        return;
+    }
+    s = scanOptional("From (YYYY-mm-dd [HH:MM:SS], blank = start of the log): ", line, sizeof(line));
+    if (*s && parseQueryTime(s, 0, &q.fromTime) != 0) {
+        printf("Invalid time. Query cancelled.\n");
+        return;
+    }
+    s = scanOptional("To (YYYY-mm-dd [HH:MM:SS], blank = now): ", line, sizeof(line));
+    if (*s && parseQueryTime(s, 1, &q.toTime) != 0) {
+        printf("Invalid time. Query cancelled.\n");
+        return;
+    }
+    HistoryQueryView v;
+    memset(&v, 0, sizeof(v));
+    v.limit = safeScanInt("Most recent how many (0 = all): ");
+
+    printLine();
+    double start = monotonicSeconds();
+    HistoryQueryStats st;
+    if (historyQuery(&q, printQueryRow, &v, &st) != 0) {
+        printf("No transaction history found.\n");
+        printLine();
+        return;
+    }
+    double ms = (monotonicSeconds() - start - v.paused) * 1e3;
+    char total[MONEY_BUF];
+    if (v.shown == 0) printf("No matching transactions.\n");
+    printf("%d record(s)%s, withdrawals totalling ₹%s (newest first)\n", v.shown,
+           v.stopped || (v.limit > 0 && v.shown >= v.limit) ? " shown" : "", formatMoney(v.withdrawn, total));
+    if (st.lookups > 0 || q.accountFrom == q.accountTo) {
+        printf("Read %ld record(s) through the account index from %ld of %ld segment(s) in %.2f ms\n", st.lookups,
+               st.segments - st.segmentsSkipped, st.segments, ms);
+    } else {
+        printf("Read %ld of %ld block(s) in %ld of %ld segment(s) in %.2f ms\n", st.blocksRead, st.blocks,
+               st.segments - st.segmentsSkipped, st.segments, ms);
+    }
+    if (st.segmentsFromLog > 0) printf("(%ld segment(s) read from the log: columns not built yet)\n", st.segmentsFromLog);
+    printLine();
+}
+
+/* --------------------- Refill forecast ---------------------
+   Depletion is modelled per machine, cassette and local hour of the day
+   from the withdrawals logged over the last FORECAST_HISTORY_DAYS; each
+   record names its machine and the notes it took. The rate for an hour of
+   the day is what the machine paid out in that hour over the window,
+   divided by how long the window has spent in that hour; hours the window
+   has not seen yet take the machine's average. Time to empty runs those
+   rates forward from the current inventory. A plan for a visit now loads
+   each cassette with the demand expected before the next visit plus
+   FORECAST_SAFETY_Z deviations of its day-to-day spread, in whole
+   bundles, so the truck carries the note mix each machine will pay out. */
+
+/* Local hour of the day of `when`, cached for the rest of that hour */
+static int forecastHour(RefillForecast *f, long long when, long long *day) {
+    if (when < f->hourStart || when >= f->hourStart + 3600) {
+        time_t tt = (time_t)when;
+        struct tm tm;
+#ifdef _WIN32
+        localtime_s(&tm, &tt);
+#else
+        localtime_r(&tt, &tm);
+#endif
+        f->hourStart = when - tm.tm_min * 60 - tm.tm_sec;
+        f->hour = tm.tm_hour;
+        f->hourDay = (long long)tm.tm_year * 366 + tm.tm_yday;
+    }
+    if (day) *day = f->hourDay;
+    return f->hour;
+}
+
+/* Model of machine `id`: index 0 is the standalone machine, then the fleet */
+static RefillModel *forecastModelOf(RefillForecast *f, int id) {
+    if (id == 0) return &f->models[0];
+    Machine *m = findMachine(id);
+    return m ? &f->models[1 + (m - fleet)] : NULL;
+}
+
+/* Square root by Newton's method, which keeps the build free of libm */
+static double forecastSqrt(double v) {
+    if (v <= 0) return 0;
+    double r = v > 1 ? v : 1;
+    for (int i = 0; i < 64; ++i) {
+        double next = (r + v / r) / 2;
+        if (next >= r) break;
+        r = next;
+    }
+    return r;
+}
+
+static void forecastCloseDay(RefillModel *m) {
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        m->daySum[k] += m->dayOpen[k];
+        m->daySq[k] += m->dayOpen[k] * m->dayOpen[k];
+        m->dayOpen[k] = 0;
+    }
+}
+
+static int forecastRecord(const Transaction *t, TxnPos pos, void *ctx) {
+    RefillForecast *f = ctx;
+    (void)pos;
+    if (t->time < f->from || t->time > f->now) return 0;
+    if (t->time < f->first) f->first = t->time;
+    if (t->type != TXN_WITHDRAWAL || t->machine < 0) return 0;
+    RefillModel *m = forecastModelOf(f, t->machine);
+    if (!m) return 0;
+    long long day;
+    int h = forecastHour(f, t->time, &day);
+    if (day != m->day) {
+        forecastCloseDay(m);
+        m->day = day;
+    }
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        m->notes[h][k] += (float)t->notes[k];
+        m->dayOpen[k] += t->notes[k];
+    }
+    m->withdrawals++;
+    return 0;
+}
+
+/* Learn the models of every loaded machine from the log up to `now` */
+int refillForecastBuild(RefillForecast *f, long long now) {
+    memset(f, 0, sizeof(*f));
+    f->count = 1 + fleetCount;
+    f->models = calloc((size_t)f->count, sizeof(RefillModel));
+    if (!f->models) {
+        printf("Error: out of memory for the refill forecast.\n");
+        return -1;
+    }
+    for (int i = 0; i < f->count; ++i) f->models[i].day = -1;
+    f->now = f->first = now;
+    f->from = now - FORECAST_HISTORY_DAYS * 86400LL;
+    f->hourStart = LLONG_MIN;
+    txnLogFlush();
+    txnLogScan(txnLogSince(f->from), forecastRecord, f);
+    for (int i = 0; i < f->count; ++i) forecastCloseDay(&f->models[i]);
+
+    /* time the window spent in each hour of the day */
+    for (long long t = f->first; t < now;) {
+        int h = forecastHour(f, t, NULL);
+        long long end = f->hourStart + 3600 < now ? f->hourStart + 3600 : now;
+        f->exposure[h] += (double)(end - t) / 3600;
+        t = end;
+    }
+    f->hours = (double)(now - f->first) / 3600;
+    if (f->hours < 1) f->hours = 1;
+
+    /* and the hours ahead: the rest of this one, then whole hours */
+    forecastHour(f, now, NULL);
+    long long next = f->hourStart + 3600;
+    f->firstStep = (double)(next - now) / 3600;
+    f->hourAt[0] = (unsigned char)f->hour;
+    for (int i = 1; i < FORECAST_HORIZON_HOURS; ++i) {
+        f->hourAt[i] = (unsigned char)forecastHour(f, next + (long long)(i - 1) * 3600, NULL);
+    }
+    return 0;
+}
+
+void refillForecastFree(RefillForecast *f) {
+    free(f->models);
+    f->models = NULL;
+    f->count = 0;
+}
+
+/* Forecast and plan for the machine at `index` of the forecast, holding `inv` */
+void refillPlanFor(const RefillForecast *f, int index, const ATM *inv, double cycleHours, RefillPlan *out) {
+    const RefillModel *m = &f->models[index];
+    double days = f->hours / 24;
+    out->withdrawals = m->withdrawals;
+    out->historyHours = f->hours;
+    out->firstEmpty = -1;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        double total = 0, rate[24];
+        for (int h = 0; h < 24; ++h) total += m->notes[h][k];
+        for (int h = 0; h < 24; ++h) {
+            rate[h] = f->exposure[h] >= 1 ? m->notes[h][k] / f->exposure[h] : total / f->hours;
+        }
+        double left = inv->notes[k], at = 0, demand = 0;
+        out->emptyIn[k] = left <= 0 ? 0 : -1;
+        for (int i = 0; i < FORECAST_HORIZON_HOURS; ++i) {
+            double len = i ? 1 : f->firstStep, r = rate[f->hourAt[i]];
+            if (at < cycleHours) demand += r * (at + len <= cycleHours ? len : cycleHours - at);
+            if (out->emptyIn[k] < 0 && r * len >= left) out->emptyIn[k] = at + left / r;
+            left -= r * len;
+            at += len;
+        }
+        if (out->emptyIn[k] >= 0 && (out->firstEmpty < 0 || out->emptyIn[k] < out->firstEmpty)) {
+            out->firstEmpty = out->emptyIn[k];
+        }
+
+        /* spread of the daily totals, never below that of a Poisson count */
+        double mean = total / days, var = mean;
+        if (days >= 2 && m->daySq[k] / days - mean * mean > var) var = m->daySq[k] / days - mean * mean;
+        double need = demand + FORECAST_SAFETY_Z * forecastSqrt(var * cycleHours / 24) - inv->notes[k];
+        int bundles = need > 0 ? (int)(need / FORECAST_BUNDLE) : 0;
+        if (need > (double)bundles * FORECAST_BUNDLE) bundles++;
+        out->demand[k] = demand;
+        out->load[k] = bundles * FORECAST_BUNDLE;
+    }
+}
+
+/* Forecast and plan for one machine */
+int refillPlanMachine(int id, const ATM *inv, double cycleHours, RefillPlan *out) {
+    RefillForecast *f = malloc(sizeof(*f));
+    if (!f || refillForecastBuild(f, (long long)time(NULL)) != 0) {
+        free(f);
+        return -1;
+    }
+    RefillModel *m = forecastModelOf(f, id);
+    if (m) refillPlanFor(f, (int)(m - f->models), inv, cycleHours, out);
+    out->machine = id;
+    refillForecastFree(f);
+    free(f);
+    return m ? 0 : -1;
+}
+
+static const char *formatHours(double hours, char *buf, size_t size) {
+    if (hours < 0) snprintf(buf, size, "over %d days", FORECAST_HORIZON_HOURS / 24);
+    else if (hours < 48) snprintf(buf, size, "%.1f h", hours);
+    else snprintf(buf, size, "%.1f days", hours / 24);
+    return buf;
+}
+
+/* Admin view of one machine's forecast and suggested load */
+void printRefillPlan(const RefillPlan *p, const ATM *inv, double cycleHours) {
+    char when[32];
+    printLine();
+    printf("Refill forecast from %ld withdrawal(s) over %s; next visit in %.0f h\n", p->withdrawals,
+           formatHours(p->historyHours, when, sizeof(when)), cycleHours);
+    printf("%-8s %8s %12s %14s %8s\n", "Note", "In ATM", "Until visit", "Empty in", "Load");
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        printf("₹%-7d %8d %12.1f %14s %8d\n", denomValue[k], inv->notes[k], p->demand[k],
+               formatHours(p->emptyIn[k], when, sizeof(when)), p->load[k]);
+    }
+    if (p->firstEmpty >= 0 && p->firstEmpty < cycleHours) {
+        printf("Warning: a cassette runs out in %s, before the next visit.\n",
+               formatHours(p->firstEmpty, when, sizeof(when)));
+    }
+    printLine();
+}
+
+static int compareRefillPlans(const void *a, const void *b) {
+    double x = ((const RefillPlan *)a)->firstEmpty, y = ((const RefillPlan *)b)->firstEmpty;
+    if (x < 0 || y < 0) return (x < 0) - (y < 0);
+    return (x > y) - (x < y);
+}
+
+/* --refill-plan: every machine's plan, soonest to run out first, and what
+   the trucks need to carry in total */
+int runRefillPlan(double cycleHours) {
+    if (!(cycleHours >= 1 && cycleHours <= FORECAST_HORIZON_HOURS)) {
+        printf("Error: the visit interval must be between 1 and %d hours.\n", FORECAST_HORIZON_HOURS);
+        return -1;
+    }
+    RefillForecast *f = malloc(sizeof(*f));
+    if (!f || refillForecastBuild(f, (long long)time(NULL)) != 0) {
+        free(f);
+        return -1;
+    }
+    RefillPlan *plans = malloc(sizeof(RefillPlan) * (size_t)f->count);
+    if (!plans) {
+        refillForecastFree(f);
+        free(f);
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < f->count; ++i) {
+        /* the standalone machine only counts outside a fleet or if it is used */
+        if (i == 0 && fleetCount > 0 && f->models[0].withdrawals == 0) continue;
+        const ATM *inv = i == 0 ? &atm : &fleet[i - 1].atm;
+        refillPlanFor(f, i, inv, cycleHours, &plans[n]);
+        plans[n++].machine = i == 0 ? 0 : fleet[i - 1].id;
+    }
+    qsort(plans, (size_t)n, sizeof(RefillPlan), compareRefillPlans);
+
+    char when[32];
+    long long carry[ATM_MAX_DENOMS] = {0};
+    long long value = 0;
+    printf("Refill plan for a visit now, next visit in %.0f h (history: %s)\n", cycleHours,
+           formatHours(f->hours, when, sizeof(when)));
+    printf("%-8s %14s %12s", "Machine", "Empty in", "Withdrawals");
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) printf(" ₹%-7d", denomValue[k]);
+    printf("\n");
+    for (int i = 0; i < n; ++i) {
+        printf("%-8d %14s %12ld", plans[i].machine, formatHours(plans[i].firstEmpty, when, sizeof(when)),
+               plans[i].withdrawals);
+        for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+            printf(" %-8d", plans[i].load[k]);
+            carry[k] += plans[i].load[k];
+            value += (long long)plans[i].load[k] * denomValue[k];
+        }
+        printf("\n");
+    }
+    printf("%-8s %14s %12s", "Total", "", "");
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        printf(" %-8lld", carry[k]);
+    }
+    printf("\nCash to load: ₹%lld\n", value);
+    free(plans);
+    refillForecastFree(f);
+    free(f);
+    return 0;
+}
+
+/* Simple admin menu to view/refill ATM and unlock accounts */
+void adminMenu() {
+    printf("Enter admin PIN: ");
+    int pin = safeScanInt("");
+    if (pin != ADMIN_PIN) {
+        printf("Invalid admin PIN.\n");
+        return;
+    }
+    int choice;
+    do {
+        printLine();
+        printf("Admin Menu:\n1. View ATM inventory\n2. Refill ATM notes\n3. View all accounts\n4. Unlock account\n5. Dispense policy\n6. Latency metrics\n7. Create account\n8. Export accounts to text\n9. Inquiry logging\n10. Account reports\n11. History query\n12. Exit admin\nEnter choice: ");
+        choice = safeScanInt("");
+        if (choice == 1) {
+            printLine();
+            printf("ATM Inventory:\n");
+            for (int k = 0; k < ATM_NUM_DENOMS; ++k) printf("₹%-4d x %d\n", denomValue[k], atm.notes[k]);
+            printLine();
+        } else if (choice == 2) {
+            int add[ATM_MAX_DENOMS], invalid = 0, suggested = 0;
+            RefillPlan plan;
+            if (refillPlanMachine(0, &atm, FORECAST_CYCLE_HOURS, &plan) == 0 && plan.withdrawals > 0) {
+                printRefillPlan(&plan, &atm, FORECAST_CYCLE_HOURS);
+                printf("Load the suggested notes? (1=Yes, 0=Enter counts): ");
+                suggested = safeScanInt("") == 1;
+            } else {
+                printf("No withdrawals logged here in the last %d days to forecast from.\n", FORECAST_HISTORY_DAYS);
+            }
+            for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+                if (suggested) {
+                    add[k] = plan.load[k];
+                    continue;
+                }
+                printf("Enter additional ₹%d notes to add: ", denomValue[k]);
+                add[k] = safeScanInt("");
+                if (add[k] < 0) invalid = 1;
+            }
+            if (invalid) {
+                printf("Invalid (negative) input. Operation cancelled.\n");
+            } else {
+                releaseNotes(&atm, add); /* adds the notes atomically */
+                journalCheckpoint(); /* also saves atm.txt */
+                printf("ATM refilled successfully.\n");
+            }
+        } else if (choice == 3) {
+            ReportSnapshot snap;
+            if (reportSnapshotTake(&snap, NULL) == 0) {
+                printLine();
+                printf("Accounts List:\n");
+                reportListAccounts(&snap, 0);
+                printLine();
+                reportSnapshotFree(&snap);
+            }
+        } else if (choice == 4) {
+            printf("Enter account number to unlock: ");
+            int accn = safeScanInt("");
+            int idx = findAccountIndex(accn);
+            if (idx == -1) {
+                printf("Account not found.\n");
+            } else {
+                lockAccount(idx);
+                accountAt(idx)->locked = 0;
+                accountAt(idx)->loginAttempts = 0;
+                unlockAccount(idx);
+                /* journaled too, or replaying the lockout would undo this */
+                journalLoginState(idx);
+                printf("Account %d unlocked.\n", accn);
+            }
+        } else if (choice == 5) {
+            evaluateDispenseStrategies();
+            for (int i = 0; i < DISPENSE_STRATEGY_COUNT; ++i) {
+                printf("%d. %s%s\n", i + 1, dispensePolicies[i].name,
+                       i == (int)dispenseStrategy ? " (active)" : "");
+            }
+            int pick = safeScanInt("Select policy (0 = keep current): ");
+            if (pick >= 1 && pick <= DISPENSE_STRATEGY_COUNT) {
+                dispenseStrategy = (DispenseStrategy)(pick - 1);
+                printf("Dispense policy set to: %s\n", dispensePolicies[dispenseStrategy].name);
+            }
+        } else if (choice == 6) {
+            printLatencyReport();
+            FILE *fp = fopen(METRICS_FILE, "w");
+            if (!fp || writeMetrics(fp) != 0) printf("Error: Unable to write %s.\n", METRICS_FILE);
+            else printf("Prometheus metrics written to %s.\n", METRICS_FILE);
+            if (fp) fclose(fp);
+        } else if (choice == 7) {
+            Account a;
+            memset(&a, 0, sizeof(a));
+            char line[MAX_LINE], name[MAX_NAME_LEN];
+            a.accountNumber = safeScanInt("Enter new account number: ");
+            a.pin = safeScanInt("Enter PIN: ");
+            printf("Enter name (no spaces): ");
+            if (!fgets(line, sizeof(line), stdin) || sscanf(line, "%49s", name) != 1) strcpy(name, "Customer");
+            a.balance = safeScanMoney("Enter opening balance: ");
+            int idx = -1;
+            if (a.accountNumber <= 0 || a.pin < 0 || a.balance < 0) {
+                printf("Invalid account details. Operation cancelled.\n");
+            } else if (findAccountIndex(a.accountNumber) != -1) {
+                printf("Account %d already exists.\n", a.accountNumber);
+            } else if ((idx = accountCreate(&a, name)) == -1) {
+                printf("Unable to create account (store full or out of memory).\n");
+            } else {
+                accountSetPin(idx, a.pin);
+                lockAccount(idx);
+                snapshotSaveRecord(ACC_SNAPSHOT_FILE, idx);
+                unlockAccount(idx);
+                printf("Account %d created for %s.\n", a.accountNumber, name);
+            }
+        } else if (choice == 8) {
+            /* a consistent copy: no withdrawal is half applied meanwhile */
+            pthread_rwlock_wrlock(&checkpointLock);
+            if (saveAccounts(ACC_FILE) == 0) printf("%d accounts exported to %s.\n", accountCount, ACC_FILE);
+            pthread_rwlock_unlock(&checkpointLock);
+        } else if (choice == 9) {
+            printf("Balance inquiries are logged %s.\n", inquirySummaries ? "as per-session summaries" : "one record each");
+            int pick = safeScanInt("1 = one record each, 2 = summaries (0 = keep current): ");
+            if (pick == 1 || pick == 2) {
+                inquirySummaries = pick == 2;
+                if (!inquirySummaries) inquiryFlushAll();
+                printf("Inquiry logging set to: %s\n", inquirySummaries ? "summaries" : "one record each");
+            }
+        } else if (choice == 10) {
+            printAccountReport();
+        } else if (choice == 11) {
+            printHistoryQuery();
+        } else if (choice == 12) {
+            printf("Exiting admin menu.\n");
+        } else {
+            printf("Invalid choice.\n");
+        }
+    } while (choice != 12);
+}
+
+/* Load all state from disk and bring it to a consistent point */
+int startSystem(void) {
+    initAccountLocks();
+    probeInit();
+    /* load data from files; the text file is only imported when there is
+       no snapshot at all. accounts.txt is only written by an admin export,
+       so importing it over a damaged snapshot (and saving the result over
+       it) would roll the book back: refuse to start instead. */
+    int loaded = snapshotLoad(ACC_SNAPSHOT_FILE);
+    if (loaded < 0) {
+        printf("Error: not starting over a damaged %s; restore it from a backup, or remove it to rebuild the "
+               "book from %s.\n", ACC_SNAPSHOT_FILE, ACC_FILE);
+        return -1;
+    }
+    if (loaded > 0) {
+        if (loadAccounts(ACC_FILE) != 0) {
+            printf("Error loading accounts.\n");
+            return -1;
+        }
+        if (accountCount > 0) {
+            printf("Imported %d accounts from %s.\n", accountCount, ACC_FILE);
+            if (snapshotSave(ACC_SNAPSHOT_FILE) != 0) return -1;
+        }
+    }
+    loadATM(ATM_FILE);
+    /* journaled withdrawals may name fleet machines even outside --fleet */
+    FILE *fleetFp = fleetCount == 0 ? fopen(FLEET_FILE, "r") : NULL;
+    if (fleetFp) {
+        fclose(fleetFp);
+        loadFleet(FLEET_FILE, 0);
+    }
+    txnLogOpen();
+    if (recoverJournal() != 0 || journalOpen() != 0) {
+        printf("Error opening journal.\n");
+        return -1;
+    }
+
+    /* if no accounts exist, create a sample set (so user can test) */
+    if (accountCount == 0) {
+        printf("No accounts found. Creating sample accounts for testing.\n");
+        static const Account samples[] = {
+            {1001, 1234, RUPEES(15000), 0, 0, 0},
+            {1002, 2345, RUPEES(5000), 0, 0, 0},
+            {1003, 3456, RUPEES(20000), 0, 0, 0},
+        };
+        static const char *sampleNames[] = {"Zaid", "Anita", "Ravi"};
+        for (int i = 0; i < 3; ++i) {
+            int idx = accountCreate(&samples[i], sampleNames[i]);
+            if (idx == -1) return -1;
+            accountSetPin(idx, samples[i].pin);
+        }
+        snapshotSave(ACC_SNAPSHOT_FILE);
+        saveATM(ATM_FILE);
+    }
+    if (startCheckpointer() != 0) printf("Warning: checkpoints will run in the session that triggers them.\n");
+    return 0;
+}
+
+/* Final checkpoint and cleanup */
+void shutdownSystem(void) {
+    inquiryFlushAll();
+    stopCheckpointer();
+    journalClose();
+    txnLogClose();
+
+    /* cleanup */
+    releaseAccounts();
+    for (int i = 0; i < fleetCount; ++i) dispenseCacheFree(&fleet[i].avail);
+    dispenseCacheFree(&atmAvail);
+    free(fleet);
+    fleet = NULL;
+    fleetCount = 0;
+}
+
+/* Interactive console menus */
+void runConsole(void) {
+    printf("Welcome to the ATM Withdrawal System (Console)\n");
+    int mainChoice;
+    do {
+        printLine();
+        printf("Main Menu:\n1. User Login\n2. Admin Menu\n3. Exit\nEnter choice: ");
+        mainChoice = safeScanInt("");
+        if (mainChoice == 1) {
+            int accIndex;
+            if (login(&accIndex)) {
+                Account *acc = accountAt(accIndex);
+                int userChoice;
+                do {
+                    printLine();
+                    printf("1. Balance Inquiry\n2. Cash Withdrawal\n3. Transaction History\n4. Logout\nEnter choice: ");
+                    userChoice = safeScanInt("");
+                    if (userChoice == 1) {
+                        showBalance(acc);
+                    } else if (userChoice == 2) {
+                        withdrawCash(acc, &atm);
+                    } else if (userChoice == 3) {
+                        int lastN = safeScanInt("Show how many recent transactions? (0 = all): ");
+                        inquiryFlushAccount(accIndex);
+                        showTransactionHistory(acc->accountNumber, lastN);
+                    } else if (userChoice == 4) {
+                        printf("Logging out...\n");
+                        endSession(accIndex); // persist any changes
+                    } else {
+                        printf("Invalid choice.\n");
+                    }
+                } while (userChoice != 4);
+            }
+        } else if (mainChoice == 2) {
+            adminMenu();
+        } else if (mainChoice == 3) {
+            printf("Exiting system. Goodbye!\n");
+        } else {
+            printf("Invalid choice.\n");
+        }
+    } while (mainChoice != 3);
+}
+
+/* Seconds on a monotonic clock, for throughput and latency figures */
+double monotonicSeconds(void) {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Non-interactive replay of a command stream (a file, or "-" for stdin).
+   One command per line; blank lines and lines starting with '#' are
+   skipped:
+     B <acc>           balance inquiry
+     W <acc> <amount>  withdrawal (no confirmation step)
+     L <acc> <pin>     PIN check, counting towards lockout
+   Nothing is printed per command; a summary with throughput and failures
+   by reason is printed at the end. Returns 0 if the stream was read. */
+int runBatch(const char *path) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        printf("Error: unable to open batch file %s.\n", path);
+        return -1;
+    }
+    long failures[ATM_ERR_IO + 1] = {0};
+    long inquiries = 0, withdrawals = 0, logins = 0, bad = 0, lineNo = 0;
+    long long dispensed = 0;
+    char line[MAX_LINE];
+
+    jnlDeferSync = 1;
+    jnlCheckpointInterval = BATCH_CHECKPOINT_INTERVAL;
+    double start = monotonicSeconds();
+    while (fgets(line, sizeof(line), in)) {
+        lineNo++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+        char op = (char)toupper((unsigned char)*p++);
+        char *end;
+        long accNum = strtol(p, &end, 10);
+        if (end == p) {
+            bad++;
+            continue;
+        }
+        p = end;
+        long arg = strtol(p, &end, 10);
+        int hasArg = end != p;
+        AtmStatus st = ATM_OK;
+        int idx = findAccountIndex((int)accNum);
+
+        if (op == 'B') {
+            inquiries++;
+            if (idx == -1) st = ATM_ERR_NO_ACCOUNT;
+            else recordBalanceInquiry(accountAt(idx));
+        } else if (op == 'W' && hasArg) {
+            withdrawals++;
+            int notes[ATM_MAX_DENOMS];
+            if (idx == -1) st = ATM_ERR_NO_ACCOUNT;
+            else if (accountAt(idx)->locked) st = ATM_ERR_LOCKED;
+            else st = performWithdrawal(accountAt(idx), &atm, (int)arg, notes);
+            if (st == ATM_OK) dispensed += arg;
+        } else if (op == 'L' && hasArg) {
+            logins++;
+            int loggedIn, left;
+            st = verifyLogin((int)accNum, (int)arg, LOGIN_TERMINAL_LOCAL, &loggedIn, &left);
+        } else {
+            bad++;
+            continue;
+        }
+        if (st != ATM_OK) failures[st]++;
+        if (lineNo % BATCH_SYNC_INTERVAL == 0) journalSync();
+    }
+    inquiryFlushAll();
+    journalCheckpoint();
+    double elapsed = monotonicSeconds() - start;
+    jnlDeferSync = 0;
+    jnlCheckpointInterval = JNL_CHECKPOINT_INTERVAL;
+    if (in != stdin) fclose(in);
+
+    long ops = inquiries + withdrawals + logins;
+    long failed = 0;
+    for (int i = 0; i <= ATM_ERR_IO; ++i) failed += failures[i];
+    printLine();
+    printf("Batch complete: %ld commands in %.3f s (%.0f ops/s)\n",
+           ops, elapsed, elapsed > 0 ? ops / elapsed : 0.0);
+    printf("Balance inquiries: %ld | Withdrawals: %ld (₹%lld dispensed) | PIN checks: %ld\n",
+           inquiries, withdrawals, dispensed, logins);
+    printf("Failures: %ld\n", failed);
+    for (int i = 1; i <= ATM_ERR_IO; ++i) {
+        if (failures[i]) printf("  %8ld  %s\n", failures[i], atmStatusText((AtmStatus)i));
+    }
+    if (bad) printf("Unrecognised lines: %ld\n", bad);
+    printLine();
+    return 0;
+}
+
+/* --------------------- Benchmarks ---------------------
+   Each row times BENCH_SAMPLES calls (fewer for full rewrites of large
+   books) one by one and reports the mean, p50 and p99 in nanoseconds plus
+   heap allocations per call. Per-call figures include about 20-30 ns of
+   clock overhead. The real data files are never touched: the synthetic
+   book lives in memory and persistence goes to the BENCH_* files. */
+
+typedef struct {
+    int *keys;          // account numbers to look up, in probe order
+    int keyCount;
+    const ATM *inv[2];  // inventories, alternated when inv[1] is set
+    int *amounts;
+    int amountCount;
+    TxnDurability durability;
+    AccountRecordV2 *combined; // the book in the old combined layout
+    long step;          // calls per simulated second (timestamp rows)
+    int queryWindow;    // seconds a history query row covers, 0 = one account
+    int pinOffset;      // added to the right PIN (login rows)
+    const ReportSnapshot *report;
+    struct Session *session; // pooled server session (session rows)
+    long sink;          // keeps results live
+} BenchCtx;
+
+static int benchCompare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Time `iters` calls of op and print one result row */
+static void benchRun(const char *name, long iters, void (*op)(BenchCtx *ctx, long i), BenchCtx *ctx) {
+    long samples = iters < BENCH_SAMPLES ? iters : BENCH_SAMPLES;
+    double *ns = malloc(sizeof(double) * (size_t)samples);
+    if (!ns) return;
+    double total = 0;
+    allocCount = 0;
+    allocCounting = 1;
+    for (long i = 0; i < samples; ++i) {
+        double t0 = monotonicSeconds();
+        op(ctx, i);
+        ns[i] = (monotonicSeconds() - t0) * 1e9;
+        total += ns[i];
+    }
+    allocCounting = 0;
+    unsigned long allocs = allocCount;
+    qsort(ns, (size_t)samples, sizeof(double), benchCompare);
+    printf("%-34s %9ld %11.0f %9.0f %9.0f", name, samples, total / samples,
+           ns[samples / 2], ns[(long)(samples * 0.99)]);
+#ifdef ATM_ALLOC_COUNT
+    printf(" %9.2f\n", (double)allocs / samples);
+#else
+    (void)allocs;
+    printf(" %9s\n", "n/a");
+#endif
+    free(ns);
+}
+
+static void benchLookupOp(BenchCtx *ctx, long i) {
+    ctx->sink += findAccountIndex(ctx->keys[i % ctx->keyCount]);
+}
+
+/* PIN of synthetic account idx (see benchMakeBook) */
+static int benchPin(int idx) {
+    return 1000 + idx % 9000;
+}
+
+static void benchPinHashOp(BenchCtx *ctx, long i) {
+    unsigned char salt[PIN_SALT_LEN] = {0}, hash[PIN_HASH_LEN];
+    pinHash(benchPin((int)i), salt, PIN_HASH_ITERATIONS, hash);
+    ctx->sink += hash[0];
+}
+
+static void benchLoginOp(BenchCtx *ctx, long i) {
+    int accNum = ctx->keys[i % ctx->keyCount];
+    int idx = findAccountIndex(accNum), left;
+    if (idx >= 0) {
+        ctx->sink += verifyLogin(accNum, benchPin(idx) + ctx->pinOffset, LOGIN_TERMINAL_LOCAL, &idx, &left);
+    }
+}
+
+/* Set the console terminal's failure budget (tokens) */
+static void benchTerminalTokens(float tokens) {
+    pthread_mutex_lock(&loginTerminalLock);
+    LoginTerminal *t = loginTerminalOf(LOGIN_TERMINAL_LOCAL, monotonicSeconds());
+    t->tokens = tokens;
+    pthread_mutex_unlock(&loginTerminalLock);
+}
+
+static void benchDispenseOp(BenchCtx *ctx, long i) {
+    int notes[ATM_MAX_DENOMS], possible;
+    const ATM *inv = ctx->inv[ctx->inv[1] ? i & 1 : 0];
+    calculateDenominations(ctx->amounts[i % ctx->amountCount], inv, notes, &possible);
+    ctx->sink += possible;
+}
+
+static void benchExactChangeOp(BenchCtx *ctx, long i) {
+    int notes[ATM_MAX_DENOMS];
+    /* more distinct inventories than tables, in turn, so every call rebuilds */
+    ATM inv = *ctx->inv[0];
+    inv.notes[ATM_NUM_DENOMS - 1] -= (int)(i % (4 * DISPENSE_TABLES)) % (inv.notes[ATM_NUM_DENOMS - 1] + 1);
+    ctx->sink += solveExactChange(ctx->amounts[(i * 2) % ctx->amountCount], &inv, notes);
+}
+
+static void benchCanDispenseOp(BenchCtx *ctx, long i) {
+    ctx->sink += canDispense(&atm, &atm, ctx->amounts[i % ctx->amountCount]);
+}
+
+static void benchNearestOp(BenchCtx *ctx, long i) {
+    int below, above;
+    nearestDispensable(&atm, &atm, ctx->amounts[i % ctx->amountCount], INT_MAX, &below, &above);
+    ctx->sink += below + above;
+}
+
+/* one note out, then back in: every call applies a delta */
+static void benchCacheDeltaOp(BenchCtx *ctx, long i) {
+    atm.notes[(i >> 1) % ATM_NUM_DENOMS] += i & 1 ? 1 : -1;
+    ctx->sink += canDispense(&atm, &atm, ctx->amounts[i % ctx->amountCount]);
+}
+
+static void benchCacheRebuildOp(BenchCtx *ctx, long i) {
+    atmAvail.valid = 0;
+    ctx->sink += canDispense(&atm, &atm, ctx->amounts[i % ctx->amountCount]);
+}
+
+static void benchReportCopyOp(BenchCtx *ctx, long i) {
+    ReportSnapshot snap;
+    (void)i;
+    if (reportSnapshotTake(&snap, NULL) == 0) ctx->sink += snap.balance[snap.count - 1];
+    reportSnapshotFree(&snap);
+}
+
+static void benchReportTotalsOp(BenchCtx *ctx, long i) {
+    ReportTotals t;
+    (void)i;
+    reportTotals(ctx->report, &t);
+    ctx->sink += t.total;
+}
+
+static void benchExportOp(BenchCtx *ctx, long i) {
+    (void)i;
+    ctx->sink += saveAccounts(BENCH_ACC_FILE);
+}
+
+static void benchSnapshotSaveOp(BenchCtx *ctx, long i) {
+    (void)i;
+    ctx->sink += snapshotSave(BENCH_SNAPSHOT_FILE);
+}
+
+static void benchSnapshotRecordOp(BenchCtx *ctx, long i) {
+    ctx->sink += snapshotSaveRecord(BENCH_SNAPSHOT_FILE, (int)((i * 7919) % accountCount));
+}
+
+/* Startup load paths; each run replaces the book with what it loaded */
+static void benchImportOp(BenchCtx *ctx, long i) {
+    (void)i;
+    ctx->sink += loadAccounts(BENCH_ACC_FILE);
+}
+
+static void benchSnapshotLoadOp(BenchCtx *ctx, long i) {
+    (void)i;
+    ctx->sink += snapshotLoad(BENCH_SNAPSHOT_FILE);
+}
+
+/* Layout comparison: the same work against the split store and against a
+   contiguous array of the old combined records, probed through the same
+   index. Scan ops cover the whole book. */
+static int benchCombinedFind(const BenchCtx *ctx, int accNum) {
+    unsigned int mask = (unsigned int)accIndexCap - 1;
+    unsigned int pos = hashAccountNumber(accNum) & mask;
+    while (accIndexSlots[pos] != 0) {
+        int idx = accIndexSlots[pos] - 1;
+        if (ctx->combined[idx].accountNumber == accNum) return idx;
+        pos = (pos + 1) & mask;
+    }
+    return -1;
+}
+
+static void benchCombinedLookupOp(BenchCtx *ctx, long i) {
+    ctx->sink += benchCombinedFind(ctx, ctx->keys[i % ctx->keyCount]);
+}
+
+/* a failed PIN: find the record, bump its counter, check the limit */
+static void benchLockoutOp(BenchCtx *ctx, long i) {
+    int idx = findAccountIndex(ctx->keys[i % ctx->keyCount]);
+    Account *a = accountAt(idx);
+    if (++a->loginAttempts >= 3) a->loginAttempts = 0;
+    ctx->sink += a->locked;
+}
+
+static void benchCombinedLockoutOp(BenchCtx *ctx, long i) {
+    AccountRecordV2 *a = &ctx->combined[benchCombinedFind(ctx, ctx->keys[i % ctx->keyCount])];
+    if (++a->loginAttempts >= 3) a->loginAttempts = 0;
+    ctx->sink += a->locked;
+}
+
+/* admin-style listing of balances and lock state */
+static void benchListOp(BenchCtx *ctx, long i) {
+    (void)i;
+    Money total = 0;
+    long locked = 0;
+    for (int c = 0; c * ACCOUNT_CHUNK < accountCount; ++c) {
+        const Account *chunk = accountChunks[c];
+        int n = accountCount - c * ACCOUNT_CHUNK < ACCOUNT_CHUNK ? accountCount - c * ACCOUNT_CHUNK : ACCOUNT_CHUNK;
+        for (int k = 0; k < n; ++k) {
+            total += chunk[k].balance;
+            locked += chunk[k].locked;
+        }
+    }
+    ctx->sink += (long)total + locked;
+}
+
+static void benchCombinedListOp(BenchCtx *ctx, long i) {
+    (void)i;
+    double total = 0;
+    long locked = 0;
+    for (int k = 0; k < accountCount; ++k) {
+        total += ctx->combined[k].balance;
+        locked += ctx->combined[k].locked;
+    }
+    ctx->sink += (long)total + locked;
+}
+
+/* the same listing with names, which the split layout keeps elsewhere */
+static void benchListNamesOp(BenchCtx *ctx, long i) {
+    (void)i;
+    long n = 0;
+    for (int c = 0; c * ACCOUNT_CHUNK < accountCount; ++c) {
+        const Account *chunk = accountChunks[c];
+        const AccountProfile *names = profileChunks[c];
+        int used = accountCount - c * ACCOUNT_CHUNK < ACCOUNT_CHUNK ? accountCount - c * ACCOUNT_CHUNK : ACCOUNT_CHUNK;
+        for (int k = 0; k < used; ++k) n += chunk[k].locked + names[k].name[0];
+    }
+    ctx->sink += n;
+}
+
+static void benchCombinedListNamesOp(BenchCtx *ctx, long i) {
+    (void)i;
+    long n = 0;
+    for (int k = 0; k < accountCount; ++k) n += ctx->combined[k].locked + ctx->combined[k].name[0];
+    ctx->sink += n;
+}
+
+static void benchRecordOp(BenchCtx *ctx, long i) {
+    Transaction t;
+    t.accountNumber = ctx->keys[i % ctx->keyCount];
+    t.type = TXN_WITHDRAWAL;
+    t.amount = RUPEES(500);
+    t.remainingBalance = RUPEES(1000000);
+    t.time = 1704110400LL + i;
+    t.machine = 0;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) t.notes[k] = denomValue[k] == 500;
+    recordTransaction(&t, ctx->durability);
+}
+
+static void benchFormatTimeOp(BenchCtx *ctx, long i) {
+    char buf[TIME_BUF];
+    ctx->sink += formatTime(1704110400LL + i / ctx->step, buf)[18];
+}
+
+static void benchLocaltimeOp(BenchCtx *ctx, long i) {
+    char buf[TIME_BUF];
+    time_t tt = (time_t)(1704110400LL + i / ctx->step);
+    struct tm tm;
+#ifdef _WIN32
+    localtime_s(&tm, &tt);
+#else
+    localtime_r(&tt, &tm);
+#endif
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    ctx->sink += buf[18];
+}
+
+static void benchInquiryOp(BenchCtx *ctx, long i) {
+    recordBalanceInquiry(accountAt(findAccountIndex(ctx->keys[i % ctx->keyCount])));
+}
+
+static void benchCountRecord(const Transaction *t, void *ctx) {
+    ((BenchCtx *)ctx)->sink += t->amount;
+}
+
+static void benchHistoryOp(BenchCtx *ctx, long i) {
+    forEachTransaction(ctx->keys[(i * 7919) % ctx->keyCount], 10, benchCountRecord, ctx);
+}
+
+static int benchScanRecord(const Transaction *t, TxnPos pos, void *ctx) {
+    (void)pos;
+    ((BenchCtx *)ctx)->sink += t->accountNumber;
+    return 0;
+}
+
+static void benchScanOp(BenchCtx *ctx, long i) {
+    (void)i;
+    txnLogScan(0, benchScanRecord, ctx);
+}
+
+static int benchQueryRecord(const Transaction *t, TxnPos pos, void *ctx) {
+    (void)pos;
+    ((BenchCtx *)ctx)->sink += t->amount;
+    return 0;
+}
+
+/* Withdrawals of one account, or of every account within one minute */
+static void benchQueryOp(BenchCtx *ctx, long i) {
+    HistoryQuery q = {INT_MIN, INT_MAX, 1u << TXN_WITHDRAWAL, 0, LLONG_MIN, LLONG_MAX};
+    HistoryQueryStats st;
+    if (ctx->queryWindow) {
+        q.fromTime = 1704110400LL + (i * ctx->queryWindow) % BENCH_SAMPLES;
+        q.toTime = q.fromTime + ctx->queryWindow - 1;
+    } else {
+        q.accountFrom = q.accountTo = ctx->keys[(i * 7919) % ctx->keyCount];
+    }
+    historyQuery(&q, benchQueryRecord, ctx, &st);
+}
+
+static long benchSegmentSize(int segment, int compressed) {
+    char path[MAX_LINE];
+    txnSegmentPath(path, sizeof(path), segment, compressed);
+    FILE *fp = fopen(path, "rb");
+    long size = fp && fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : 0;
+    if (fp) fclose(fp);
+    return size;
+}
+
+/* Delete the benchmark's log segments, their columns and the index */
+static void benchRemoveLog(void) {
+    char path[MAX_LINE];
+    for (int seg = 1; txnSegmentExists(seg); ++seg) {
+        for (int c = 0; c < 2; ++c) {
+            txnSegmentPath(path, sizeof(path), seg, c);
+            remove(path);
+        }
+        historyStorePath(path, sizeof(path), seg);
+        remove(path);
+    }
+    historyIndexPath(path, sizeof(path));
+    remove(path);
+}
+
+/* Replace the in-memory book with `count` synthetic accounts. Account
+   numbers are scattered (multiplicative hash mod a prime) so the index
+   sees realistic probe patterns. */
+static int benchMakeBook(int count) {
+    releaseAccounts();
+    Account a;
+    char name[MAX_NAME_LEN];
+    memset(&a, 0, sizeof(a));
+    for (int i = 0; i < count; ++i) {
+        a.accountNumber = 100000000 + (int)(((unsigned long long)i * 2654435761ULL) % 1000000007ULL);
+        a.pin = benchPin(i);
+        a.balance = RUPEES(1000000);
+        snprintf(name, MAX_NAME_LEN, "bench%d", i);
+        if (accountCreate(&a, name) == -1) {
+            printf("Memory allocation failed for %d benchmark accounts.\n", count);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void benchHeader(const char *title) {
+    printLine();
+    printf("%s\n", title);
+    printf("%-34s %9s %11s %9s %9s %9s\n", "benchmark", "ops", "ns/op", "p50", "p99", "allocs/op");
+}
+
+/* Dispense rows for one inventory over the whole amount sweep */
+static void benchDispense(const char *label, const ATM *inv, BenchCtx *ctx) {
+    int fails = 0, affordable = 0, notes[ATM_MAX_DENOMS];
+    for (int i = 0; i < ctx->amountCount; ++i) {
+        if (ctx->amounts[i] % denomUnit != 0 || ctx->amounts[i] > atmTotalCash(inv)) continue;
+        affordable++;
+        if (greedyPass(ctx->amounts[i], inv->notes, notes) != 0) fails++;
+    }
+    char name[64];
+    ctx->inv[0] = inv;
+    ctx->inv[1] = NULL;
+    for (int s = 0; s < DISPENSE_STRATEGY_COUNT; ++s) {
+        dispenseStrategy = (DispenseStrategy)s;
+        snprintf(name, sizeof(name), "dispense %s/%d", label, s + 1);
+        benchRun(name, BENCH_SAMPLES, benchDispenseOp, ctx);
+    }
+    dispenseStrategy = ATM_DISPENSE_STRATEGY;
+    printf("  (%s: greedy alone fails on %d of %d affordable amounts)\n", label, fails, affordable);
+}
+
+#ifdef __linux__
+static int benchSessions(BenchCtx *ctx);
+#endif
+
+/* Run every benchmark; books grow by 10x from 1000 up to maxAccounts */
+int runBenchmarks(int maxAccounts) {
+    if (maxAccounts < 1000) maxAccounts = 1000;
+    initAccountLocks();
+    BenchCtx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+
+    /* amounts: every multiple of the smallest note up to 200 notes' worth,
+       plus as many amounts that are not multiples */
+    ctx.amountCount = 400;
+    ctx.amounts = malloc(sizeof(int) * (size_t)ctx.amountCount);
+    ctx.keys = malloc(sizeof(int) * BENCH_SAMPLES);
+    if (!ctx.amounts || !ctx.keys) {
+        free(ctx.amounts);
+        free(ctx.keys);
+        return -1;
+    }
+    for (int i = 0; i < ctx.amountCount; i += 2) {
+        ctx.amounts[i] = (i / 2 + 1) * denomUnit;
+        ctx.amounts[i + 1] = (i / 2 + 1) * denomUnit + denomUnit / 2 + 1;
+    }
+
+    printf("Dispense policies: ");
+    for (int s = 0; s < DISPENSE_STRATEGY_COUNT; ++s) printf("%d = %s%s", s + 1, dispensePolicies[s].name,
+                                                          s + 1 < DISPENSE_STRATEGY_COUNT ? ", " : "\n");
+    /* full default load; smallest cassette empty so greedy gets stuck on
+       odd multiples of the next note up; and a near-empty machine */
+    ATM full = {{0}}, noSmall = {{0}}, sparse = {{0}};
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        full.notes[k] = denomDefault[k] ? denomDefault[k] : 50;
+        noSmall.notes[k] = k == ATM_NUM_DENOMS - 1 ? 0 : 50;
+        sparse.notes[k] = 1 + k;
+    }
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) atm.notes[k] = full.notes[k];
+    benchHeader("Denomination search (calculateDenominations, per policy)");
+    benchDispense("full", &full, &ctx);
+    benchDispense("no-small", &noSmall, &ctx);
+    benchDispense("sparse", &sparse, &ctx);
+    ctx.inv[0] = &full;
+    ctx.inv[1] = NULL;
+    benchRun("solveExactChange table rebuild", 2000, benchExactChangeOp, &ctx);
+    benchHeader("Dispensable amounts (per-machine cache, full load)");
+    benchRun("canDispense", BENCH_SAMPLES, benchCanDispenseOp, &ctx);
+    benchRun("nearestDispensable", BENCH_SAMPLES, benchNearestOp, &ctx);
+    benchRun("cache delta, one note", BENCH_SAMPLES, benchCacheDeltaOp, &ctx);
+    benchRun("cache rebuild", 20000, benchCacheRebuildOp, &ctx);
+
+    /* history and dump output: many records per second, then one each */
+    benchHeader("Timestamp formatting");
+    ctx.step = 64;
+    benchRun("formatTime, 64 per second", BENCH_SAMPLES, benchFormatTimeOp, &ctx);
+    benchRun("strftime, 64 per second", BENCH_SAMPLES, benchLocaltimeOp, &ctx);
+    ctx.step = 1;
+    benchRun("formatTime, new second each", BENCH_SAMPLES, benchFormatTimeOp, &ctx);
+    benchRun("strftime, new second each", BENCH_SAMPLES, benchLocaltimeOp, &ctx);
+
+    for (long n = 1000; n <= maxAccounts; n *= 10) {
+        if (benchMakeBook((int)n) != 0) break;
+        char title[64], name[64];
+        snprintf(title, sizeof(title), "Account book: %ld accounts", n);
+        benchHeader(title);
+        for (int i = 0; i < BENCH_SAMPLES; ++i) {
+            ctx.keys[i] = accountAt((int)(((unsigned long long)i * 40503ULL) % (unsigned long long)n))->accountNumber;
+        }
+        ctx.keyCount = BENCH_SAMPLES;
+        benchRun("findAccountIndex hit", BENCH_SAMPLES, benchLookupOp, &ctx);
+        for (int i = 0; i < BENCH_SAMPLES; ++i) ctx.keys[i] = -1 - i; /* never issued */
+        benchRun("findAccountIndex miss", BENCH_SAMPLES, benchLookupOp, &ctx);
+        for (int i = 0; i < BENCH_SAMPLES; ++i) {
+            ctx.keys[i] = accountAt((int)(((unsigned long long)i * 40503ULL) % (unsigned long long)n))->accountNumber;
+        }
+        /* the first keys get hashed PINs, which also caches their tags */
+        for (int i = 0; i < BENCH_LOGIN_KEYS; ++i) {
+            int idx = findAccountIndex(ctx.keys[i]);
+            accountSetPin(idx, benchPin(idx));
+        }
+        ctx.keyCount = BENCH_LOGIN_KEYS;
+        if (n == 1000) {
+            snprintf(name, sizeof(name), "PIN hash (PBKDF2, %d rounds)", PIN_HASH_ITERATIONS);
+            benchRun(name, 50, benchPinHashOp, &ctx);
+        }
+        benchRun("verifyLogin, cached", BENCH_SAMPLES, benchLoginOp, &ctx);
+        ctx.pinOffset = 1;
+        benchTerminalTokens(0);
+        benchRun("verifyLogin, throttled (wrong PIN)", BENCH_SAMPLES, benchLoginOp, &ctx);
+        benchTerminalTokens(LOGIN_TERMINAL_BURST);
+        ctx.pinOffset = 0;
+        ctx.keyCount = BENCH_SAMPLES;
+
+        /* hot/cold split against the old combined records */
+        ctx.combined = calloc((size_t)n, sizeof(AccountRecordV2));
+        if (ctx.combined) {
+            for (int k = 0; k < n; ++k) {
+                const Account *a = accountAt(k);
+                AccountRecordV2 *r = &ctx.combined[k];
+                r->accountNumber = a->accountNumber;
+                r->pin = a->pin;
+                r->balance = (double)a->balance / PAISE;
+                strcpy(r->name, accountName(k));
+                r->slot = k;
+            }
+            long scans = 20000000 / n;
+            if (scans < 5) scans = 5;
+            benchRun("lookup hit, split", BENCH_SAMPLES, benchLookupOp, &ctx);
+            benchRun("lookup hit, combined", BENCH_SAMPLES, benchCombinedLookupOp, &ctx);
+            benchRun("failed PIN count, split", BENCH_SAMPLES, benchLockoutOp, &ctx);
+            benchRun("failed PIN count, combined", BENCH_SAMPLES, benchCombinedLockoutOp, &ctx);
+            benchRun("list balances, split", scans, benchListOp, &ctx);
+            benchRun("list balances, combined", scans, benchCombinedListOp, &ctx);
+            benchRun("list with names, split", scans, benchListNamesOp, &ctx);
+            benchRun("list with names, combined", scans, benchCombinedListNamesOp, &ctx);
+            free(ctx.combined);
+            ctx.combined = NULL;
+            for (int k = 0; k < n; ++k) accountAt(k)->loginAttempts = 0;
+        }
+
+        /* admin reports: the copy pauses withdrawals, the totals do not */
+        ReportSnapshot snap;
+        long reports = 20000000 / n;
+        if (reports < 5) reports = 5;
+        if (reportSnapshotTake(&snap, NULL) == 0) {
+            ctx.report = &snap;
+            snprintf(name, sizeof(name), "report copy, %d thread(s)", reportThreadCount((int)n));
+            benchRun(name, reports, benchReportCopyOp, &ctx);
+            snprintf(name, sizeof(name), "report totals, %d thread(s)", reportThreadCount((int)n));
+            benchRun(name, reports, benchReportTotalsOp, &ctx);
+            reportThreadLimit = 1;
+            benchRun("report totals, 1 thread", reports, benchReportTotalsOp, &ctx);
+            reportThreadLimit = 0;
+            ctx.report = NULL;
+            reportSnapshotFree(&snap);
+        }
+
+        long rewrites = 2000000 / n;
+        if (rewrites < 3) rewrites = 3;
+        snprintf(name, sizeof(name), "saveAccounts export (%ld KB)", n * ACC_RECORD_LEN / 1024);
+        benchRun(name, rewrites, benchExportOp, &ctx);
+        snprintf(name, sizeof(name), "snapshotSave (%ld KB)",
+                 ((n + n / 4) / ACCOUNT_CHUNK + 1) * ACCOUNT_CHUNK *
+                 (long)(sizeof(Account) + sizeof(AccountProfile) + sizeof(PinHash) + 4) / 1024);
+        benchRun(name, rewrites, benchSnapshotSaveOp, &ctx);
+        benchRun("snapshotSaveRecord (synced)", 2000, benchSnapshotRecordOp, &ctx);
+
+        /* compression and history columns are built by hand below rather
+           than by the flusher */
+        int compress = txnCompressSealed, columns = histStoreSealed;
+        txnLogPrefix = BENCH_TXN_PREFIX;
+        txnCompressSealed = histStoreSealed = 0;
+        benchRemoveLog();
+        if (txnLogOpen() == 0) {
+            ctx.durability = TXN_FLUSH_LAZY;
+            benchRun("recordTransaction lazy", BENCH_SAMPLES, benchRecordOp, &ctx);
+            ctx.durability = TXN_FLUSH_RECORD;
+            benchRun("recordTransaction record", 50000, benchRecordOp, &ctx);
+            ctx.durability = TXN_FLUSH_SYNC;
+            benchRun("recordTransaction sync", 200, benchRecordOp, &ctx);
+            int summaries = inquirySummaries;
+            long before = txnLogEnd;
+            inquirySummaries = 0;
+            benchRun("recordBalanceInquiry, each", BENCH_SAMPLES, benchInquiryOp, &ctx);
+            long each = txnLogEnd - before;
+            inquirySummaries = 1;
+            benchRun("recordBalanceInquiry, summarized", BENCH_SAMPLES, benchInquiryOp, &ctx);
+            inquiryFlushAll();
+            inquirySummaries = summaries;
+            printf("  (log bytes for %d inquiries: %ld each, %ld summarized)\n", BENCH_SAMPLES, each,
+                   txnLogEnd - before - each);
+            benchRun("history last 10 (raw segment)", 20000, benchHistoryOp, &ctx);
+            benchRun("txnLogScan (raw segment)", 20, benchScanOp, &ctx);
+            pthread_mutex_lock(&txnLock);
+            txnRotateLocked((long long)time(NULL));
+            pthread_mutex_unlock(&txnLock);
+            long raw = benchSegmentSize(1, 0);
+            txnCompressSegment(1);
+            printf("  (segment 1: %ld KB raw, %ld KB compressed)\n", raw / 1024, benchSegmentSize(1, 1) / 1024);
+            benchRun("history last 10 (compressed)", 20000, benchHistoryOp, &ctx);
+            benchRun("txnLogScan (compressed)", 20, benchScanOp, &ctx);
+            historyStoreBuild(1);
+            ctx.queryWindow = 0;
+            benchRun("history query, one account (columns)", 20000, benchQueryOp, &ctx);
+            ctx.queryWindow = 60;
+            benchRun("history query, one minute (columns)", 2000, benchQueryOp, &ctx);
+            txnLogClose();
+        }
+        benchRemoveLog();
+        txnLogPrefix = TXN_LOG_PREFIX;
+        txnCompressSealed = compress;
+        histStoreSealed = columns;
+        benchRun("loadAccounts text import", rewrites, benchImportOp, &ctx);
+        benchRun("snapshotLoad (mmap + verify)", rewrites, benchSnapshotLoadOp, &ctx);
+    }
+    int rc = 0;
+#ifdef __linux__
+    rc = benchSessions(&ctx);
+#endif
+    printLine();
+    remove(BENCH_ACC_FILE);
+    remove(BENCH_SNAPSHOT_FILE);
+    free(ctx.amounts);
+    free(ctx.keys);
+    releaseAccounts();
+    dispenseCacheFree(&atmAvail);
+    return rc;
+}
+
+/* --------------------- Server mode ---------------------
+   Line protocol, one request per line, one reply per request:
+   LOGIN <acc> <pin>   -> OK <name>            | ERR <message>
+   BALANCE             -> OK <balance>
+   QUOTE <amount>      -> OK <notes per cassette>
+   WITHDRAW <amount>   -> OK <new balance> <notes per cassette>
+   SUGGEST <amount>    -> OK <below> <above>: the nearest amounts the machine
+                          can dispense, above capped at the balance; 0 = none
+   HISTORY [n]         -> TXN <datetime>;<type>;<amount>;<balance> lines, then OK <count>
+                          (inquiry summaries add ;<inquiries>;<first datetime>)
+   LOGOUT              -> OK
+   QUIT                -> OK, then the connection is closed
+   METRICS             -> Prometheus text (see writeMetrics), then OK;
+                          allowed without logging in
+   MACHINE <id>        -> OK <notes per cassette> | ERR <message>; picks the
+                          fleet machine later QUOTE/WITHDRAW requests use
+                          (default: the lowest id); allowed without login
+   Terminals confirm a withdrawal locally (after QUOTE) before sending it.
+   Requests run the same core operations as the console directly on the
+   event loop thread; those do their own per-account locking.
+   Sessions come from a per-loop pool and buffer replies in place, and the
+   fixed replies are formatted once (sessionTemplatesInit), so a
+   login, balance, withdraw, logout cycle makes no heap allocation; only
+   replies longer than SESSION_OUT_INLINE (history, metrics) spill to the
+   heap, until they are sent.
+*/
+#ifdef __linux__
+
+typedef struct Session {
+    int fd;
+    ATM *atm;                  // machine the session withdraws from
+    int accIndex;              // -1 until LOGIN succeeds
+    unsigned int peer;         // login terminal: hash of the client address
+    int closing;               // close once the output is flushed
+    char in[SESSION_IN_MAX];
+    size_t inLen;
+    char *out;                 // outInline unless a reply outgrew it
+    size_t outLen, outSent, outCap;
+    struct Session *nextFree;  // in the pool's free list while unused
+    char outInline[SESSION_OUT_INLINE];
+} Session;
+
+/* Sessions of one event loop, allocated SESSION_POOL_BLOCK at a time and
+   never freed before the loop ends (only its thread touches them) */
+typedef struct {
+    Session *free;
+    Session **blocks;
+    int blockCount;
+} SessionPool;
+
+/* A fixed reply, formatted once */
+typedef struct {
+    char text[MAX_LINE];
+    size_t len;
+} SessionReply;
+
+SessionReply sessionErrReplies[ATM_ERR_IO + 1]; // "ERR <atmStatusText>\n" by status
+pthread_once_t sessionTemplatesOnce = PTHREAD_ONCE_INIT;
+
+/* Login terminal of a client: FNV-1a of its address without the port, so
+   reconnecting does not buy a fresh failure budget (never
+   LOGIN_TERMINAL_LOCAL) */
+static unsigned int peerTerminal(const struct sockaddr_storage *addr) {
+    const unsigned char *p = NULL;
+    size_t n = 0;
+    if (addr->ss_family == AF_INET) {
+        p = (const unsigned char *)&((const struct sockaddr_in *)addr)->sin_addr;
+        n = sizeof(struct in_addr);
+    } else if (addr->ss_family == AF_INET6) {
+        p = (const unsigned char *)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+        n = sizeof(struct in6_addr);
+    }
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < n; ++i) h = (h ^ p[i]) * 16777619u;
+    return h == LOGIN_TERMINAL_LOCAL ? 1 : h;
+}
+
+volatile sig_atomic_t serverStop = 0;
+
+static void onServerSignal(int sig) {
+    (void)sig;
+    serverStop = 1;
+}
+
+static void sessionTemplatesBuild(void) {
+    for (int st = 0; st <= ATM_ERR_IO; ++st) {
+        SessionReply *r = &sessionErrReplies[st];
+        r->len = (size_t)snprintf(r->text, sizeof(r->text), "ERR %s\n", atmStatusText((AtmStatus)st));
+    }
+}
+
+static void sessionTemplatesInit(void) {
+    pthread_once(&sessionTemplatesOnce, sessionTemplatesBuild);
+}
+
+/* Add SESSION_POOL_BLOCK free sessions to the pool */
+static int sessionPoolGrow(SessionPool *pool) {
+    Session *block = malloc(sizeof(Session) * SESSION_POOL_BLOCK);
+    Session **blocks = block ? realloc(pool->blocks, sizeof(Session *) * (size_t)(pool->blockCount + 1)) : NULL;
+    if (!blocks) {
+        free(block);
+        return -1;
+    }
+    pool->blocks = blocks;
+    pool->blocks[pool->blockCount++] = block;
+    for (int i = SESSION_POOL_BLOCK - 1; i >= 0; --i) {
+        block[i].nextFree = pool->free;
+        pool->free = &block[i];
+    }
+    return 0;
+}
+
+/* Take a session from the pool, growing it by a block if it is empty;
+   NULL if that fails */
+static Session *sessionAcquire(SessionPool *pool) {
+    if (!pool->free && sessionPoolGrow(pool) != 0) return NULL;
+    Session *s = pool->free;
+    pool->free = s->nextFree;
+    s->fd = -1;
+    s->atm = fleetCount > 0 ? &fleet[0].atm : &atm;
+    s->accIndex = -1;
+    s->peer = LOGIN_TERMINAL_LOCAL;
+    s->closing = 0;
+    s->inLen = 0;
+    s->out = s->outInline;
+    s->outCap = sizeof(s->outInline);
+    s->outLen = s->outSent = 0;
+    return s;
+}
+
+static void sessionRelease(SessionPool *pool, Session *s) {
+    if (s->out != s->outInline) free(s->out);
+    s->nextFree = pool->free;
+    pool->free = s;
+}
+
+static void sessionPoolFree(SessionPool *pool) {
+    for (int i = 0; i < pool->blockCount; ++i) free(pool->blocks[i]);
+    free(pool->blocks);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/* Room for n more bytes of output; NULL (and the session closes) if a
+   spilled buffer cannot grow */
+static char *sessionReserve(Session *s, size_t n) {
+    if (s->outLen + n > s->outCap) {
+        size_t cap = s->outCap * 2;
+        while (cap < s->outLen + n) cap *= 2;
+        char *grown = s->out == s->outInline ? malloc(cap) : realloc(s->out, cap);
+        if (!grown) {
+            s->closing = 1;
+            return NULL;
+        }
+        if (s->out == s->outInline) memcpy(grown, s->outInline, s->outLen);
+        s->out = grown;
+        s->outCap = cap;
+    }
+    return s->out + s->outLen;
+}
+
+/* Append text to a session's output buffer */
+static void sessionWrite(Session *s, const char *buf, size_t n) {
+    char *p = sessionReserve(s, n);
+    if (!p) return;
+    memcpy(p, buf, n);
+    s->outLen += n;
+}
+
+static void sessionReply(Session *s, const SessionReply *r) {
+    sessionWrite(s, r->text, r->len);
+}
+
+/* Append a string literal, its length known at compile time */
+#define SESSION_LITERAL(s, text) sessionWrite((s), (text), sizeof(text) - 1)
+
+/* Mark the bytes written at the reserved pointer as output (end is one
+   past the last) */
+static void sessionCommit(Session *s, const char *end) {
+    s->outLen = (size_t)(end - s->out);
+}
+
+static void sessionPrintf(Session *s, const char *fmt, ...) {
+    char buf[MAX_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (n >= (int)sizeof(buf)) n = (int)sizeof(buf) - 1;
+    sessionWrite(s, buf, (size_t)n);
+}
+
+/* " <notes per cassette>\n"; the caller reserved room for it */
+static char *putNotes(char *p, const int notes[]) {
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        *p++ = ' ';
+        p = putInt(p, notes[k]);
+    }
+    *p++ = '\n';
+    return p;
+}
+
+static void sessionNotes(Session *s, const int notes[]) {
+    char *p = sessionReserve(s, (size_t)ATM_NUM_DENOMS * 12 + 1);
+    if (p) sessionCommit(s, putNotes(p, notes));
+}
+
+static void sessionHistoryLine(const Transaction *t, void *ctx) {
+    Session *s = ctx;
+    char amount[MONEY_BUF], balance[MONEY_BUF], when[TIME_BUF];
+    sessionPrintf(s, "TXN %s;%s;%s;%s", formatTime(t->time, when), txnTypeName(t->type),
+                  formatMoney(t->amount, amount), formatMoney(t->remainingBalance, balance));
+    if (t->type == TXN_INQUIRY_SUMMARY) sessionPrintf(s, ";%d;%s", t->count, formatTime(t->firstTime, when));
+    sessionPrintf(s, "\n");
+}
+
+/* Split a request into its command word (upper-cased, cut to size - 1
+   chars) and up to two integer arguments. Returns the number of arguments
+   that parsed, -1 for a blank line. */
+static int parseRequest(const char *line, char *cmd, size_t size, int *a, int *b) {
+    const char *p = line;
+    while (*p == ' ' || *p == '\t') p++;
+    if (!*p) return -1;
+    size_t n = 0;
+    for (; *p && !isspace((unsigned char)*p); ++p) {
+        if (n < size - 1) cmd[n++] = (char)toupper((unsigned char)*p);
+    }
+    cmd[n] = '\0';
+    if (!(p = parseInt(p, a))) return 0;
+    return parseInt(p, b) ? 2 : 1;
+}
+
+/* Run one request line */
+static void handleRequest(Session *s, char *line) {
+    char cmd[16];
+    int a = 0, b = 0;
+    int args = parseRequest(line, cmd, sizeof(cmd), &a, &b);
+    if (args < 0) return;
+
+    if (strcmp(cmd, "QUIT") == 0) {
+        if (s->accIndex != -1) endSession(s->accIndex);
+        s->accIndex = -1;
+        s->closing = 1;
+        SESSION_LITERAL(s, "OK\n");
         return;
     }
-    fprintf(fp, "%d;%s;%.2f;%.2f;%s\n",
-            t->accountNumber, t->type, t->amount, t->remainingBalance, t->datetime);
-    fclose(fp);
+    if (strcmp(cmd, "METRICS") == 0) {
+        char *text = NULL;
+        size_t len = 0;
+        FILE *mem = open_memstream(&text, &len);
+        int ok = mem && writeMetrics(mem) == 0;
+        if (mem && fclose(mem) != 0) ok = 0;
+        if (ok) {
+            sessionWrite(s, text, len);
+            sessionPrintf(s, "OK\n");
+        } else {
+            sessionPrintf(s, "ERR Metrics unavailable.\n");
+        }
+        free(text);
+        return;
+    }
+    if (strcmp(cmd, "MACHINE") == 0) {
+        Machine *m = args >= 1 ? findMachine(a) : NULL;
+        if (!m) {
+            sessionPrintf(s, "ERR %s\n", args >= 1 ? "Unknown machine." : "Usage: MACHINE <id>");
+            return;
+        }
+        ATM inv;
+        snapshotATM(&m->atm, &inv);
+        s->atm = &m->atm;
+        sessionPrintf(s, "OK");
+        sessionNotes(s, inv.notes);
+        return;
+    }
+    if (strcmp(cmd, "LOGIN") == 0) {
+        if (args < 2) {
+            sessionPrintf(s, "ERR Usage: LOGIN <account> <pin>\n");
+            return;
+        }
+        if (s->accIndex != -1) endSession(s->accIndex);
+        s->accIndex = -1;
+        int idx, left = 0;
+        AtmStatus st = verifyLogin(a, b, s->peer, &idx, &left);
+        char *p;
+        if (st == ATM_OK) {
+            s->accIndex = idx;
+            if ((p = sessionReserve(s, MAX_NAME_LEN + 4))) {
+                p = putText(putText(p, "OK "), accountName(idx));
+                *p++ = '\n';
+                sessionCommit(s, p);
+            }
+        } else if (st == ATM_ERR_BAD_PIN) {
+            if ((p = sessionReserve(s, 64))) {
+                p = putInt(putText(p, "ERR Incorrect PIN. Attempts remaining: "), left);
+                *p++ = '\n';
+                sessionCommit(s, p);
+            }
+        } else {
+            sessionReply(s, &sessionErrReplies[st]);
+        }
+        return;
+    }
+    if (s->accIndex == -1) {
+        SESSION_LITERAL(s, "ERR Not logged in.\n");
+        return;
+    }
+    Account *acc = accountAt(s->accIndex);
+    if (strcmp(cmd, "BALANCE") == 0) {
+        recordBalanceInquiry(acc);
+        lockAccount(s->accIndex);
+        Money balance = acc->balance;
+        unlockAccount(s->accIndex);
+        char *p = sessionReserve(s, MONEY_BUF + 4);
+        if (p) {
+            p = putMoney(putText(p, "OK "), balance);
+            *p++ = '\n';
+            sessionCommit(s, p);
+        }
+    } else if (strcmp(cmd, "QUOTE") == 0 || strcmp(cmd, "WITHDRAW") == 0) {
+        int notes[ATM_MAX_DENOMS];
+        AtmStatus st = ATM_ERR_BAD_AMOUNT;
+        if (args >= 1) {
+            st = cmd[0] == 'W' ? performWithdrawal(acc, s->atm, a, notes) : planWithdrawal(acc, s->atm, a, notes);
+        }
+        char *p;
+        if (st != ATM_OK) {
+            sessionReply(s, &sessionErrReplies[st]);
+        } else if ((p = sessionReserve(s, MONEY_BUF + 4 + (size_t)ATM_NUM_DENOMS * 12))) {
+            p = putText(p, "OK");
+            if (cmd[0] == 'W') {
+                lockAccount(s->accIndex);
+                Money balance = acc->balance;
+                unlockAccount(s->accIndex);
+                *p++ = ' ';
+                p = putMoney(p, balance);
+            }
+            sessionCommit(s, putNotes(p, notes));
+        }
+    } else if (strcmp(cmd, "SUGGEST") == 0) {
+        ATM inv;
+        snapshotATM(s->atm, &inv);
+        lockAccount(s->accIndex);
+        Money balance = acc->balance;
+        unlockAccount(s->accIndex);
+        int below = 0, above = 0;
+        int limit = balance / PAISE > INT_MAX ? INT_MAX : (int)(balance / PAISE);
+        if (args < 1 || a < 0) sessionPrintf(s, "ERR Usage: SUGGEST <amount>\n");
+        else if (nearestDispensable(s->atm, &inv, a, limit, &below, &above) != 0) sessionPrintf(s, "ERR Suggestions unavailable.\n");
+        else sessionPrintf(s, "OK %d %d\n", below, above);
+    } else if (strcmp(cmd, "HISTORY") == 0) {
+        inquiryFlushAccount(s->accIndex);
+        int total = forEachTransaction(acc->accountNumber, args >= 1 ? a : 0, sessionHistoryLine, s);
+        sessionPrintf(s, "OK %d\n", total < 0 ? 0 : total);
+    } else if (strcmp(cmd, "LOGOUT") == 0) {
+        endSession(s->accIndex);
+        s->accIndex = -1;
+        SESSION_LITERAL(s, "OK\n");
+    } else {
+        SESSION_LITERAL(s, "ERR Unknown command.\n");
+    }
+}
+
+/* Split buffered input into lines and run them */
+static void sessionProcessInput(Session *s) {
+    size_t start = 0;
+    for (size_t i = 0; i < s->inLen; ++i) {
+        if (s->in[i] != '\n') continue;
+        s->in[i] = '\0';
+        if (i > start && s->in[i - 1] == '\r') s->in[i - 1] = '\0';
+        handleRequest(s, s->in + start);
+        start = i + 1;
+        if (s->closing) break;
+    }
+    memmove(s->in, s->in + start, s->inLen - start);
+    s->inLen -= start;
+    if (s->inLen == sizeof(s->in)) {
+        /* a line longer than SESSION_IN_MAX - drop the client */
+        s->closing = 1;
+    }
+}
+
+/* Send as much buffered output as the socket takes; returns 1 if some
+   is still pending */
+static int sessionFlush(Session *s) {
+    while (s->outSent < s->outLen) {
+        ssize_t n = send(s->fd, s->out + s->outSent, s->outLen - s->outSent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            s->closing = 1;
+            s->outSent = s->outLen;
+            break;
+        }
+        s->outSent += (size_t)n;
+    }
+    s->outSent = s->outLen = 0;
+    if (s->out != s->outInline) {
+        /* back to the inline buffer once a long reply is out */
+        free(s->out);
+        s->out = s->outInline;
+        s->outCap = sizeof(s->outInline);
+    }
+    return 0;
+}
+
+typedef struct {
+    int port;
+    int listenFd;
+    pthread_t thread;
+    SessionPool pool;
+} ServerLoop;
+
+static void sessionClose(ServerLoop *loop, int ep, Session *s) {
+    if (s->accIndex != -1) endSession(s->accIndex);
+    epoll_ctl(ep, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    sessionRelease(&loop->pool, s);
+}
+
+/* One event loop: its own listening socket (SO_REUSEPORT lets the kernel
+   spread new connections across loops) and its own epoll set */
+static void *serverLoopMain(void *arg) {
+    ServerLoop *loop = arg;
+    int ep = epoll_create1(0);
+    if (ep < 0 || sessionPoolGrow(&loop->pool) != 0) {
+        if (ep >= 0) close(ep);
+        return NULL;
+    }
+    struct epoll_event ev = {0}, events[SERVER_MAX_EVENTS];
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; /* NULL marks the listening socket */
+    epoll_ctl(ep, EPOLL_CTL_ADD, loop->listenFd, &ev);
+
+    while (!serverStop) {
+        int n = epoll_wait(ep, events, SERVER_MAX_EVENTS, 500);
+        for (int i = 0; i < n; ++i) {
+            Session *s = events[i].data.ptr;
+            if (!s) {
+                int fd;
+                struct sockaddr_storage addr;
+                socklen_t addrLen = sizeof(addr);
+                while ((fd = accept(loop->listenFd, (struct sockaddr *)&addr, &addrLen)) >= 0) {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    Session *ns = sessionAcquire(&loop->pool);
+                    if (!ns) {
+                        close(fd);
+                        continue;
+                    }
+                    ns->fd = fd;
+                    ns->peer = peerTerminal(&addr);
+                    addrLen = sizeof(addr);
+                    struct epoll_event cev = {0};
+                    cev.events = EPOLLIN;
+                    cev.data.ptr = ns;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev);
+                }
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t r = recv(s->fd, s->in + s->inLen, sizeof(s->in) - s->inLen, 0);
+                if (r > 0) {
+                    s->inLen += (size_t)r;
+                    sessionProcessInput(s);
+                } else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    s->closing = 1;
+                    s->outLen = s->outSent = 0;
+                }
+            }
+            int pending = sessionFlush(s);
+            if (s->closing && !pending) {
+                sessionClose(loop, ep, s);
+                continue;
+            }
+            struct epoll_event mev = {0};
+            mev.events = EPOLLIN | (pending ? EPOLLOUT : 0);
+            mev.data.ptr = s;
+            epoll_ctl(ep, EPOLL_CTL_MOD, s->fd, &mev);
+        }
+    }
+    close(ep);
+    /* sessions still connected are dropped with the process */
+    sessionPoolFree(&loop->pool);
+    return NULL;
+}
+
+/* Benchmark row for the server's request path: one pooled session runs
+   login, balance, withdraw and logout through handleRequest, unconnected
+   (replies are dropped after each cycle). The journal, log and
+   checkpoints go to the BENCH_* files, with journal syncs deferred as in
+   batch mode; checkpoints run on their own thread. Returns -1 if the
+   steady state made a heap allocation. */
+static void benchSessionOp(BenchCtx *ctx, long i) {
+    Session *s = ctx->session;
+    int accNum = ctx->keys[i % ctx->keyCount];
+    char line[64];
+    static const char *const fixed[] = {"BALANCE", NULL, "LOGOUT"};
+    for (int r = 0; r < 4; ++r) {
+        char *p = line;
+        if (r == 0) {
+            p = putInt(putText(p, "LOGIN "), accNum);
+            *p++ = ' ';
+            p = putInt(p, benchPin(findAccountIndex(accNum)));
+        } else if (r == 2) {
+            p = putInt(putText(p, "WITHDRAW "), denomUnit);
+        } else {
+            p = putText(p, fixed[r - 1]);
+        }
+        *p = '\0';
+        s->outLen = 0;
+        handleRequest(s, line);
+        if (s->outLen < 2 || s->out[0] != 'O') ctx->sink++;
+    }
+}
+
+static int benchSessions(BenchCtx *ctx) {
+    if (benchMakeBook(1000) != 0) return -1;
+    benchHeader("Server session (pooled, 1000 accounts)");
+    for (int i = 0; i < BENCH_LOGIN_KEYS; ++i) {
+        ctx->keys[i] = accountAt(i * 13)->accountNumber;
+        accountSetPin(i * 13, benchPin(i * 13));
+    }
+    ctx->keyCount = BENCH_LOGIN_KEYS;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) atm.notes[k] = 1000000;
+    atmAvail.valid = 0;
+
+    txnLogPrefix = BENCH_TXN_PREFIX;
+    jnlPrefix = BENCH_JNL_PREFIX;
+    jnlSnapshotFile = BENCH_SNAPSHOT_FILE;
+    jnlAtmFile = BENCH_ATM_FILE;
+    benchRemoveLog();
+    int rc = -1;
+    SessionPool pool = {NULL, NULL, 0};
+    Session *s = NULL;
+    if (snapshotSave(BENCH_SNAPSHOT_FILE) == 0 && txnLogOpen() == 0) {
+        jnlDeferSync = 1;
+        sessionTemplatesInit();
+        if (journalOpen() == 0 && startCheckpointer() == 0 && (s = sessionAcquire(&pool))) {
+            ctx->session = s;
+            for (long i = 0; i < BENCH_SESSION_WARMUP; ++i) benchSessionOp(ctx, i);
+            /* history lists grow with the log, a doubling every so often
+               per account rather than per request: size them for the run */
+            for (int k = 0; k < ctx->keyCount; ++k) {
+                historyIndexReserve(ctx->keys[k], 4 * (BENCH_SESSION_CYCLES / ctx->keyCount + 1));
+            }
+            ctx->sink = 0;
+            benchRun("login, balance, withdraw, logout", BENCH_SESSION_CYCLES, benchSessionOp, ctx);
+            long failed = ctx->sink;
+#ifdef ATM_ALLOC_COUNT
+            unsigned long allocs = allocCount;
+            printf("  (steady state: %lu heap allocation(s), %ld failed request(s)) %s\n", allocs, failed,
+                   allocs == 0 && failed == 0 ? "PASS" : "FAIL");
+            rc = allocs == 0 && failed == 0 ? 0 : -1;
+#else
+            printf("  (%ld failed request(s); allocations are not counted on this build)\n", failed);
+            rc = failed == 0 ? 0 : -1;
+#endif
+            ctx->session = NULL;
+            sessionRelease(&pool, s);
+        }
+        stopCheckpointer();
+        journalClose();
+        txnLogClose();
+        jnlDeferSync = 0;
+    }
+    sessionPoolFree(&pool);
+    char path[MAX_LINE];
+    journalPath(path, sizeof(path), 0);
+    remove(path);
+    remove(BENCH_ATM_FILE);
+    benchRemoveLog();
+    txnLogPrefix = TXN_LOG_PREFIX;
+    jnlPrefix = JNL_PREFIX;
+    jnlSnapshotFile = ACC_SNAPSHOT_FILE;
+    jnlAtmFile = ATM_FILE;
+    ctx->keyCount = 0;
+    return rc;
+}
+
+/* Serve terminal sessions on `port` with `threads` event loops (0 = one
+   per core) until SIGINT/SIGTERM */
+int runServer(int port, int threads) {
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    ServerLoop *loops = calloc((size_t)threads, sizeof(ServerLoop));
+    if (!loops) return -1;
+
+    signal(SIGINT, onServerSignal);
+    signal(SIGTERM, onServerSignal);
+    signal(SIGPIPE, SIG_IGN);
+    sessionTemplatesInit();
+
+    int started = 0;
+    for (int i = 0; i < threads; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int one = 1;
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons((unsigned short)port);
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+            printf("Error: unable to listen on port %d.\n", port);
+            if (fd >= 0) close(fd);
+            break;
+        }
+        loops[i].port = port;
+        loops[i].listenFd = fd;
+        if (pthread_create(&loops[i].thread, NULL, serverLoopMain, &loops[i]) != 0) {
+            close(fd);
+            break;
+        }
+        started++;
+    }
+    if (started > 0) {
+        printf("Serving on port %d with %d event loop(s). Press Ctrl+C to stop.\n", port, started);
+        fflush(stdout);
+    } else {
+        serverStop = 1;
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(loops[i].thread, NULL);
+        close(loops[i].listenFd);
+    }
+    free(loops);
+    if (started > 0) printf("Server stopped.\n");
+    return started > 0 ? 0 : -1;
+}
+
+#else
+
+int runServer(int port, int threads) {
+    (void)port;
+    (void)threads;
+    printf("Server mode is only available on Linux builds.\n");
+    return -1;
+}
+
+#endif
+
+/* --------------------- Load generator ---------------------
+   --loadgen TARGET [CUSTOMERS [REQUESTS [MIX]]] soak-tests a child process
+   of this same binary. TARGET is serve (one machine), fleet
+   (LOADGEN_MACHINES machines) or batch. The run directory is written
+   in-process with the store's own savers, the child is started in it
+   through /proc/self/exe, and afterwards the directory is loaded back
+   with startSystem (replaying whatever journal the child left) to check
+   the books.
+
+   Against a server, CUSTOMERS connections (terminals) each run visits in
+   a closed loop: LOGIN, one to LOADGEN_VISIT_OPS requests drawn from MIX,
+   then LOGOUT and the next customer, on a random account. MIX weighs
+   inquiry:withdraw:history:wrong-PIN; a withdrawal is QUOTE then
+   WITHDRAW, a wrong-PIN request re-enters the card with a typo and then
+   the right PIN. Each terminal connects from its own 127.x.y.z address,
+   so the server throttles it as a separate client. REQUESTS counts mix
+   requests plus refused logins (the customer walks away). Every reply is
+   timed per request type and classed by its status text. Customers are
+   seeded by terminal, so a run is repeatable up to the interleaving.
+
+   Against batch, the same customers are written out as one command
+   stream, terminals taking turns (history has no batch command and is
+   left out), and only throughput is measured, by the batch summary.
+   Batch input is a single terminal, so once its failure budget is spent
+   the PIN checks that need a hash are throttled.
+
+   After the child stops (SIGTERM for a server) the run passes if it
+   exited cleanly and:
+   - every account's balance is its opening balance less its withdrawals
+     in the transaction log
+   - each machine's note count fell by the notes the log records for it
+     and, for a server, by the notes in its OK WITHDRAW replies
+   - no reply contradicted its request (notes not adding up to the
+     amount, a wrong PIN accepted) */
+#ifdef __linux__
+
+typedef enum {
+    LOAD_INQUIRY,
+    LOAD_WITHDRAW,
+    LOAD_HISTORY,
+    LOAD_WRONG_PIN,
+    LOAD_MIX_KINDS
+} LoadKind;
+
+/* Requests a terminal sends, timed separately */
+typedef enum {
+    LOADREQ_MACHINE,
+    LOADREQ_LOGIN,
+    LOADREQ_BALANCE,
+    LOADREQ_QUOTE,
+    LOADREQ_WITHDRAW,
+    LOADREQ_HISTORY,
+    LOADREQ_LOGOUT,
+    LOADREQ_QUIT,
+    LOADREQ_COUNT
+} LoadRequest;
+
+static const char *loadRequestNames[LOADREQ_COUNT] = {
+    "MACHINE", "LOGIN", "BALANCE", "QUOTE", "WITHDRAW", "HISTORY", "LOGOUT", "QUIT",
+};
+
+/* Reply classes: the AtmStatus whose text the reply carries, or none */
+#define LOAD_REPLY_OTHER (ATM_ERR_IO + 1)
+#define LOAD_REPLY_CLASSES (ATM_ERR_IO + 2)
+
+static const int loadAmounts[] = {100, 200, 500, 800, 1000, 1500, 2000, 2500, 3000, 5000, 10000};
+
+/* One terminal and the customer at it */
+typedef struct {
+    int fd;
+    int machine;             // fleet machine id, 0 for the standalone machine
+    unsigned long long rng;
+    int account;             // index into the synthetic book
+    int visitLeft;           // mix requests left in this visit
+    int connected, answered, machineSet, loggedIn, typo, quoted;
+    LoadRequest pending;
+    int amount;              // of the QUOTE/WITHDRAW pending
+    double sentAt;
+    char in[LOADGEN_IN_MAX];
+    size_t inLen;
+    char out[MAX_LINE];
+    size_t outLen, outSent;
+} LoadCustomer;
+
+typedef struct {
+    int fleet, batch;
+    int customers, accounts, machines;
+    long requests, issued;
+    int mix[LOAD_MIX_KINDS], mixTotal;
+    /* replies (server targets) */
+    ProbeHistogram latency[LOADREQ_COUNT];   // in nanoseconds
+    double maxLatency[LOADREQ_COUNT];
+    long replies[LOADREQ_COUNT][LOAD_REPLY_CLASSES];
+    long long (*replyNotes)[ATM_MAX_DENOMS]; // OK WITHDRAW notes by machine slot
+    long long replyCash;                     // rupees in OK WITHDRAW replies
+    long replyWithdrawals;
+    long typos;              // wrong-PIN LOGINs sent
+    long badReplies;         // replies contradicting their request
+    long dropped;            // terminals lost before QUIT
+    long skipped;            // history requests left out of a batch stream
+} LoadGen;
+
+/* Withdrawals found in the log by loadLogRecord */
+typedef struct {
+    const LoadGen *g;
+    Money *withdrawn;                   // by account
+    long long (*notes)[ATM_MAX_DENOMS]; // by machine slot
+    Money total;
+    long count;
+    long foreign;                       // not on a load test account or machine
+} LoadLogTotals;
+
+/* splitmix64 step */
+static unsigned long long loadRandom(unsigned long long *state) {
+    unsigned long long z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
 }
 
-/* Show transaction history for a particular account */
-void showTransactionHistory(int accNum) {
-    FILE *fp = fopen(TXN_FILE, "r");
-    if (!fp) {
-        printf("No transaction history found.\n");
-        return;
+static int loadAccountNumber(int account) {
+    return LOADGEN_FIRST_ACCOUNT + account;
+}
+
+static int loadPin(int account) {
+    return 1000 + (int)(((unsigned int)account * 7919u) % 9000u);
+}
+
+/* Index of machine `id` in the per-machine tallies, -1 if not in the run */
+static int loadMachineSlot(const LoadGen *g, int id) {
+    int slot = g->fleet ? id - 1 : id;
+    return slot >= 0 && slot < g->machines ? slot : -1;
+}
+
+static LoadKind loadPickKind(const LoadGen *g, LoadCustomer *c) {
+    int r = (int)(loadRandom(&c->rng) % (unsigned long long)g->mixTotal);
+    int k = 0;
+    while (r >= g->mix[k]) r -= g->mix[k++];
+    return (LoadKind)k;
+}
+
+/* The next customer walks up to the terminal */
+static void loadNextVisit(const LoadGen *g, LoadCustomer *c) {
+    c->account = (int)(loadRandom(&c->rng) % (unsigned long long)g->accounts);
+    c->visitLeft = 1 + (int)(loadRandom(&c->rng) % LOADGEN_VISIT_OPS);
+}
+
+static void loadSeedCustomers(const LoadGen *g, LoadCustomer *cs) {
+    for (int i = 0; i < g->customers; ++i) {
+        cs[i].fd = -1;
+        cs[i].rng = LOADGEN_SEED ^ ((unsigned long long)(i + 1) * 0xd1b54a32d192ed03ULL);
+        cs[i].machine = g->fleet ? 1 + i % g->machines : 0;
+        loadNextVisit(g, &cs[i]);
     }
-    char line[MAX_LINE];
-    int found = 0;
-    printLine();
-    printf("Transaction History for Account %d\n", accNum);
-    printLine();
-    while (fgets(line, sizeof(line), fp)) {
-        int a;
-        char type[32], datetime[64];
-        double amt, bal;
-        /* format: acc;type;amt;bal;datetime\n */
-        if (sscanf(line, "%d;%31[^;];%lf;%lf;%63[^\n]", &a, type, &amt, &bal, datetime) == 5) {
-            if (a == accNum) {
-                printf("[%s] %s : ₹%.2f | Balance: ₹%.2f\n", datetime, type, amt, bal);
-                found = 1;
-            }
+}
+
+/* "INQUIRY:WITHDRAW:HISTORY:WRONGPIN" weights */
+static int loadParseMix(LoadGen *g, const char *mix) {
+    const char *p = mix;
+    g->mixTotal = 0;
+    for (int k = 0; k < LOAD_MIX_KINDS; ++k) {
+        char *end;
+        long w = strtol(p, &end, 10);
+        if (end == p || w < 0 || w > 1000000 || *end != (k < LOAD_MIX_KINDS - 1 ? ':' : '\0')) {
+            g->mixTotal = 0;
+            break;
         }
+        g->mix[k] = (int)w;
+        g->mixTotal += (int)w;
+        p = end + 1;
     }
-    if (!found) {
-        printf("No transactions found for this account.\n");
+    if (g->mixTotal == 0) {
+        printf("Error: the mix must be INQUIRY:WITHDRAW:HISTORY:WRONGPIN weights, e.g. %s.\n", LOADGEN_DEFAULT_MIX);
+        return -1;
     }
-    printLine();
-    fclose(fp);
+    return 0;
 }
 
-/* Find account index by account number */
-int findAccountIndex(int accNum) {
-    for (int i = 0; i < accountCount; ++i) {
-        if (accounts[i].accountNumber == accNum) return i;
+/* Enough descriptors for every terminal (the server inherits the limit) */
+static int loadRaiseFileLimit(int customers) {
+    struct rlimit rl;
+    rlim_t need = (rlim_t)customers + 64;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) return -1;
+    if (rl.rlim_cur >= need) return 0;
+    if (rl.rlim_max < need) {
+        printf("Error: %d customers need %lu open files; the limit is %lu.\n", customers,
+               (unsigned long)need, (unsigned long)rl.rlim_max);
+        return -1;
     }
-    return -1;
+    rl.rlim_cur = need;
+    return setrlimit(RLIMIT_NOFILE, &rl);
 }
 
-/* Login routine: returns 1 if success and sets accIndex, else 0 */
-int login(int *accIndex) {
-    printLine();
-    printf("Enter Account Number: ");
-    int accNum = safeScanInt("");
-    int idx = findAccountIndex(accNum);
-    if (idx == -1) {
-        printf("Account not found.\n");
-        return 0;
+/* Write the opening state of a run into the current directory: the book
+   as accounts.txt (PINs are hashed by the child on first login), full
+   cassettes in atm.txt and, for a fleet, fleet.txt */
+static int loadPrepare(const LoadGen *g) {
+    initAccountLocks();
+    Account a;
+    char name[MAX_NAME_LEN];
+    memset(&a, 0, sizeof(a));
+    for (int i = 0; i < g->accounts; ++i) {
+        a.accountNumber = loadAccountNumber(i);
+        a.pin = loadPin(i);
+        a.balance = RUPEES(LOADGEN_BALANCE);
+        snprintf(name, sizeof(name), "Customer %d", i);
+        if (accountCreate(&a, name) == -1) {
+            printf("Memory allocation failed for %d load test accounts.\n", g->accounts);
+            releaseAccounts();
+            return -1;
+        }
     }
-    Account *acc = &accounts[idx];
-    if (acc->locked) {
-        printf("Account is locked due to multiple failed login attempts. Contact admin.\n");
-        return 0;
+    int rc = saveAccounts(ACC_FILE);
+    releaseAccounts();
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) atm.notes[k] = LOADGEN_NOTES;
+    if (rc == 0) rc = saveATM(ATM_FILE);
+    if (rc == 0 && g->fleet) {
+        if (loadFleet(FLEET_FILE, g->machines) != 0) return -1;
+        for (int i = 0; i < fleetCount; ++i) {
+            for (int k = 0; k < ATM_NUM_DENOMS; ++k) fleet[i].atm.notes[k] = LOADGEN_NOTES;
+        }
+        rc = saveFleet(FLEET_FILE);
+        free(fleet);
+        fleet = NULL;
+        fleetCount = 0;
     }
-    int attemptsLeft = 3 - acc->loginAttempts;
-    for (;;) {
-        printf("Enter PIN: ");
-        int pin = safeScanInt("");
-        if (pin == acc->pin) {
-            acc->loginAttempts = 0; // reset on success
-            *accIndex = idx;
-            printf("Login successful. Welcome, %s!\n", acc->name);
-            return 1;
-        } else {
-            acc->loginAttempts++;
-            attemptsLeft = 3 - acc->loginAttempts;
-            if (attemptsLeft > 0) {
-                printf("Incorrect PIN. Attempts remaining: %d\n", attemptsLeft);
-            } else {
-                acc->locked = 1;
-                printf("Incorrect PIN. Account locked after 3 failed attempts.\n");
-                saveAccounts(ACC_FILE); // persist locked state
-                return 0;
-            }
+    return rc;
+}
+
+/* Run this binary with argv in the current directory, its output going
+   to logFile (NULL: ours) */
+static pid_t loadSpawn(char *const argv[], const char *logFile) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = logFile ? open(logFile, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
         }
+        execv("/proc/self/exe", argv);
+        _exit(127);
     }
+    if (pid < 0) printf("Error: unable to start the %s process.\n", argv[1]);
+    return pid;
 }
 
-/* Show account balance */
-void showBalance(const Account *acc) {
-    printLine();
-    printf("Account: %d | Name: %s\n", acc->accountNumber, acc->name);
-    printf("Available Balance: ₹ %.2f\n", acc->balance);
-    printLine();
-    /* record inquiry as transaction */
-    Transaction t;
-    t.accountNumber = acc->accountNumber;
-    strcpy(t.type, "Balance Inquiry");
-    t.amount = 0.0;
-    t.remainingBalance = acc->balance;
-    time_t now = time(NULL);
-    strftime(t.datetime, sizeof(t.datetime), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    recordTransaction(&t);
+/* Wait for the child to exit, after sending it sig (0 = none); returns
+   its exit status, 128 + the signal if one killed it */
+static int loadStop(pid_t child, int sig) {
+    int status = 0;
+    if (sig) kill(child, sig);
+    while (waitpid(child, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 }
 
-/* Calculate denominations greedily but respect ATM availability */
-void calculateDenominations(int amount, ATM *atm, int *n2000, int *n500, int *n200, int *n100, int *possible) {
-    int remaining = amount;
-    *n2000 = *n500 = *n200 = *n100 = 0;
-    /* start with 2000 */
-    int use = remaining / 2000;
-    if (use > atm->note2000) use = atm->note2000;
-    *n2000 = use;
-    remaining -= use * 2000;
-
-    /* 500 */
-    use = remaining / 500;
-    if (use > atm->note500) use = atm->note500;
-    *n500 = use;
-    remaining -= use * 500;
-
-    /* 200 */
-    use = remaining / 200;
-    if (use > atm->note200) use = atm->note200;
-    *n200 = use;
-    remaining -= use * 200;
-
-    /* 100 */
-    use = remaining / 100;
-    if (use > atm->note100) use = atm->note100;
-    *n100 = use;
-    remaining -= use * 100;
-
-    if (remaining == 0) {
-        *possible = 1;
-        return;
+/* A loopback port nothing listens on, for the child server */
+static int loadFreePort(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int port = -1;
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&addr, &len) == 0) {
+        port = ntohs(addr.sin_port);
     }
+    if (fd >= 0) close(fd);
+    return port;
+}
 
-    /* If greedy failed (because of insufficient medium notes), attempt limited backtracking:
-       Try reducing some higher denomination usage to make change using smaller notes.
-       This is a simple heuristic, not exhaustive search, but sufficient for typical note sets.
-    */
-    int backup2000 = *n2000, backup500 = *n500, backup200 = *n200, backup100 = *n100;
-
-    /* Try reduce 2000 by 1 repeatedly and recalc remainder */
-    for (int r2000 = backup2000; r2000 >= 0 && !(*possible); --r2000) {
-        for (int r500 = backup500; r500 >= 0 && !(*possible); --r500) {
-            for (int r200 = backup200; r200 >= 0 && !(*possible); --r200) {
-                int rem = amount - (r2000*2000 + r500*500 + r200*200);
-                if (rem < 0) continue;
-                int need100 = rem / 100;
-                if (rem % 100 != 0) continue;
-                if (need100 <= atm->note100) {
-                    /* solution found */
-                    *n2000 = r2000;
-                    *n500  = r500;
-                    *n200  = r200;
-                    *n100  = need100;
-                    *possible = 1;
-                    return;
-                }
-            }
+/* Poll until the child accepts connections on port; returns -1 (and
+   *status, the child having been reaped) if it exits first */
+static int loadAwaitServer(pid_t child, int port, int *status) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short)port);
+    struct timespec pause = {0, 20 * 1000 * 1000};
+    double deadline = monotonicSeconds() + LOADGEN_START_SECONDS;
+    while (monotonicSeconds() < deadline) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int up = fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (fd >= 0) close(fd);
+        if (up) return 0;
+        if (waitpid(child, status, WNOHANG) == child) {
+            *status = WIFEXITED(*status) ? WEXITSTATUS(*status) : 128 + WTERMSIG(*status);
+            printf("Error: the server exited before listening (see server.log).\n");
+            return -1;
         }
+        nanosleep(&pause, NULL);
     }
-
-    /* if still not possible */
-    *n2000 = backup2000;
-    *n500  = backup500;
-    *n200  = backup200;
-    *n100  = backup100;
-    *possible = 0;
+    printf("Error: the server is not listening on port %d after %d s.\n", port, LOADGEN_START_SECONDS);
+    return -1;
 }
 
-/* Withdraw cash */
-void withdrawCash(Account *acc, ATM *atm) {
-    printf("Enter amount to withdraw (multiples of 100): ");
-    double damount = safeScanDouble("");
-    if (damount <= 0.0) {
-        printf("Invalid amount. Must be > 0.\n");
-        return;
+/* Connect terminal `slot` from 127.1.0.1 + slot, without waiting */
+static int loadConnect(LoadCustomer *c, int slot, int port, int ep) {
+    struct sockaddr_in src = {0}, dst = {0};
+    src.sin_family = dst.sin_family = AF_INET;
+    src.sin_addr.s_addr = htonl(0x7f010001u + (unsigned int)slot);
+    dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    dst.sin_port = htons((unsigned short)port);
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) return -1;
+    if (bind(c->fd, (struct sockaddr *)&src, sizeof(src)) != 0 ||
+        (connect(c->fd, (struct sockaddr *)&dst, sizeof(dst)) != 0 && errno != EINPROGRESS)) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
     }
-    if (((int)damount) % 100 != 0) {
-        printf("Amount must be a multiple of 100.\n");
-        return;
+    struct epoll_event ev = {0};
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+/* Choose the terminal's next request and format it into c->out */
+static void loadNextRequest(LoadGen *g, LoadCustomer *c) {
+    int accNum = loadAccountNumber(c->account), pin = loadPin(c->account);
+    int n;
+    if (g->fleet && !c->machineSet) {
+        c->pending = LOADREQ_MACHINE;
+        n = snprintf(c->out, sizeof(c->out), "MACHINE %d\n", c->machine);
+    } else if (!c->loggedIn && g->issued >= g->requests) {
+        c->pending = LOADREQ_QUIT;
+        n = snprintf(c->out, sizeof(c->out), "QUIT\n");
+    } else if (!c->loggedIn) {
+        c->pending = LOADREQ_LOGIN;
+        n = snprintf(c->out, sizeof(c->out), "LOGIN %d %d\n", accNum, pin);
+    } else if (c->quoted) {
+        c->quoted = 0;
+        c->pending = LOADREQ_WITHDRAW;
+        n = snprintf(c->out, sizeof(c->out), "WITHDRAW %d\n", c->amount);
+    } else if (c->visitLeft == 0 || g->issued >= g->requests) {
+        c->pending = LOADREQ_LOGOUT;
+        c->loggedIn = 0;
+        loadNextVisit(g, c);
+        n = snprintf(c->out, sizeof(c->out), "LOGOUT\n");
+    } else {
+        g->issued++;
+        c->visitLeft--;
+        switch (loadPickKind(g, c)) {
+        case LOAD_INQUIRY:
+            c->pending = LOADREQ_BALANCE;
+            n = snprintf(c->out, sizeof(c->out), "BALANCE\n");
+            break;
+        case LOAD_WITHDRAW:
+            c->pending = LOADREQ_QUOTE;
+            c->amount = loadAmounts[loadRandom(&c->rng) % (sizeof(loadAmounts) / sizeof(loadAmounts[0]))];
+            n = snprintf(c->out, sizeof(c->out), "QUOTE %d\n", c->amount);
+            break;
+        case LOAD_HISTORY:
+            c->pending = LOADREQ_HISTORY;
+            n = snprintf(c->out, sizeof(c->out), "HISTORY %d\n", LOADGEN_HISTORY_ROWS);
+            break;
+        default:
+            /* a LOGIN ends the session; the right PIN follows */
+            c->pending = LOADREQ_LOGIN;
+            c->typo = 1;
+            c->loggedIn = 0;
+            g->typos++;
+            n = snprintf(c->out, sizeof(c->out), "LOGIN %d %d\n", accNum, pin + 1);
+            break;
+        }
     }
-    int amount = (int)damount;
-    if (amount > (int)(acc->balance + 0.0001)) {
-        printf("Insufficient balance.\n");
-        return;
+    c->outLen = (size_t)n;
+    c->outSent = 0;
+    c->sentAt = monotonicSeconds();
+}
+
+/* Class of a reply line (see LOAD_REPLY_CLASSES) */
+static int loadReplyClass(const char *line) {
+    if (strncmp(line, "OK", 2) == 0 && (line[2] == ' ' || line[2] == '\0')) return ATM_OK;
+    if (strncmp(line, "ERR ", 4) != 0) return LOAD_REPLY_OTHER;
+    const char *text = line + 4;
+    for (int st = ATM_ERR_NO_ACCOUNT; st <= ATM_ERR_IO; ++st) {
+        if (strcmp(text, atmStatusText((AtmStatus)st)) == 0) return st;
     }
-    /* compute ATM's total cash */
-    long atmTotal = (long)atm->note2000*2000 + (long)atm->note500*500 + (long)atm->note200*200 + (long)atm->note100*100;
-    if (amount > atmTotal) {
-        printf("ATM does not have enough cash.\n");
-        return;
+    if (strncmp(text, "Incorrect PIN. Attempts remaining:", 34) == 0) return ATM_ERR_BAD_PIN;
+    return LOAD_REPLY_OTHER;
+}
+
+/* Tally the notes of an OK WITHDRAW reply ("OK <balance> <notes...>"),
+   which must add up to the amount asked for */
+static void loadCountDispense(LoadGen *g, const LoadCustomer *c, const char *line) {
+    Money balance;
+    const char *p = parseMoney(line + 2, &balance);
+    int notes[ATM_MAX_DENOMS] = {0};
+    for (int k = 0; p && k < ATM_NUM_DENOMS; ++k) {
+        char *end;
+        notes[k] = (int)strtol(p, &end, 10);
+        p = end == p ? NULL : end;
     }
-    int n2000, n500, n200, n100, possible;
-    calculateDenominations(amount, atm, &n2000, &n500, &n200, &n100, &possible);
-    if (!possible) {
-        printf("ATM cannot dispense the requested amount with available denominations.\n");
+    int slot = loadMachineSlot(g, c->machine);
+    if (!p || slot < 0) {
+        g->badReplies++;
         return;
     }
-    /* Show breakdown and ask for confirmation */
-    printLine();
-    printf("Dispensing:\n");
-    if (n2000) printf("₹2000 x %d\n", n2000);
-    if (n500)  printf("₹500  x %d\n", n500);
-    if (n200)  printf("₹200  x %d\n", n200);
-    if (n100)  printf("₹100  x %d\n", n100);
-    printLine();
-    printf("Confirm withdrawal? (1=Yes, 0=No): ");
-    int confirm = safeScanInt("");
-    if (!confirm) {
-        printf("Withdrawal cancelled.\n");
-        return;
+    long long value = 0;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+        g->replyNotes[slot][k] += notes[k];
+        value += (long long)notes[k] * denomValue[k];
     }
-    /* Deduct from account and ATM */
-    acc->balance -= amount;
-    atm->note2000 -= n2000;
-    atm->note500  -= n500;
-    atm->note200  -= n200;
-    atm->note100  -= n100;
+    if (value != c->amount) g->badReplies++;
+    g->replyCash += value;
+    g->replyWithdrawals++;
+}
 
-    /* Record transaction */
-    Transaction t;
-    t.accountNumber = acc->accountNumber;
-    strcpy(t.type, "Withdrawal");
-    t.amount = (double)amount;
-    t.remainingBalance = acc->balance;
-    time_t now = time(NULL);
-    strftime(t.datetime, sizeof(t.datetime), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    recordTransaction(&t);
+/* Take one reply line; returns 1 once it completes the pending request */
+static int loadReply(LoadGen *g, LoadCustomer *c, const char *line) {
+    if (c->pending == LOADREQ_HISTORY && strncmp(line, "TXN ", 4) == 0) return 0;
+    double seconds = monotonicSeconds() - c->sentAt;
+    unsigned long long ns = (unsigned long long)(seconds * 1e9);
+    ProbeHistogram *h = &g->latency[c->pending];
+    h->count++;
+    h->ticks += ns;
+    h->buckets[probeBucket(ns)]++;
+    if (seconds > g->maxLatency[c->pending]) g->maxLatency[c->pending] = seconds;
+    int cls = loadReplyClass(line);
+    g->replies[c->pending][cls]++;
 
-    /* persist changes */
-    saveAccounts(ACC_FILE);
-    saveATM(ATM_FILE);
+    if (c->pending == LOADREQ_MACHINE) {
+        c->machineSet = 1;
+    } else if (c->pending == LOADREQ_LOGIN) {
+        if (c->typo) {
+            c->typo = 0;
+            if (cls == ATM_OK) {
+                g->badReplies++; // a wrong PIN let the customer in
+                c->loggedIn = 1;
+            }
+        } else if (cls == ATM_OK) {
+            c->loggedIn = 1;
+        } else {
+            g->issued++;
+            loadNextVisit(g, c);
+        }
+    } else if (c->pending == LOADREQ_QUOTE) {
+        c->quoted = cls == ATM_OK;
+    } else if (c->pending == LOADREQ_WITHDRAW && cls == ATM_OK) {
+        loadCountDispense(g, c, line);
+    }
+    return 1;
+}
 
-    printf("Transaction successful. New balance: ₹ %.2f\n", acc->balance);
+/* Handle the input buffered for a terminal and queue its next request;
+   returns 1 when the terminal is done (QUIT answered), -1 on a broken
+   stream */
+static int loadReadReplies(LoadGen *g, LoadCustomer *c) {
+    size_t start = 0;
+    int complete = 0;
+    for (size_t i = 0; i < c->inLen && !complete; ++i) {
+        if (c->in[i] != '\n') continue;
+        c->in[i] = '\0';
+        complete = loadReply(g, c, c->in + start);
+        start = i + 1;
+    }
+    memmove(c->in, c->in + start, c->inLen - start);
+    c->inLen -= start;
+    if (!complete) return c->inLen == sizeof(c->in) ? -1 : 0;
+    if (c->inLen > 0) return -1; // one request is in flight, so nothing may follow its reply
+    if (c->pending == LOADREQ_QUIT) return 1;
+    loadNextRequest(g, c);
+    return 0;
 }
 
-/* Simple admin menu to view/refill ATM and unlock accounts */
-void adminMenu() {
-    printf("Enter admin PIN: ");
-    int pin = safeScanInt("");
-    if (pin != ADMIN_PIN) {
-        printf("Invalid admin PIN.\n");
-        return;
+/* Send what the socket takes; returns 1 if some is still pending */
+static int loadSend(LoadCustomer *c) {
+    while (c->outSent < c->outLen) {
+        ssize_t n = send(c->fd, c->out + c->outSent, c->outLen - c->outSent, MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        c->outSent += (size_t)n;
     }
-    int choice;
-    do {
-        printLine();
-        printf("Admin Menu:\n1. View ATM inventory\n2. Refill ATM notes\n3. View all accounts\n4. Unlock account\n5. Exit admin\nEnter choice: ");
-        choice = safeScanInt("");
-        if (choice == 1) {
-            printLine();
-            printf("ATM Inventory:\n₹2000 x %d\n₹500  x %d\n₹200  x %d\n₹100  x %d\n",
-                   atm.note2000, atm.note500, atm.note200, atm.note100);
-            printLine();
-        } else if (choice == 2) {
-            printf("Enter additional ₹2000 notes to add: ");
-            int a = safeScanInt("");
-            printf("Enter additional ₹500 notes to add: ");
-            int b = safeScanInt("");
-            printf("Enter additional ₹200 notes to add: ");
-            int c = safeScanInt("");
-            printf("Enter additional ₹100 notes to add: ");
-            int d = safeScanInt("");
-            if (a < 0 || b < 0 || c < 0 || d < 0) {
-                printf("Invalid (negative) input. Operation cancelled.\n");
-            } else {
-                atm.note2000 += a;
-                atm.note500  += b;
-                atm.note200  += c;
-                atm.note100  += d;
-                saveATM(ATM_FILE);
-                printf("ATM refilled successfully.\n");
+    return 0;
+}
+
+static void loadClose(LoadGen *g, LoadCustomer *c, int ep, int lost) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    if (lost) g->dropped++;
+}
+
+/* Run every terminal against the server on port until each has quit.
+   Terminals join LOADGEN_CONNECT_BURST at a time: the next connects once
+   one of those has had its first reply. */
+static int loadDrive(LoadGen *g, LoadCustomer *cs, int port) {
+    int ep = epoll_create1(0);
+    if (ep < 0) return -1;
+    int active = 0, joining = 0, next = 0;
+    loadSeedCustomers(g, cs);
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    double lastReply = monotonicSeconds();
+    while (active > 0 || next < g->customers) {
+        for (; next < g->customers && joining < LOADGEN_CONNECT_BURST; ++next) {
+            if (loadConnect(&cs[next], next, port, ep) != 0) {
+                g->dropped++;
+                continue;
             }
-        } else if (choice == 3) {
-            printLine();
-            printf("Accounts List:\n");
-            for (int i = 0; i < accountCount; ++i) {
-                printf("Acc: %d | Name: %s | Bal: ₹%.2f | Locked: %s\n",
-                       accounts[i].accountNumber, accounts[i].name, accounts[i].balance,
-                       accounts[i].locked ? "Yes" : "No");
+            active++;
+            joining++;
+        }
+        int n = epoll_wait(ep, events, SERVER_MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) break;
+        if (n <= 0) {
+            if (monotonicSeconds() - lastReply < LOADGEN_STALL_SECONDS) continue;
+            printf("Error: no reply for %d s; giving up on %d terminal(s).\n", LOADGEN_STALL_SECONDS,
+                   active + g->customers - next);
+            g->dropped += g->customers - next;
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            LoadCustomer *c = events[i].data.ptr;
+            int state = 0;
+            if (!c->connected) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) state = -1;
+                else if ((events[i].events & EPOLLOUT) == 0) continue;
+                else {
+                    c->connected = 1;
+                    loadNextRequest(g, c);
+                }
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t r = recv(c->fd, c->in + c->inLen, sizeof(c->in) - c->inLen, 0);
+                if (r > 0) {
+                    c->inLen += (size_t)r;
+                    lastReply = monotonicSeconds();
+                    if (!c->answered) joining--;
+                    c->answered = 1;
+                    state = loadReadReplies(g, c);
+                } else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    state = -1;
+                }
             }
-            printLine();
-        } else if (choice == 4) {
-            printf("Enter account number to unlock: ");
-            int accn = safeScanInt("");
-            int idx = findAccountIndex(accn);
-            if (idx == -1) {
-                printf("Account not found.\n");
-            } else {
-                accounts[idx].locked = 0;
-                accounts[idx].loginAttempts = 0;
-                saveAccounts(ACC_FILE);
-                printf("Account %d unlocked.\n", accn);
+            int pending = state == 0 ? loadSend(c) : 0;
+            if (pending < 0) state = -1;
+            if (state != 0) {
+                if (!c->answered) joining--;
+                c->answered = 1;
+                loadClose(g, c, ep, state < 0);
+                active--;
+                continue;
             }
-        } else if (choice == 5) {
-            printf("Exiting admin menu.\n");
-        } else {
-            printf("Invalid choice.\n");
+            struct epoll_event mev = {0};
+            mev.events = EPOLLIN | (pending ? EPOLLOUT : 0);
+            mev.data.ptr = c;
+            epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &mev);
         }
-    } while (choice != 5);
+    }
+    for (int i = 0; i < g->customers; ++i) {
+        if (cs[i].fd >= 0) loadClose(g, &cs[i], ep, 1);
+    }
+    close(ep);
+    return 0;
 }
 
-/* Main program */
-int main(void) {
-    /* load data from files */
-    if (loadAccounts(ACC_FILE) != 0) {
-        printf("Error loading accounts.\n");
-        return 1;
+/* Write the customers' requests as a --batch stream, terminals taking
+   turns one mix request at a time */
+static int loadWriteBatch(LoadGen *g, LoadCustomer *cs, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        printf("Error: unable to write %s.\n", path);
+        return -1;
     }
-    loadATM(ATM_FILE);
+    loadSeedCustomers(g, cs);
+    for (long n = 0; n < g->requests; ++n) {
+        LoadCustomer *c = &cs[n % g->customers];
+        int accNum = loadAccountNumber(c->account), pin = loadPin(c->account);
+        if (!c->loggedIn) {
+            fprintf(fp, "L %d %d\n", accNum, pin);
+            c->loggedIn = 1;
+        }
+        switch (loadPickKind(g, c)) {
+        case LOAD_INQUIRY:
+            fprintf(fp, "B %d\n", accNum);
+            break;
+        case LOAD_WITHDRAW:
+            fprintf(fp, "W %d %d\n", accNum,
+                    loadAmounts[loadRandom(&c->rng) % (sizeof(loadAmounts) / sizeof(loadAmounts[0]))]);
+            break;
+        case LOAD_HISTORY:
+            g->skipped++;
+            break;
+        default:
+            fprintf(fp, "L %d %d\nL %d %d\n", accNum, pin + 1, accNum, pin);
+            g->typos++;
+            break;
+        }
+        if (--c->visitLeft == 0) {
+            c->loggedIn = 0;
+            loadNextVisit(g, c);
+        }
+    }
+    if (fclose(fp) != 0) {
+        printf("Error: unable to write %s.\n", path);
+        return -1;
+    }
+    return 0;
+}
 
-    /* if no accounts exist, create a sample set (so user can test) */
-    if (accountCount == 0) {
-        printf("No accounts found. Creating sample accounts for testing.\n");
-        accountCount = 3;
-        accounts = realloc(accounts, sizeof(Account) * accountCount);
-        accounts[0].accountNumber = 1001; accounts[0].pin = 1234; accounts[0].balance = 15000.0; strcpy(accounts[0].name, "Zaid"); accounts[0].loginAttempts = 0; accounts[0].locked=0;
-        accounts[1].accountNumber = 1002; accounts[1].pin = 2345; accounts[1].balance = 5000.0;  strcpy(accounts[1].name, "Anita"); accounts[1].loginAttempts = 0; accounts[1].locked=0;
-        accounts[2].accountNumber = 1003; accounts[2].pin = 3456; accounts[2].balance = 20000.0; strcpy(accounts[2].name, "Ravi");  accounts[2].loginAttempts = 0; accounts[2].locked=0;
-        saveAccounts(ACC_FILE);
-        saveATM(ATM_FILE);
+/* Latency by request type and replies other than OK */
+static void loadReport(const LoadGen *g, double elapsed) {
+    long total = 0;
+    for (int t = 0; t < LOADREQ_COUNT; ++t) total += (long)g->latency[t].count;
+    printLine();
+    printf("%ld replies in %.2f s (%.0f/s)\n", total, elapsed, elapsed > 0 ? total / elapsed : 0.0);
+    printf("%-9s %9s %8s %9s %9s %9s %9s %9s\n", "request", "count", "errors", "p50 us", "p90 us", "p99 us",
+           "p99.9 us", "max us");
+    for (int t = 0; t < LOADREQ_COUNT; ++t) {
+        const ProbeHistogram *h = &g->latency[t];
+        if (h->count == 0) continue;
+        long errors = (long)h->count - g->replies[t][ATM_OK];
+        double max = g->maxLatency[t] * 1e9, q[4] = {0.50, 0.90, 0.99, 0.999};
+        for (int i = 0; i < 4; ++i) {
+            q[i] = probeQuantile(h, q[i]);
+            if (q[i] > max) q[i] = max; // bucket midpoints can overshoot the slowest sample
+        }
+        printf("%-9s %9lu %7.2f%% %9.1f %9.1f %9.1f %9.1f %9.1f\n", loadRequestNames[t], h->count,
+               100.0 * (double)errors / (double)h->count, q[0] / 1e3, q[1] / 1e3, q[2] / 1e3, q[3] / 1e3,
+               max / 1e3);
+    }
+    printf("Replies other than OK (%ld wrong-PIN LOGINs were sent on purpose):\n", g->typos);
+    for (int t = 0; t < LOADREQ_COUNT; ++t) {
+        for (int cls = ATM_ERR_NO_ACCOUNT; cls < LOAD_REPLY_CLASSES; ++cls) {
+            long n = g->replies[t][cls];
+            if (n == 0) continue;
+            printf("  %-9s %9ld %7.2f%%  %s\n", loadRequestNames[t], n,
+                   100.0 * (double)n / (double)g->latency[t].count,
+                   cls == LOAD_REPLY_OTHER ? "(not a core outcome)" : atmStatusText((AtmStatus)cls));
+        }
     }
+    if (g->dropped) printf("Terminals lost before QUIT: %ld\n", g->dropped);
+}
 
-    printf("Welcome to the ATM Withdrawal System (Console)\n");
-    int mainChoice;
-    do {
-        printLine();
-        printf("Main Menu:\n1. User Login\n2. Admin Menu\n3. Exit\nEnter choice: ");
-        mainChoice = safeScanInt("");
-        if (mainChoice == 1) {
-            int accIndex;
-            if (login(&accIndex)) {
-                Account *acc = &accounts[accIndex];
-                int userChoice;
-                do {
-                    printLine();
-                    printf("1. Balance Inquiry\n2. Cash Withdrawal\n3. Transaction History\n4. Logout\nEnter choice: ");
-                    userChoice = safeScanInt("");
-                    if (userChoice == 1) {
-                        showBalance(acc);
-                    } else if (userChoice == 2) {
-                        withdrawCash(acc, &atm);
-                    } else if (userChoice == 3) {
-                        showTransactionHistory(acc->accountNumber);
-                    } else if (userChoice == 4) {
-                        printf("Logging out...\n");
-                        saveAccounts(ACC_FILE); // persist any changes
-                    } else {
-                        printf("Invalid choice.\n");
-                    }
-                } while (userChoice != 4);
+static int loadLogRecord(const Transaction *t, TxnPos pos, void *ctx) {
+    LoadLogTotals *lt = ctx;
+    (void)pos;
+    if (t->type != TXN_WITHDRAWAL) return 0;
+    int account = t->accountNumber - LOADGEN_FIRST_ACCOUNT;
+    int slot = loadMachineSlot(lt->g, t->machine);
+    if (account < 0 || account >= lt->g->accounts || slot < 0) {
+        lt->foreign++;
+        return 0;
+    }
+    lt->withdrawn[account] += t->amount;
+    lt->total += t->amount;
+    lt->count++;
+    for (int k = 0; k < ATM_NUM_DENOMS; ++k) lt->notes[slot][k] += t->notes[k];
+    return 0;
+}
+
+/* Load the run directory back and check it against the log and the
+   replies; returns the number of failed checks */
+static int loadVerify(LoadGen *g) {
+    LoadLogTotals lt;
+    memset(&lt, 0, sizeof(lt));
+    lt.g = g;
+    lt.withdrawn = calloc((size_t)g->accounts, sizeof(Money));
+    lt.notes = calloc((size_t)g->machines, sizeof(*lt.notes));
+    if (!lt.withdrawn || !lt.notes || startSystem() != 0) {
+        printf("Error: unable to load the run back for checking.\n");
+        free(lt.withdrawn);
+        free(lt.notes);
+        return 1;
+    }
+    txnLogScan(0, loadLogRecord, &lt);
+
+    int failed = 0, wrongBalances = 0, wrongCassettes = 0;
+    char a[MONEY_BUF], b[MONEY_BUF];
+    printLine();
+    for (int i = 0; i < g->accounts; ++i) {
+        int idx = findAccountIndex(loadAccountNumber(i));
+        Money expected = RUPEES(LOADGEN_BALANCE) - lt.withdrawn[i];
+        if (idx != -1 && accountAt(idx)->balance == expected) continue;
+        if (wrongBalances++ < 5) {
+            printf("  account %d: balance ₹%s, opening less logged withdrawals ₹%s\n", loadAccountNumber(i),
+                   idx == -1 ? "(missing)" : formatMoney(accountAt(idx)->balance, a), formatMoney(expected, b));
+        }
+    }
+    long long cashOut = 0;
+    for (int m = 0; m < g->machines; ++m) {
+        const ATM *inv = machineInventory(g->fleet ? m + 1 : 0);
+        for (int k = 0; k < ATM_NUM_DENOMS; ++k) {
+            long long taken = inv ? LOADGEN_NOTES - inv->notes[k] : 0;
+            cashOut += taken * denomValue[k];
+            if (inv && taken == lt.notes[m][k] && (g->batch || taken == g->replyNotes[m][k])) continue;
+            if (wrongCassettes++ < 5) {
+                printf("  machine %d, ₹%d notes: %lld taken, %lld logged", g->fleet ? m + 1 : 0, denomValue[k],
+                       taken, lt.notes[m][k]);
+                if (!g->batch) printf(", %lld in replies", g->replyNotes[m][k]);
+                printf("\n");
             }
-        } else if (mainChoice == 2) {
-            adminMenu();
-        } else if (mainChoice == 3) {
-            printf("Exiting system. Goodbye!\n");
-            saveAccounts(ACC_FILE);
-            saveATM(ATM_FILE);
+        }
+    }
+    printf("Withdrawals logged:      %ld, ₹%s\n", lt.count, formatMoney(lt.total, a));
+    if (!g->batch) printf("OK WITHDRAW replies:     %ld, ₹%lld\n", g->replyWithdrawals, g->replyCash);
+    printf("Cash out of cassettes:   ₹%lld\n", cashOut);
+    printf("Balances matching log:   %d of %d\n", g->accounts - wrongBalances, g->accounts);
+    printf("Cassettes matching:      %d of %d\n", g->machines * ATM_NUM_DENOMS - wrongCassettes,
+           g->machines * ATM_NUM_DENOMS);
+    if (wrongBalances) failed++;
+    if (wrongCassettes) failed++;
+    if (lt.total != RUPEES(cashOut) || (!g->batch && g->replyCash != cashOut)) {
+        printf("Error: cash dispensed does not agree between the log, the replies and the cassettes.\n");
+        failed++;
+    }
+    if (lt.foreign) {
+        printf("Error: %ld logged withdrawal(s) name an account or machine outside the run.\n", lt.foreign);
+        failed++;
+    }
+    if (g->badReplies) {
+        printf("Error: %ld repl%s contradicted the request.\n", g->badReplies, g->badReplies == 1 ? "y" : "ies");
+        failed++;
+    }
+    shutdownSystem();
+    free(lt.withdrawn);
+    free(lt.notes);
+    return failed;
+}
+
+/* Remove a passed run's directory (flat: the store writes no
+   subdirectories). Returns 0 once it is gone. */
+static int loadRemoveRunDir(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    struct dirent *e;
+    int rc = 0;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        if (unlinkat(dirfd(d), e->d_name, 0) != 0) rc = -1;
+    }
+    closedir(d);
+    return rc == 0 && rmdir(dir) == 0 ? 0 : -1;
+}
+
+/* Soak run of a child server or batch replay; see the section comment */
+int runLoadGenerator(const char *target, int customers, long requests, const char *mix) {
+    LoadGen g;
+    memset(&g, 0, sizeof(g));
+    g.fleet = strcmp(target, "fleet") == 0;
+    g.batch = strcmp(target, "batch") == 0;
+    if (!g.fleet && !g.batch && strcmp(target, "serve") != 0) {
+        printf("Error: the load target must be serve, fleet or batch.\n");
+        return -1;
+    }
+    g.customers = customers > 0 ? customers : LOADGEN_DEFAULT_CUSTOMERS;
+    g.requests = requests > 0 ? requests : LOADGEN_DEFAULT_REQUESTS;
+    if (g.customers > ACCOUNT_CHUNK * ACCOUNT_MAX_CHUNKS / LOADGEN_ACCOUNTS_PER_CUSTOMER ||
+        (!g.batch && g.customers > 0xfe0000)) {
+        printf("Error: too many customers.\n");
+        return -1;
+    }
+    g.accounts = g.customers * LOADGEN_ACCOUNTS_PER_CUSTOMER;
+    g.machines = g.fleet ? LOADGEN_MACHINES : 1;
+    if (!mix) mix = LOADGEN_DEFAULT_MIX;
+    if (loadParseMix(&g, mix) != 0 || (!g.batch && loadRaiseFileLimit(g.customers) != 0)) return -1;
+
+    char dir[] = LOADGEN_DIR_TEMPLATE;
+    if (!mkdtemp(dir) || chdir(dir) != 0) {
+        printf("Error: unable to create a run directory.\n");
+        return -1;
+    }
+    printf("Load run in %s: %s, %d customers, %ld requests, mix %s (inquiry:withdraw:history:wrong-PIN)\n", dir,
+           target, g.customers, g.requests, mix);
+    LoadCustomer *cs = calloc((size_t)g.customers, sizeof(LoadCustomer));
+    g.replyNotes = calloc((size_t)g.machines, sizeof(*g.replyNotes));
+    int prepared = cs && g.replyNotes && loadPrepare(&g) == 0;
+    int rc = prepared ? 0 : -1, status = -1;
+    if (prepared && g.batch) {
+        char *argv[] = {"atm_system", "--batch", "commands.txt", NULL};
+        pid_t child = loadWriteBatch(&g, cs, "commands.txt") == 0 ? loadSpawn(argv, NULL) : -1;
+        if (child > 0) status = loadStop(child, 0);
+        if (g.skipped) printf("(%ld history requests left out: batch streams have no history command)\n", g.skipped);
+    } else if (prepared) {
+        char portText[16], machinesText[16];
+        int port = loadFreePort();
+        snprintf(portText, sizeof(portText), "%d", port);
+        snprintf(machinesText, sizeof(machinesText), "%d", g.machines);
+        char *serveArgv[] = {"atm_system", "--serve", portText, NULL};
+        char *fleetArgv[] = {"atm_system", "--fleet", portText, machinesText, NULL};
+        pid_t child = port > 0 ? loadSpawn(g.fleet ? fleetArgv : serveArgv, "server.log") : -1;
+        if (child > 0 && loadAwaitServer(child, port, &status) == 0) {
+            double start = monotonicSeconds();
+            rc = loadDrive(&g, cs, port);
+            double elapsed = monotonicSeconds() - start;
+            status = loadStop(child, SIGTERM);
+            loadReport(&g, elapsed);
         } else {
-            printf("Invalid choice.\n");
+            if (child > 0 && status == -1) status = loadStop(child, SIGKILL);
+            rc = -1;
         }
-    } while (mainChoice != 3);
+    }
+    if (prepared && status != 0) printf("Error: the %s process exited with status %d.\n", target, status);
+    int failed = prepared ? loadVerify(&g) : 1;
+    printLine();
+    int passed = rc == 0 && status == 0 && failed == 0 && g.dropped == 0;
+    if (passed) {
+        printf("Load run passed: the books balance.\n");
+    } else {
+        printf("Load run FAILED (files kept in %s).\n", dir);
+        rc = -1;
+    }
+    if (chdir("..") != 0) rc = -1;
+    else if (passed && loadRemoveRunDir(dir) != 0) printf("Warning: unable to remove %s.\n", dir);
+    free(cs);
+    free(g.replyNotes);
+    return rc;
+}
 
-    /* cleanup */
-    if (accounts) free(accounts);
-    return 0;
+#else
+
+int runLoadGenerator(const char *target, int customers, long requests, const char *mix) {
+    (void)target;
+    (void)customers;
+    (void)requests;
+    (void)mix;
+    printf("The load generator is only available on Linux builds.\n");
+    return -1;
+}
+
+#endif
+
+/* Main program */
+int main(int argc, char **argv) {
+    const char *mode = argc > 1 ? argv[1] : NULL;
+    int serve = mode && argc >= 3 && strcmp(mode, "--serve") == 0;
+    int batch = mode && argc >= 3 && strcmp(mode, "--batch") == 0;
+    int bench = mode && strcmp(mode, "--bench") == 0;
+    int dump = mode && strcmp(mode, "--dump-log") == 0;
+    int fleetMode = mode && argc >= 3 && strcmp(mode, "--fleet") == 0;
+    int refill = mode && strcmp(mode, "--refill-plan") == 0;
+    int loadgen = mode && argc >= 3 && strcmp(mode, "--loadgen") == 0;
+    if (mode && !serve && !batch && !bench && !dump && !fleetMode && !refill && !loadgen) {
+        printf("Usage: %s [--serve PORT [THREADS] | --fleet PORT [MACHINES [THREADS]] | --batch FILE|- |"
+               " --bench [ACCOUNTS] | --dump-log | --refill-plan [HOURS] |"
+               " --loadgen serve|fleet|batch [CUSTOMERS [REQUESTS [MIX]]]]\n", argv[0]);
+        return 1;
+    }
+    if (checkDenominations() != 0) return 1;
+    if (dump) return dumpTransactionLog(stdout) == 0 ? 0 : 1;
+    if (loadgen) {
+        return runLoadGenerator(argv[2], argc >= 4 ? atoi(argv[3]) : 0, argc >= 5 ? atol(argv[4]) : 0,
+                                argc >= 6 ? argv[5] : NULL) == 0 ? 0 : 1;
+    }
+    if (bench) return runBenchmarks(argc >= 3 ? atoi(argv[2]) : BENCH_DEFAULT_ACCOUNTS) == 0 ? 0 : 1;
+    if (fleetMode) {
+        jnlShardCount = FLEET_JOURNAL_SHARDS;
+        jnlCheckpointInterval = JNL_CHECKPOINT_INTERVAL * FLEET_JOURNAL_SHARDS;
+        if (loadFleet(FLEET_FILE, argc >= 4 ? atoi(argv[3]) : FLEET_DEFAULT_MACHINES) != 0) return 1;
+    }
+    if (startSystem() != 0) return 1;
+    int rc = 0;
+    if (fleetMode) {
+        pthread_rwlock_wrlock(&checkpointLock);
+        saveFleet(FLEET_FILE);
+        pthread_rwlock_unlock(&checkpointLock);
+        printf("Fleet of %d machine(s), %d journal shard(s).\n", fleetCount, jnlShardCount);
+        rc = runServer(atoi(argv[2]), argc >= 5 ? atoi(argv[4]) : 0) == 0 ? 0 : 1;
+    } else if (serve) {
+        rc = runServer(atoi(argv[2]), argc >= 4 ? atoi(argv[3]) : 0) == 0 ? 0 : 1;
+    } else if (batch) {
+        rc = runBatch(argv[2]) == 0 ? 0 : 1;
+    } else if (refill) {
+        rc = runRefillPlan(argc >= 3 ? atof(argv[2]) : FORECAST_CYCLE_HOURS) == 0 ? 0 : 1;
+    } else {
+        runConsole();
+    }
+    shutdownSystem();
+    return rc;
 }